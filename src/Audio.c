@@ -1,7 +1,7 @@
 #include <pthread.h>
 #include <stdlib.h> //rand_r
-#include <time.h> //nanosleep
-#include <sys/time.h> //struct timeval
+#include <stddef.h> //offsetof
+#include <time.h>
 #include <uuid/uuid.h>
 #include <opus/opus.h>
 
@@ -15,14 +15,152 @@
 #include "Config.h"
 #include "Recording.h"
 #include "StreamLobby.h"
+#include "WorkerPool.h"
+#include "Mixer.h"
+#include "Scheduler.h"
+#include "Rtcp.h"
+
+#define MIX_BUFFER_SIZE	(SETTINGS_MAX_FRAME_SIZE*SETTINGS_CHANNELS)
+#define PEER_BUFFER_FRAMES	20 //Ticks worth of audio a peer's buffer holds
+
+static worker_pool* decode_pool;
+static unsigned int decode_threads;
+static gint decode_affinity_counter;
+
+/* Listener quality tier. Listeners whose reports go over a tier's limits move down to the next one */
+typedef struct quality_tier {
+	int bitrate_percent; //Of the lobby profile's bitrate
+	int fec;
+	int loss_percent; //Loss the encoder expects, and spends bits protecting against
+	unsigned int max_loss; //Percent
+	unsigned int max_jitter; //Microseconds
+} quality_tier;
+
+static const quality_tier quality_tiers[SETTINGS_QUALITY_TIERS] = {
+	{100, 0,  0,   2,  30000},
+	{ 40, 1, 10,  10,  80000},
+	{ 15, 1, 25, 100, UINT_MAX},
+};
+static scheduler* mix_scheduler;
+static unsigned int mixer_threads;
+static worker_pool* submix_pool;
+static unsigned int submix_threads;
+static recorder* capture;
+static char capture_filename[256];
+
+static uint32_t audio_stream_ssrc(lobby*);
+
+/* Mix-minus stream of a peer that's speaking */
+typedef struct speaker_stream {
+	peer* dude; //Only compared against, the peer might be gone by the time the stream is released
+	OpusEncoder* encoder;
+	int tier; //Quality tier the encoder is set up for, -1 before it's first used
+	unsigned int hangover; //Ticks left before the encoder goes back to the pool
+} speaker_stream;
+
+/* A mixing thread's speaker streams and the encoders not in use by any of them */
+typedef struct speaker_streams {
+	speaker_stream streams[SETTINGS_MAX_SPEAKER_STREAMS];
+	unsigned int count;
+	OpusEncoder* pool[SETTINGS_MAX_SPEAKER_STREAMS];
+	unsigned int pool_count;
+} speaker_streams;
+
+static void speaker_streams_update(speaker_streams*, const audio_profile*, peer**, const unsigned char*, int*, unsigned int);
+static void speaker_streams_destroy(speaker_streams*);
+struct audio_mixer;
+static void audio_mixer_destroy(struct audio_mixer*);
+static void audio_send_sender_reports(struct audio_mixer*, peer**, unsigned int);
+struct mix_shard;
+static void audio_shard_accumulate(void*);
+static void audio_shard_send(void*);
+static void audio_run_shards(struct audio_mixer*, worker_task_fn);
+
+int audio_init()
+{
+	mixer_init();
+	if(recorder_init() != 0)
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't start the recording thread, lobbies won't be recorded\n");
+	JANUS_LOG(LOG_INFO, "[Stream Lobby] Using the %s mixing kernel\n", mixer_kernel_name());
+	if(capture_filename[0] != '\0')
+	{
+		capture = recorder_open(capture_filename, RECORDER_CAPTURE, SETTINGS_RTP_CLOCK_RATE, SETTINGS_CAPTURE_SLOTS, SETTINGS_PACKET_SLOT_SIZE);
+		if(capture == NULL)
+			JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't start capturing traffic to %s\n", capture_filename);
+		else
+			JANUS_LOG(LOG_INFO, "[Stream Lobby] Capturing traffic to %s\n", capture_filename);
+	}
+	decode_pool = worker_pool_create("decode", decode_threads);
+	if(decode_pool == NULL)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create audio decoding threads\n");
+		return 1;
+	}
+	mix_scheduler = scheduler_create("mixer", mixer_threads);
+	if(mix_scheduler == NULL)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create audio mixing threads\n");
+		return 2;
+	}
+	//Large lobbies can still be mixed without these, just on one thread each
+	submix_pool = worker_pool_create("submix", submix_threads);
+	if(submix_pool == NULL)
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't create submixing threads, large lobbies will be mixed on one thread\n");
+
+	//Lobbies from the config file were created before there was anything to mix them with
+	GList* items = lobbies_get_lobbies();
+	for(GList* item = items; item != NULL; item = item->next)
+	{
+		lobby* room = item->data;
+		if(room->audio_enabled && room->mix_task == NULL && audio_start_mixer(room) != 0)
+		{
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't start mixing audio for lobby \"%s\". Disabling audio.\n", room->name);
+			room->audio_enabled = 0;
+			room->audio_failed = 1;
+			lobbies_directory_changed(room);
+		}
+	}
+	g_list_free(items);
+	return 0;
+}
 
-unsigned int audio_mix_thread_count;
-pthread_mutex_t audio_mix_threads_mutex;
-pthread_cond_t audio_destroy_threads_cond;
+/* Lobbies' mixers have to be stopped first, they schedule decoding */
+int audio_shutdown()
+{
+	scheduler_destroy(mix_scheduler);
+	mix_scheduler = NULL;
+	worker_pool_destroy(submix_pool);
+	submix_pool = NULL;
+	worker_pool_destroy(decode_pool);
+	decode_pool = NULL;
+	recorder_close(&capture);
+	recorder_shutdown();
+	return 0;
+}
+
+/* 0 uses one decoding thread per core */
+void audio_set_decode_threads(unsigned int threads)
+{
+	decode_threads = threads;
+}
+
+/* 0 uses one mixing thread per core */
+void audio_set_mixer_threads(unsigned int threads)
+{
+	mixer_threads = threads;
+}
 
-static int max_sample_count = SETTINGS_OPUS_FRAME_SIZE*SETTINGS_CHANNELS*20;
-static struct timeval previous_rtp_time, previous_out_packet_time;
-static int threadinit_result;
+/* 0 uses one submixing thread per core */
+void audio_set_submix_threads(unsigned int threads)
+{
+	submix_threads = threads;
+}
+
+/* Capture every peer's incoming RTP to this file, for tools/replay.c. Empty to not capture */
+void audio_set_capture_file(const char* filename)
+{
+	snprintf(capture_filename, sizeof(capture_filename), "%s", filename);
+}
 
 void audio_setup_media(janus_plugin_session *handle)
 {
@@ -32,7 +170,16 @@ void audio_setup_media(janus_plugin_session *handle)
 	
 	peer* dude = handle->plugin_handle;
 	pthread_mutex_lock(&dude->mutex);
-		dude->buffer_head = dude->buffer_tail = dude->buffer_start = calloc(max_sample_count, sizeof(opus_int32));
+		//Audio is decoded at the rate the lobby mixes at, and buffered in its ticks
+		audio_profile profile;
+		if(dude->current_lobby != NULL)
+			profile = dude->current_lobby->profile;
+		else
+			audio_profile_defaults(&profile);
+		dude->sample_rate = profile.sample_rate;
+		dude->frame_size = profile.frame_size;
+		int buffer_samples = profile.frame_size*SETTINGS_CHANNELS*PEER_BUFFER_FRAMES;
+		dude->buffer_head = dude->buffer_tail = dude->buffer_start = calloc(buffer_samples, sizeof(opus_int32));
 		if(dude->buffer_head == NULL)
 		{
 			char id[37];
@@ -42,10 +189,32 @@ void audio_setup_media(janus_plugin_session *handle)
 			return;
 		}
 
-		dude->buffer_end = dude->buffer_start + max_sample_count;
+		dude->buffer_end = dude->buffer_start + buffer_samples;
+		if(jitter_buffer_init(&dude->packets, SETTINGS_JITTER_BUFFER_SLOTS) != 0)
+		{
+			char id[37];
+			uuid_unparse(dude->uuid, id);
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Unable to create jitter buffer for \"%s\" (%s)\n", dude->nick, id);
+			free(dude->buffer_start);
+			dude->buffer_head = dude->buffer_tail = dude->buffer_start = NULL;
+			pthread_mutex_unlock(&dude->mutex);
+			return;
+		}
+		//The packet pool sticks around until the session is destroyed
+		if(dude->pool.slabs == NULL && packet_pool_init(&dude->pool, SETTINGS_PACKET_POOL_SIZE, SETTINGS_PACKET_SLOT_SIZE) != 0)
+		{
+			char id[37];
+			uuid_unparse(dude->uuid, id);
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Unable to create packet pool for \"%s\" (%s)\n", dude->nick, id);
+			jitter_buffer_destroy(&dude->packets);
+			free(dude->buffer_start);
+			dude->buffer_head = dude->buffer_tail = dude->buffer_start = NULL;
+			pthread_mutex_unlock(&dude->mutex);
+			return;
+		}
 		//Decoder
 		int error = 0;
-		dude->decoder = opus_decoder_create(SETTINGS_SAMPLE_RATE, SETTINGS_CHANNELS, &error);
+		dude->decoder = opus_decoder_create(dude->sample_rate, SETTINGS_CHANNELS, &error);
 		if(error != OPUS_OK)
 		{
 			char id[37];
@@ -55,29 +224,31 @@ void audio_setup_media(janus_plugin_session *handle)
 		}
 		else
 		{
-			dude->comms_ready = 1;
-			int thread = pthread_create(&dude->decoder_thread, NULL, &peer_audio_thread, dude);
-			if(thread != 0)
+			g_atomic_int_set(&dude->speech_energy, 0);
+			g_atomic_int_set(&dude->mixed, 1);
+			g_atomic_int_set(&dude->quality_tier, 0);
+			dude->good_reports = 0;
+			memset(&dude->link, 0, offsetof(link_stats, packets_sent));
+			__atomic_store_n(&dude->link.packets_sent, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&dude->link.octets_sent, 0, __ATOMIC_RELAXED);
+			dude->link.rtt = -1;
+			g_atomic_int_set(&dude->comms_ready, 1);
+			dude->decode_affinity = g_atomic_int_add(&decode_affinity_counter, 1) & INT_MAX;
+			//Wake up the lobby's mixer if it was idle
+			dude->media_lobby = dude->current_lobby;
+			if(dude->media_lobby != NULL)
 			{
-				char id[37];
-				uuid_unparse(dude->uuid, id);
-				JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create audio decoder thread for \"%s\" (%s)\n", dude->nick, id);
-				switch(threadinit_result) {
-					case EAGAIN:
-						JANUS_LOG(LOG_ERR, "[Stream Lobby] EAGAIN - Insufficient resources OR a system-imposed thread limit was violated\n");
-						break;
-					case EINVAL:
-						JANUS_LOG(LOG_ERR, "[Stream Lobby] EINVAL - Invalid thread attributes\n");
-						break;
-					case EPERM:
-						JANUS_LOG(LOG_ERR, "[Stream Lobby] EPERM - No permission to set the scheduling policy and parameters specified in attr\n");
-						break;
-					default:
-						JANUS_LOG(LOG_ERR, "[Stream Lobby] Unknown error code for creating thread\n");
-						break;
+				g_atomic_int_inc(&dude->media_lobby->media_peers);
+				lobbies_publish_snapshot(dude->media_lobby);
+				audio_wake_mixer(dude->media_lobby);
+				if(g_atomic_pointer_get(&capture) != NULL)
+				{
+					unsigned char media[2+256];
+					media[0] = dude->opus_pt;
+					media[1] = dude->audio_level_ext_id;
+					int length = snprintf((char*) media+2, 256, "%s", dude->media_lobby->name);
+					recorder_write(&capture, dude->capture_id, CAPTURE_MEDIA, media, 2 + MIN(length, 255));
 				}
-				opus_decoder_destroy(dude->decoder);
-				dude->comms_ready = 0;
 			}
 		}
 	pthread_mutex_unlock(&dude->mutex);
@@ -99,19 +270,27 @@ void audio_hangup_media_no_lock(janus_plugin_session *handle)
 {
 	JANUS_LOG(LOG_DBG, "hangup_media_no_lock start\n");
 	peer* dude = handle->plugin_handle;
-	dude->comms_ready = 0;
+	lobby* room = g_atomic_int_get(&dude->comms_ready) ? dude->media_lobby : NULL;
+	dude->media_lobby = NULL;
+	g_atomic_int_set(&dude->comms_ready, 0);
+	if(room != NULL)
+	{
+		g_atomic_int_add(&room->media_peers, -1);
+		lobbies_publish_snapshot(room);
+		recorder_write(&capture, dude->capture_id, CAPTURE_HANGUP, "", 0);
+	}
+	//Wait for any decoding in progress, the decoder and buffers are about to go away
+	while(dude->decode_scheduled)
+		pthread_cond_wait(&dude->decode_cond, &dude->mutex);
 	free(dude->buffer_start);
 	dude->buffer_head = dude->buffer_tail = dude->buffer_start = dude->buffer_end = NULL;
 	dude->sample_count = 0;
 	opus_decoder_destroy(dude->decoder);
 	dude->decoder = NULL;
-	while(dude->packets != NULL)
-	{
-		rtp_wrapper* packet = dude->packets->data;
-		dude->packets = g_list_remove(dude->packets, packet);
-		free(packet->data);
-		free(packet);
-	}
+	rtp_wrapper* packet;
+	while((packet = jitter_buffer_drain(&dude->packets)) != NULL)
+		packet_pool_release(&dude->pool, packet);
+	jitter_buffer_destroy(&dude->packets);
 }
 
 
@@ -123,15 +302,14 @@ void audio_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int
 		return;
 
 	peer* dude = handle->plugin_handle;
+	if(!g_atomic_int_get(&dude->comms_ready))
+	{
+		char id[37];
+		uuid_unparse(dude->uuid, id);
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] RTP packed recieved after hangup_media() for \"%s\" (%s)\n", dude->nick, id);
+		return;
+	}
 	pthread_mutex_lock(&dude->mutex);
-		if(!dude->comms_ready)
-		{
-			char id[37];
-			uuid_unparse(dude->uuid, id);
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] RTP packed recieved after hangup_media() for \"%s\" (%s)\n", dude->nick, id);
-			pthread_mutex_unlock(&dude->mutex);
-			return;
-		}
 		lobby* room = dude->current_lobby;
 		if(room == NULL)
 		{
@@ -140,31 +318,14 @@ void audio_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int
 			return;
 		}
 	pthread_mutex_unlock(&dude->mutex);
+	//Traffic capture, before anything's made of the packet so replays go through the same checks
+	recorder_write(&capture, dude->capture_id, CAPTURE_RTP, buf, len);
 
 	//Get packet info
-	rtp_wrapper* input_packet = malloc(sizeof(rtp_wrapper));
-	input_packet->data = malloc(len);
-	memcpy(input_packet->data, buf, len);
-	rtp_header* pkt = input_packet->data;
-	input_packet->data = pkt;
-	input_packet->timestamp = ntohl(pkt->timestamp);
-	input_packet->seq_number = ntohs(pkt->seq_number);
-	input_packet->length = len;
-	input_packet->ssrc = pkt->ssrc;
-	int difference = 0;
-	struct timeval rec_time;
-	gettimeofday(&rec_time, NULL);
-	if(previous_rtp_time.tv_sec != 0)
-	{
-		difference = rec_time.tv_usec;
-		if(rec_time.tv_sec > previous_rtp_time.tv_sec)
-			difference += 1000000*(rec_time.tv_sec-previous_rtp_time.tv_sec);
-		difference -= previous_rtp_time.tv_usec;
-	}
-	previous_rtp_time.tv_sec = rec_time.tv_sec;
-	previous_rtp_time.tv_usec = rec_time.tv_usec;
-
-	JANUS_LOG(LOG_DBG, "Session: %d, RTP Packet #%u, Packet Timestamp: %u, Unix Timestamp: %u.%.6d, Time since last packet: %uus\n", handle, input_packet->seq_number, input_packet->timestamp, rec_time.tv_sec, rec_time.tv_usec, difference);
+	rtp_header* pkt = (rtp_header*) buf;
+	uint32_t timestamp = ntohl(pkt->timestamp);
+	uint16_t seq_number = ntohs(pkt->seq_number);
+	gint64 arrival = janus_get_monotonic_time();
 	
 	opus_int32 plen = 0;
 	const unsigned char* payload = (const unsigned char *) janus_rtp_payload(buf, len, &plen);
@@ -174,15 +335,12 @@ void audio_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int
 		return;
 	}
 
-	//OGG recording code block
+	//OGG recording code block, queued for the recording thread
 	//************************
-	ogg_packet* op = op_from_pkt(payload, plen);
-	op->granulepos = SETTINGS_OPUS_FRAME_SIZE*ntohs(input_packet->seq_number);
-	ogg_stream_packetin(room->in_ss, op);
-	free(op);
-	ogg_write(room, 'i');
+	recorder_write(&room->track_recorder, ntohl(pkt->ssrc), timestamp, payload, plen);
 	//************************
 
+#ifdef DEBUG
 	//Get opus info
 	uint8_t toc, pkt_configuration = 0, stereo = 0, frame_count = 0;
 	memcpy(&toc, payload, 1);
@@ -206,17 +364,17 @@ void audio_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int
 			JANUS_LOG(LOG_DBG, "opus_packet_get_nb_frames: %d frame(s)\n", ret);
 		break;
 	}
-	ret = opus_decoder_get_nb_samples(dude->decoder, payload, plen);
+	ret = opus_packet_get_nb_samples(payload, plen, room->profile.sample_rate);
 	switch(ret)
 	{
 		case OPUS_BAD_ARG:
-			JANUS_LOG(LOG_DBG, "opus_decoder_get_nb_samples: OPUS_BAD_ARG\n");
+			JANUS_LOG(LOG_DBG, "opus_packet_get_nb_samples: OPUS_BAD_ARG\n");
 		break;
 		case OPUS_INVALID_PACKET:
-			JANUS_LOG(LOG_DBG, "opus_decoder_get_nb_samples: OPUS_INVALID_PACKET\n");
+			JANUS_LOG(LOG_DBG, "opus_packet_get_nb_samples: OPUS_INVALID_PACKET\n");
 		break;
 		default:
-			JANUS_LOG(LOG_DBG, "opus_decoder_get_nb_samples: %d\n", ret);
+			JANUS_LOG(LOG_DBG, "opus_packet_get_nb_samples: %d\n", ret);
 		break;
 	}
 	ret = opus_packet_get_bandwidth(payload);
@@ -242,436 +400,760 @@ void audio_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int
 		break;
 	}
 	JANUS_LOG(LOG_DBG, "opus_packet_get_nb_channels: %d\n", opus_packet_get_nb_channels(payload));
+#endif
+
+	//Silent packets still go through the jitter buffer, they just don't get decoded
+	int audio_level = -1;
+	int silent = audio_packet_is_dtx(payload, plen);
 
-	//Discard packet if it's too old, add it to the peer's audio queue if it isn't
+	//Discard packet if it's too old, add it to the peer's jitter buffer if it isn't
 	pthread_mutex_lock(&dude->mutex);
-		dude->packets = g_list_insert_sorted(dude->packets, input_packet, &audio_packet_sort);
-		if(dude->sample_count == 0)
-			dude->next_seq_num = input_packet->seq_number;
+		if(!g_atomic_int_get(&dude->comms_ready))
+		{
+			pthread_mutex_unlock(&dude->mutex);
+			return;
+		}
+		rtp_wrapper* input_packet = packet_pool_alloc(&dude->pool, len);
+		if(input_packet == NULL)
+		{
+			pthread_mutex_unlock(&dude->mutex);
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Memory allocation failure, dropping RTP packet\n");
+			return;
+		}
+		memcpy(input_packet->data, buf, len);
+		input_packet->timestamp = timestamp;
+		input_packet->seq_number = seq_number;
+		input_packet->length = len;
+		input_packet->ssrc = pkt->ssrc;
+		if(dude->audio_level_ext_id > 0 && audio_parse_audio_level(buf, len, dude->audio_level_ext_id, &audio_level) == 0)
+		{
+			dude->audio_level = audio_level;
+			if(audio_level >= SETTINGS_SILENCE_AUDIO_LEVEL)
+				silent = 1;
+		}
+		input_packet->audio_level = audio_level;
+		input_packet->silent = silent;
+		//The mixer decays this every tick, so peers that stop sending fade out too
+		g_atomic_int_add(&dude->speech_energy, audio_packet_loudness(audio_level, plen, silent));
+		gint64 difference = dude->packets.last_arrival ? arrival - dude->packets.last_arrival : 0;
+		jitter_buffer_update_jitter(&dude->packets, timestamp, arrival, SETTINGS_RTP_CLOCK_RATE);
+		JANUS_LOG(LOG_DBG, "Session: %p, RTP Packet #%u, Packet Timestamp: %u, Time since last packet: %"SCNi64"us, Jitter: %uus\n", handle, seq_number, timestamp, difference, jitter_buffer_get_jitter(&dude->packets, SETTINGS_RTP_CLOCK_RATE));
+		int result = jitter_buffer_insert(&dude->packets, input_packet);
+		if(result == JITTER_BUFFER_TOO_FAR_AHEAD)
+		{
+			//Peer's stream jumped ahead of everything we're holding on to, start over from this packet
+			rtp_wrapper* stale;
+			while((stale = jitter_buffer_drain(&dude->packets)) != NULL)
+				packet_pool_release(&dude->pool, stale);
+			result = jitter_buffer_insert(&dude->packets, input_packet);
+		}
+		if(result != JITTER_BUFFER_INSERTED)
+		{
+			JANUS_LOG(LOG_DBG, "[Stream Lobby] Discarding late or duplicate packet. Seq num: %u\n", seq_number);
+			packet_pool_release(&dude->pool, input_packet);
+		}
+		else
+			audio_schedule_decode(dude);
 	pthread_mutex_unlock(&dude->mutex);
 }
 void audio_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len)
 {
 	if(handle == NULL || handle->stopped || handle->plugin_handle == NULL || stream_lobby_is_stopping() || !stream_lobby_is_initialized())
 		return;
-	//TODO - The plugin I'm basing this one from didn't do anything here. Going to have to look into rtcp
+	if(video)
+		return;
+	rtcp_report_block block;
+	rtcp_sender_info sender;
+	int have_sender = rtcp_get_sender_info(buf, len, &sender) == 0;
+	uint64_t arrival = rtcp_ntp_time(janus_get_real_time());
+
+	peer* dude = handle->plugin_handle;
+	pthread_mutex_lock(&dude->mutex);
+		if(!g_atomic_int_get(&dude->comms_ready) || dude->current_lobby == NULL || dude->current_lobby->mixer == NULL)
+		{
+			pthread_mutex_unlock(&dude->mutex);
+			return;
+		}
+		//Only the block about the lobby's stream says anything about how it reaches the listener
+		int have_block = rtcp_get_report_block(buf, len, audio_stream_ssrc(dude->current_lobby), &block) == 0;
+		if(have_sender)
+		{
+			dude->link.sender_ntp = sender.ntp;
+			dude->link.sender_rtp_timestamp = sender.rtp_timestamp;
+			dude->link.sender_packets = sender.packets;
+			dude->link.sender_octets = sender.octets;
+		}
+		if(have_block)
+		{
+			dude->link.fraction_lost = block.fraction_lost*100/256;
+			dude->link.cumulative_lost = block.cumulative_lost;
+			dude->link.jitter = (guint64) block.jitter*G_USEC_PER_SEC/SETTINGS_RTP_CLOCK_RATE;
+			gint64 rtt = rtcp_round_trip_time(arrival, &block);
+			if(rtt >= 0)
+				dude->link.rtt = rtt;
+			dude->link.reports++;
+			//Listeners' reception reports about the lobby's stream pick the quality tier they're sent
+			audio_update_quality_tier(dude, dude->link.fraction_lost, dude->link.jitter);
+		}
+	pthread_mutex_unlock(&dude->mutex);
 }
 
 
 
 
 /*
- * Per-peer audio decoding thread
- * FIXME - Try to make this cleaner and cut down on the mutex locking
+ * Queue a decoding task for the peer, unless one is already pending
+ * Only one task per peer is ever queued or running, so a decoder is only used by one worker at a time
+ * Peer's mutex must be locked
  */
-void* peer_audio_thread(void* data)
+void audio_schedule_decode(peer* dude)
 {
-	if(data == NULL)
-	{
-		JANUS_LOG(LOG_ERR, "[Stream Lobby] No data for peer audio thread");
-		return NULL;
-	}
-	peer* dude = data;
-	struct timespec sleep_ln;
-	sleep_ln.tv_sec = 0;
-	sleep_ln.tv_nsec = 1000000; // 1ms
-	g_atomic_int_inc(&audio_mix_thread_count);
+	if(dude->decode_scheduled || !g_atomic_int_get(&dude->comms_ready) || dude->packets.count == 0)
+		return;
+	dude->decode_scheduled = 1;
+	if(worker_pool_submit(decode_pool, &audio_decode_task, dude, dude->decode_affinity) != 0)
+		dude->decode_scheduled = 0;
+}
 
-	while(stream_lobby_is_initialized() && !stream_lobby_is_stopping())
-	{
-		pthread_mutex_lock(&dude->mutex);
-			if(!dude->comms_ready)
-			{
-				pthread_mutex_unlock(&dude->mutex);
-				break;
-			}
-			if(dude->packets == NULL)
-			{
-				pthread_mutex_unlock(&dude->mutex);
-				nanosleep(&sleep_ln, NULL);
-				continue;
-			}
-			rtp_wrapper* packet = dude->packets->data;
-			if(dude->next_seq_num == packet->seq_number)
+/*
+ * Per-peer audio decoding task, run by the decoding workers
+ * Decodes everything in the peer's jitter buffer that fits into the peer's audio buffer
+ */
+void audio_decode_task(void* data)
+{
+	peer* dude = data;
+	opus_int16 pcm[SETTINGS_RAW_BUFFER_SIZE*SETTINGS_CHANNELS];
+	pthread_mutex_lock(&dude->mutex);
+		while(g_atomic_int_get(&dude->comms_ready) && dude->packets.count > 0)
+		{
+			rtp_wrapper* packet = jitter_buffer_peek(&dude->packets);
+			int samples;
+			if(packet != NULL)
 			{
 				opus_int32 plen = 0;
 				const unsigned char* payload = (const unsigned char *) janus_rtp_payload((char*) packet->data, packet->length, &plen);
 				if(payload == NULL)
 				{
 					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error accessing the RTP payload\n");
-					dude->packets = g_list_remove(dude->packets, packet);
-					free(packet->data);
-					free(packet);
+					jitter_buffer_pop(&dude->packets);
+					packet_pool_release(&dude->pool, packet);
+					continue;
 				}
-				//Only decode audio if there's enough free space in the peer's buffer
-				if(payload != NULL && opus_decoder_get_nb_samples(dude->decoder, payload, plen) > max_sample_count - dude->sample_count)
+				//Only decode audio if there's enough free space in the peer's buffer, the mixer will reschedule us
+				if(opus_decoder_get_nb_samples(dude->decoder, payload, plen) > (dude->buffer_end - dude->buffer_start) - dude->sample_count)
 				{
 					char id[37];
 					uuid_unparse(dude->uuid, id);
 					JANUS_LOG(LOG_VERB, "[Stream Lobby] Buffer full for \"%s\" (%s). Waiting to decode audio.\n", dude->nick, id);
-					pthread_mutex_unlock(&dude->mutex);
-					nanosleep(&sleep_ln, NULL);
+					break;
+				}
+				jitter_buffer_pop(&dude->packets);
+				if(packet->silent || !g_atomic_int_get(&dude->mixed))
+				{
+					//Nothing worth hearing or not one of the lobby's loudest speakers, don't spend any time decoding or mixing it
+					dude->decodes_skipped++;
+					dude->decoder_idle = 1;
+					packet_pool_release(&dude->pool, packet);
 					continue;
 				}
-				dude->packets = g_list_remove(dude->packets, packet);
+				int resume = dude->decoder_idle;
+				dude->decoder_idle = 0;
+				dude->decodes++;
 				pthread_mutex_unlock(&dude->mutex);
 
-				opus_int16 pcm[SETTINGS_RAW_BUFFER_SIZE*SETTINGS_CHANNELS];
-				int samples = opus_decode(dude->decoder, payload, plen, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
-				if(samples < 0 && payload != NULL)
+				if(resume)
 				{
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error decoding Opus frame. Err no. %d (%s)\n", samples, opus_strerror(samples));
-					//TODO - Should ask around if it's a good idea to treat this as a missing packet in the event of a decoding error
-					samples = opus_decode(dude->decoder, NULL, 0, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
+					//Let the decoder conceal the frames it never saw, so it doesn't pick up where it left off
+					opus_decode(dude->decoder, NULL, 0, pcm, dude->frame_size, 0);
 				}
+				samples = opus_decode(dude->decoder, payload, plen, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
 				if(samples < 0)
 				{
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error compensating for missing audio\n");
-					pthread_mutex_lock(&dude->mutex);
-				}
-				else
-				{
-					pthread_mutex_lock(&dude->mutex);
-					int prev_sample_count = dude->sample_count;
-					switch(add_peer_audio(dude, pcm, samples))
-					{
-						case -1:
-							JANUS_LOG(LOG_ERR, "[Stream Lobby] Peer's audio buffer is full, could not add audio\n");
-							break;
-
-						case 0:
-							if(prev_sample_count == 0)
-								gettimeofday(&dude->buffering_start, NULL);
-							break;
-
-						default:
-						{
-							char id[37];
-							uuid_unparse(dude->uuid, id);
-							JANUS_LOG(LOG_WARN, "[Stream Lobby] Some audio data couldn't be added to \"%s\"'s (%s) buffer\n", dude->nick, id);
-							break;
-						}
-					}
+					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error decoding Opus frame. Err no. %d (%s)\n", samples, opus_strerror(samples));
+					//TODO - Should ask around if it's a good idea to treat this as a missing packet in the event of a decoding error
+					samples = opus_decode(dude->decoder, NULL, 0, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
 				}
-				if(dude->next_seq_num == 65535)
-					dude->next_seq_num = 0;
-				else
-					dude->next_seq_num++;
-				free(packet->data);
-				free(packet);
+				pthread_mutex_lock(&dude->mutex);
+				packet_pool_release(&dude->pool, packet);
 			}
-			else if(packet->seq_number < dude->next_seq_num && abs(packet->seq_number - dude->next_seq_num) > 5)
+			else
 			{
-				//Discard old packet
-				dude->packets = g_list_remove(dude->packets, packet);
-				char id[37];
-				uuid_unparse(dude->uuid, id);
-				JANUS_LOG(LOG_DBG, "[Stream Lobby] Discarding old packet for \"%s\" (%s). Seq num: %d, peer's next seq num: %d\n", dude->nick, id, packet->seq_number, dude->next_seq_num);
-				free(packet->data);
-				free(packet);
+				//Next packet hasn't arrived but later ones have, so conceal the missing one once the peer's audio runs low
+				if(dude->sample_count >= dude->frame_size*SETTINGS_CHANNELS)
+					break;
+				jitter_buffer_skip(&dude->packets);
+				pthread_mutex_unlock(&dude->mutex);
+				samples = opus_decode(dude->decoder, NULL, 0, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
+				pthread_mutex_lock(&dude->mutex);
 			}
-			else
+
+			if(samples < 0)
 			{
-				//First packet in queue is a future packet, so we're still waiting on the peer's next packet
-				opus_int32 plen = 0;
-				const unsigned char* payload = (const unsigned char *) janus_rtp_payload((char*)packet->data, packet->length, &plen);
-				if(payload == NULL)
-				{
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error accessing the RTP payload\n");
-				}
-				if(dude->sample_count < SETTINGS_OPUS_FRAME_SIZE*SETTINGS_CHANNELS)
-				{
-					pthread_mutex_unlock(&dude->mutex);
-					opus_int16 pcm[SETTINGS_RAW_BUFFER_SIZE*SETTINGS_CHANNELS];
-					int samples = opus_decode(dude->decoder, NULL, 0, pcm, SETTINGS_RAW_BUFFER_SIZE, 0);
-					if(samples < 0)
-					{
-						JANUS_LOG(LOG_ERR, "[Stream Lobby] Error compensating for missing audio\n");
-						pthread_mutex_lock(&dude->mutex);
-					}
-					else
+				JANUS_LOG(LOG_ERR, "[Stream Lobby] Error compensating for missing audio\n");
+				continue;
+			}
+			int prev_sample_count = dude->sample_count;
+			switch(add_peer_audio(dude, pcm, samples))
+			{
+				case -1:
+					JANUS_LOG(LOG_ERR, "[Stream Lobby] Peer's audio buffer is full, could not add audio\n");
+					break;
+
+				case 0:
+					if(prev_sample_count == 0)
 					{
-						pthread_mutex_lock(&dude->mutex);
-						//int prev_sample_count = dude->sample_count;
-						switch(add_peer_audio(dude, pcm, samples))
-						{
-							case -1:
-								JANUS_LOG(LOG_ERR, "[Stream Lobby] Peer's audio buffer is full, could not add audio\n");
-								break;
-
-							case 0:
-								break;
-
-							default:
-							{
-								char id[37];
-								uuid_unparse(dude->uuid, id);
-								JANUS_LOG(LOG_WARN, "[Stream Lobby] Some audio data couldn't be added to \"%s\"'s (%s) buffer\n", dude->nick, id);
-								break;
-							}
-						}
+						//Start of a talk spurt, pick the play out delay for it
+						dude->buffering_start = janus_get_monotonic_time();
+						dude->playout_delay = audio_get_playout_delay(dude);
 					}
-					if(dude->next_seq_num == 65535)
-						dude->next_seq_num = 0;
-					else
-						dude->next_seq_num++;
+					break;
+
+				default:
+				{
+					char id[37];
+					uuid_unparse(dude->uuid, id);
+					JANUS_LOG(LOG_WARN, "[Stream Lobby] Some audio data couldn't be added to \"%s\"'s (%s) buffer\n", dude->nick, id);
+					break;
 				}
 			}
-		pthread_mutex_unlock(&dude->mutex);
-		nanosleep(&sleep_ln, NULL);
-	}
-
-	g_atomic_int_dec_and_test(&audio_mix_thread_count);
-	pthread_mutex_lock(&audio_mix_threads_mutex);
-		if(stream_lobby_is_stopping() && g_atomic_int_get(&audio_mix_thread_count) == 0)
-			pthread_cond_signal(&audio_destroy_threads_cond);
-	pthread_mutex_unlock(&audio_mix_threads_mutex);
-	return NULL;
+		}
+		dude->decode_scheduled = 0;
+		pthread_cond_broadcast(&dude->decode_cond);
+	pthread_mutex_unlock(&dude->mutex);
 }
 
 
+#define MIX_FANOUT_SIZE	(SETTINGS_MAX_PAYLOAD_TYPES*SETTINGS_QUALITY_TIERS)
+
 /*
- * Per-lobby audio mixing thread
+ * Slice of a lobby's participants, mixed and sent to by one worker
+ * Lobbies under their submix threshold only have the one, run on the mixing thread
  */
-void* audio_mix_thread(void* data)
+typedef struct mix_shard {
+	struct audio_mixer* mixer;
+	worker_task_fn fn; //What the shard does in the current step of the tick
+	unsigned int first, last; //Participants [first, last) of this tick's snapshot
+	unsigned int skipped; //Participants in the shard that aren't in this tick's mix
+	//Buffers
+	opus_int32 bus[MIX_BUFFER_SIZE]; //Sum of the shard's participants
+	opus_int32 tmp_buffer[MIX_BUFFER_SIZE];
+	opus_int16 output_buffer[MIX_BUFFER_SIZE];
+	//Packets
+	char* packet_data;
+	rtp_header* fanout[MIX_FANOUT_SIZE]; //Copies of the tiers' packets for each payload type the shard's participants negotiated
+	int fanout_pt[MIX_FANOUT_SIZE];
+	int fanout_tier[MIX_FANOUT_SIZE];
+	unsigned int fanout_count;
+	rtp_header* overflow; //For listeners whose tier and payload type didn't get a copy
+	rtp_header* speaker_payload;
+} mix_shard;
+
+/*
+ * Per-lobby audio mixer, ticked every ptime by the mixing scheduler
+ */
+typedef struct audio_mixer {
+	lobby* room;
+	unsigned char* buffering; //Peer is still building up their play out delay, leave their audio be
+	unsigned char* contributed; //Peer's audio is in this tick's mix
+	int* mixed_samples; //How much of the peer's audio went into it, which is what's taken out of their buffer
+	int* speaker_of; //Peer's mix-minus stream, -1 if they get the shared mix
+	unsigned char* tier_of; //Peer's quality tier for this tick
+	speaker_streams speakers;
+	OpusEncoder* encoders[SETTINGS_QUALITY_TIERS]; //Shared encoder for each tier, the first is the lobby's own
+	//Shards
+	mix_shard* shards;
+	unsigned int shard_capacity, shard_count; //Allocated, and used this tick
+	unsigned int shards_pending;
+	pthread_mutex_t shard_mutex;
+	pthread_cond_t shard_cond; //Signalled when the last shard running on a worker finishes
+	peer** participants; //This tick's, for the shards
+	unsigned int peer_count;
+	//Buffers
+	opus_int16 output_buffer[MIX_BUFFER_SIZE]; //The mix is the first shard's bus, once the others are added to it
+	//Packets
+	rtp_wrapper output_packet; //Top tier's packet, the one that's recorded
+	char* packet_data;
+	rtp_header* tier_payload[SETTINGS_QUALITY_TIERS];
+	int tier_length[SETTINGS_QUALITY_TIERS]; //Including the header, -1 if the tier wasn't encoded this tick
+	//RTP
+	uint32_t ssrc;
+	uint16_t seq; //Of the last packet sent, DTX ticks don't use one up
+	uint32_t ts;
+	int sending; //Whether this tick's packets go out, they don't while the whole lobby is in DTX
+	gint64 previous_send;
+	gint64 last_sender_report;
+	//Recording
+	struct recorder* wav_recorder;
+} audio_mixer;
+
+/* SSRC of the lobby's outgoing stream. Lobby has to have a mixer */
+static uint32_t audio_stream_ssrc(lobby* room)
 {
-	if(data == NULL)
+	return room->mixer->ssrc;
+}
+
+static audio_mixer* audio_mixer_create(lobby* room)
+{
+	audio_mixer* mixer = calloc(1, sizeof(audio_mixer));
+	if(mixer == NULL)
+		return NULL;
+	mixer->room = room;
+	mixer->buffering = calloc(room->max_clients, 1);
+	mixer->contributed = calloc(room->max_clients, 1);
+	mixer->mixed_samples = calloc(room->max_clients, sizeof(int));
+	mixer->speaker_of = calloc(room->max_clients, sizeof(int));
+	mixer->tier_of = calloc(room->max_clients, 1);
+	//One shared packet per tier
+	mixer->packet_data = calloc(SETTINGS_QUALITY_TIERS, SETTINGS_OUTPUT_BUFFER_SIZE);
+	//Enough shards to split the lobby at its fullest
+	mixer->shard_capacity = 1;
+	if(room->submix_threshold > 0)
+		mixer->shard_capacity = (room->max_clients + room->submix_threshold - 1)/room->submix_threshold;
+	if(mixer->shard_capacity > SETTINGS_MAX_SUBMIX_SHARDS)
+		mixer->shard_capacity = SETTINGS_MAX_SUBMIX_SHARDS;
+	if(mixer->shard_capacity < 1)
+		mixer->shard_capacity = 1;
+	mixer->shards = calloc(mixer->shard_capacity, sizeof(mix_shard));
+	pthread_mutex_init(&mixer->shard_mutex, NULL);
+	pthread_cond_init(&mixer->shard_cond, NULL);
+	if(mixer->buffering == NULL || mixer->contributed == NULL || mixer->mixed_samples == NULL || mixer->speaker_of == NULL || mixer->tier_of == NULL || mixer->packet_data == NULL || mixer->shards == NULL)
 	{
-		JANUS_LOG(LOG_ERR, "[Stream Lobby] No lobby, abandoning mixing thread!\n");
+		audio_mixer_destroy(mixer);
 		return NULL;
 	}
-	
-	lobby* room = data;
-	if(room->encoder == NULL)
+	for(int i = 0; i < SETTINGS_QUALITY_TIERS; i++)
+		mixer->tier_payload[i] = (rtp_header*)(mixer->packet_data + i*SETTINGS_OUTPUT_BUFFER_SIZE);
+	mixer->output_packet.data = mixer->tier_payload[0];
+	for(unsigned int i = 0; i < mixer->shard_capacity; i++)
 	{
-		JANUS_LOG(LOG_ERR, "[Stream Lobby] Lobby \"%s\" has no Opus encoder, abandoning mixing thread!\n", room->name);
-		return NULL;
+		//Copies of the tiers' packets, the overflow packet and the mix-minus packet
+		mix_shard* shard = &mixer->shards[i];
+		shard->mixer = mixer;
+		shard->packet_data = calloc(MIX_FANOUT_SIZE+2, SETTINGS_OUTPUT_BUFFER_SIZE);
+		if(shard->packet_data == NULL)
+		{
+			audio_mixer_destroy(mixer);
+			return NULL;
+		}
+		for(int j = 0; j < MIX_FANOUT_SIZE; j++)
+			shard->fanout[j] = (rtp_header*)(shard->packet_data + j*SETTINGS_OUTPUT_BUFFER_SIZE);
+		shard->overflow = (rtp_header*)(shard->packet_data + MIX_FANOUT_SIZE*SETTINGS_OUTPUT_BUFFER_SIZE);
+		shard->speaker_payload = (rtp_header*)(shard->packet_data + (MIX_FANOUT_SIZE+1)*SETTINGS_OUTPUT_BUFFER_SIZE);
+	}
+
+	mixer->encoders[0] = room->encoder;
+	for(int i = 1; i < SETTINGS_QUALITY_TIERS; i++)
+	{
+		mixer->encoders[i] = audio_create_encoder(&room->profile);
+		if(mixer->encoders[i] == NULL)
+		{
+			audio_mixer_destroy(mixer);
+			return NULL;
+		}
+		audio_apply_quality_tier(mixer->encoders[i], &room->profile, i);
 	}
 
 	//OGG recording code block
 	//****************************
-		char in_fname[261] = {0};
-		snprintf(in_fname, 261, "/var/streamlobby/%s_input.ogg", room->name);
-		/*input ogg file*/
-		//room->in_file = fopen(in_fname, "wb");
-		if(room->in_file)
+		/*multitrack ogg file, a new one every time the lobby starts mixing*/
+		if(room->record_tracks)
 		{
-			room->in_ss = malloc(sizeof(ogg_stream_state));
-			if(ogg_stream_init(room->in_ss, 1) < 0) return NULL;
-			ogg_packet* op = op_opushead();
-			ogg_stream_packetin(room->in_ss, op);
-			op_free(op);
-			op = op_opustags();
-			ogg_stream_packetin(room->in_ss, op);
-			op_free(op);
-			ogg_flush(room, 'i');
+			char tracks_fname[300] = {0};
+			snprintf(tracks_fname, 300, "/var/streamlobby/%s_%"SCNi64"_tracks.opus", room->name, (gint64) time(NULL));
+			recorder* tracks = recorder_open(tracks_fname, RECORDER_OGG, SETTINGS_RTP_CLOCK_RATE, SETTINGS_RECORDER_INPUT_SLOTS, SETTINGS_PACKET_SLOT_SIZE);
+			//Incoming RTP picks it up from here on
+			g_atomic_pointer_set(&room->track_recorder, tracks);
+			if(tracks == NULL)
+				JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't open %s, lobby \"%s\" won't be recorded\n", tracks_fname, room->name);
 		}
 
-
 		char out_fname[261] = {0};
 		snprintf(out_fname, 261, "/var/streamlobby/%s_output.ogg", room->name);
 		/*output ogg file*/
-		//room->out_file = fopen(out_fname, "wb");
-		if(room->out_file)
-		{
-			room->out_ss = malloc(sizeof(ogg_stream_state));
-			if(ogg_stream_init(room->out_ss, 1) < 0) return NULL;
-			ogg_packet* op = op_opushead();
-			ogg_stream_packetin(room->out_ss, op);
-			op_free(op);
-			op = op_opustags();
-			ogg_stream_packetin(room->out_ss, op);
-			op_free(op);
-			ogg_flush(room, 'o');
-		}
+		//room->out_recorder = recorder_open(out_fname, RECORDER_OGG, room->profile.sample_rate, SETTINGS_RECORDER_SLOTS, SETTINGS_OUTPUT_BUFFER_SIZE);
 	//****************************
 
-	peer* participants_list[room->max_clients];
-	memset(participants_list, 0, sizeof(peer*) * room->max_clients);
-	unsigned int peer_count = 0, peers_skipped = 0;
-
-	//Buffers
-	int buffer_size = SETTINGS_OPUS_FRAME_SIZE*SETTINGS_CHANNELS;
-	opus_int32 mix_buffer[buffer_size], tmp_buffer[buffer_size];
-	opus_int16 output_buffer[buffer_size];
-	memset(mix_buffer, 0, buffer_size*sizeof(opus_int32));
-	memset(tmp_buffer, 0, buffer_size*sizeof(opus_int32));
-	memset(output_buffer, 0, buffer_size*sizeof(opus_int16));
-	//Packets
-	rtp_wrapper* output_packet = calloc(1, sizeof(rtp_wrapper));
-	if(output_packet == NULL)
-	{
-		JANUS_LOG(LOG_ERR, "[Stream Lobby] Memory allocation failure, abandoning mixing thread!\n");
-		return NULL;
-	}
-	output_packet->data = calloc(1, SETTINGS_OUTPUT_BUFFER_SIZE);
-	if(output_packet->data == NULL) {
-		JANUS_LOG(LOG_FATAL, "Memory allocation failure, abandoning mixing thread!\n");
-		free(output_packet);
-		return NULL;
-	}
-	rtp_header* payload = (rtp_header*)output_packet->data;
-	//Timer
-	struct timeval now, before;
-	struct timespec sleep_ln;
-	sleep_ln.tv_sec = 0;
-	sleep_ln.tv_nsec = 1000000; // 1ms
-	time_t passed, d_s, d_us;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
 	//RTP
-	uint16_t seq;
-	uint32_t ts;
 	unsigned int seedp = time(NULL);
-
-	seq = rand_r(&seedp) % RAND_MAX + 1;
-	ts = rand_r(&seedp) % RAND_MAX + 1;
+	mixer->seq = rand_r(&seedp) % RAND_MAX + 1;
+	mixer->ts = rand_r(&seedp) % RAND_MAX + 1;
+	mixer->ssrc = rand_r(&seedp);
+	rtp_header* payload = mixer->output_packet.data;
 	payload->version = 2;
+	payload->ssrc = htonl(mixer->ssrc);
 	payload->markerbit = 1;
 
 	//Wav file stuff
 	char wav_fname[261] = {0};
 	snprintf(wav_fname, 261, "/var/streamlobby/%s_output.wav", room->name);
-	FILE* wavFile = wav_file_init(wav_fname);
-	gint64 record_lastupdate = janus_get_monotonic_time();
+	mixer->wav_recorder = recorder_open(wav_fname, RECORDER_WAV, room->profile.sample_rate, SETTINGS_RECORDER_SLOTS, MIX_BUFFER_SIZE*sizeof(opus_int16));
+	return mixer;
+}
 
-	g_atomic_int_inc(&audio_mix_thread_count);
-	JANUS_LOG(LOG_INFO, "Audio mixing thread started for lobby \"%s\"\n", room->name);
+static void audio_mixer_destroy(audio_mixer* mixer)
+{
+	if(mixer == NULL)
+		return;
+	lobby* room = mixer->room;
+	speaker_streams_destroy(&mixer->speakers);
+
+	//Close the recordings, the recording thread writes out what's still queued
+	recorder_close(&mixer->wav_recorder);
+	recorder_close(&room->track_recorder);
+	recorder_close(&room->out_recorder);
+
+	free(mixer->buffering);
+	free(mixer->contributed);
+	free(mixer->mixed_samples);
+	free(mixer->speaker_of);
+	free(mixer->tier_of);
+	for(int i = 1; i < SETTINGS_QUALITY_TIERS; i++)
+		opus_encoder_destroy(mixer->encoders[i]);
+	free(mixer->packet_data);
+	if(mixer->shards != NULL)
+	{
+		for(unsigned int i = 0; i < mixer->shard_capacity; i++)
+			free(mixer->shards[i].packet_data);
+		free(mixer->shards);
+	}
+	pthread_mutex_destroy(&mixer->shard_mutex);
+	pthread_cond_destroy(&mixer->shard_cond);
+	free(mixer);
+}
 
-	while(stream_lobby_is_initialized() && !stream_lobby_is_stopping())
+/*
+ * Start mixing a lobby's audio. Lobbies created before audio_init() are started by it
+ */
+int audio_start_mixer(lobby* room)
+{
+	if(mix_scheduler == NULL)
+		return 0;
+	if(room->encoder == NULL)
 	{
-		pthread_mutex_lock(&room->mutex);
-			if(room->die)
-			{
-				pthread_mutex_unlock(&room->mutex);
-				break;
-			}
-		pthread_mutex_unlock(&room->mutex);
-		//Has enough time passed?
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0)
-		{
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < 20000) //20ms
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Lobby \"%s\" has no Opus encoder, not mixing audio!\n", room->name);
+		return 1;
+	}
+	audio_mixer* mixer = audio_mixer_create(room);
+	if(mixer == NULL)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Memory allocation failure, not mixing audio for lobby \"%s\"!\n", room->name);
+		return 2;
+	}
+	room->mixer = mixer;
+	room->mix_task = scheduler_add(mix_scheduler, &audio_mix_tick, mixer, (gint64) room->profile.ptime*1000);
+	if(room->mix_task == NULL)
+	{
+		room->mixer = NULL;
+		audio_mixer_destroy(mixer);
+		return 3;
+	}
+	JANUS_LOG(LOG_INFO, "Audio mixing started for lobby \"%s\"\n", room->name);
+	return 0;
+}
+
+/* Waits for a tick in progress to finish */
+void audio_stop_mixer(lobby* room)
+{
+	if(room->mix_task == NULL)
+		return;
+	scheduler_remove(mix_scheduler, room->mix_task);
+	room->mix_task = NULL;
+	audio_mixer_destroy(room->mixer);
+	room->mixer = NULL;
+}
+
+/*
+ * Mix one frame of a lobby's audio and send it out
+ */
+int audio_mix_tick(void* data, unsigned int skipped)
+{
+	audio_mixer* mixer = data;
+	lobby* room = mixer->room;
+	//Nobody can hear or be heard, sleep until somebody sets up media
+	if(g_atomic_int_get(&room->die) || g_atomic_int_get(&room->media_peers) == 0)
+		return SCHEDULER_PARK;
+	//Opus always runs its RTP clock at 48kHz, whatever rate the lobby mixes at
+	const uint32_t rtp_frame_size = SETTINGS_RTP_CLOCK_RATE/1000*room->profile.ptime;
+	//Keep the RTP clock in step with real time over ticks the scheduler had to drop
+	if(skipped > 0)
+	{
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Mixer for lobby \"%s\" fell behind, skipped %u ticks\n", room->name, skipped);
+		mixer->ts += skipped*rtp_frame_size;
+	}
+
+	const int buffer_size = room->profile.frame_size*SETTINGS_CHANNELS;
+	peer** participants_list;
+	unsigned char* contributed = mixer->contributed;
+	int* speaker_of = mixer->speaker_of;
+	opus_int32* mix_buffer = mixer->shards[0].bus;
+	opus_int16* output_buffer = mixer->output_buffer;
+	rtp_wrapper* output_packet = &mixer->output_packet;
+	rtp_header* payload = output_packet->data;
+	unsigned char* tier_of = mixer->tier_of;
+	int* tier_length = mixer->tier_length;
+	unsigned int peer_count = 0, peers_skipped = 0;
+
+	//Get all participants that are ready to receive A/V data (skip this tick if there aren't any)
+	int reader;
+	participant_snapshot* snapshot = lobbies_acquire_snapshot(room, &reader);
+	if(snapshot == NULL || snapshot->media_count == 0)
+	{
+		lobbies_release_snapshot(room, reader);
+		return SCHEDULER_CONTINUE;
+	}
+	participants_list = snapshot->peers;
+	peer_count = snapshot->media_count;
+	audio_select_speakers(room, participants_list, peer_count);
+
+	//Big lobbies are split into shards of about submix_threshold participants, each summed and sent to on its own thread
+	unsigned int shard_count = 1;
+	if(room->submix_threshold > 0 && submix_pool != NULL)
+		shard_count = (peer_count + room->submix_threshold - 1)/room->submix_threshold;
+	if(shard_count > mixer->shard_capacity)
+		shard_count = mixer->shard_capacity;
+	if(shard_count < 1)
+		shard_count = 1;
+	mixer->participants = participants_list;
+	mixer->peer_count = peer_count;
+	mixer->shard_count = shard_count;
+	for(unsigned int i = 0; i < shard_count; i++)
+	{
+		mixer->shards[i].first = i*peer_count/shard_count;
+		mixer->shards[i].last = (i+1)*peer_count/shard_count;
+	}
+
+	//Mix into single buffer. Integer sums don't depend on the order they're added in,
+	//so adding up the shards' buses gives exactly what one thread summing everybody would
+	memset(mixer->buffering, 0, peer_count);
+	memset(contributed, 0, peer_count);
+	audio_run_shards(mixer, &audio_shard_accumulate);
+	peers_skipped = mixer->shards[0].skipped;
+	for(unsigned int i = 1; i < shard_count; i++)
+	{
+		mixer_add_bus(mix_buffer, mixer->shards[i].bus, buffer_size);
+		peers_skipped += mixer->shards[i].skipped;
+	}
+	speaker_streams_update(&mixer->speakers, &room->profile, participants_list, contributed, speaker_of, peer_count);
+	//TODO - If somebody is streaming video data to the server, add the associated audio (if there is any) to the buffer as well
+	//Nobody's saying anything, but the stream carries on through the silence so listeners' jitter buffers don't reset.
+	//Everybody gets the same silent mix, which the top tier's encoder turns into DTX frames once it's been quiet
+	//for a while. Those aren't sent, apart from the comfort noise updates it puts out every so often
+	int silent = peers_skipped == peer_count;
+
+	//Update RTP header. The timestamp moves on every tick, the sequence number only once the packets are sent
+	mixer->ts += rtp_frame_size;
+	output_packet->timestamp = mixer->ts;
+	output_packet->seq_number = mixer->seq + 1;
+	payload->timestamp = htonl(mixer->ts);
+	payload->seq_number = htons(output_packet->seq_number);
+
+	//Everybody that isn't speaking hears their tier's mix, so it's only encoded once per tick for each tier anybody is in.
+	//The top tier is also the one that's recorded
+	unsigned char tier_used[SETTINGS_QUALITY_TIERS] = {0};
+	tier_used[0] = g_atomic_pointer_get(&room->out_recorder) != NULL;
+	for(int i = 0; i < peer_count; i++)
+	{
+		tier_of[i] = silent ? 0 : g_atomic_int_get(&participants_list[i]->quality_tier);
+		if(silent)
+			speaker_of[i] = -1;
+		if(speaker_of[i] < 0)
+			tier_used[tier_of[i]] = 1;
+	}
+	mixer_saturate(output_buffer, mix_buffer, buffer_size);
+	//Write to wav file, queued for the recording thread
+	recorder_write(&mixer->wav_recorder, 0, 0, output_buffer, buffer_size*sizeof(opus_int16));
+	for(int t = 0; t < SETTINGS_QUALITY_TIERS; t++)
+	{
+		tier_length[t] = -1;
+		if(!tier_used[t] || mixer->encoders[t] == NULL)
+			continue;
+		rtp_header* packet = mixer->tier_payload[t];
+		int length = opus_encode(mixer->encoders[t], output_buffer, room->profile.frame_size, (unsigned char*) packet+RTP_HEADER_SIZE, SETTINGS_OUTPUT_BUFFER_SIZE-RTP_HEADER_SIZE);
+		if(length < 0)
 		{
-			nanosleep(&sleep_ln, NULL);
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Oops! got an error encoding the Opus frame: %d (%s)\n", length, opus_strerror(length));
 			continue;
 		}
-		//Update time var
-		before.tv_usec += 20000;
-		if(before.tv_usec > 1000000)
+		JANUS_LOG(LOG_DBG, "Encoded %d bytes of data for tier %d\n", length, t);
+		if(t > 0)
+			memcpy(packet, payload, RTP_HEADER_SIZE);
+		tier_length[t] = length + RTP_HEADER_SIZE;
+	}
+	output_packet->length = tier_length[0];
+	//Only the top tier's been encoded on a silent tick, opus_encode() leaves 2 bytes or less when the frame doesn't need sending
+	mixer->sending = !silent || tier_length[0] > RTP_HEADER_SIZE + 2;
+	if(tier_length[0] > 0 && g_atomic_pointer_get(&room->out_recorder) != NULL)
+	{
+		//OGG recording code block, DTX frames are recorded too so the file keeps time
+		//************************
+		recorder_write(&room->out_recorder, mixer->ssrc, mixer->ts, (unsigned char*) payload+RTP_HEADER_SIZE, tier_length[0] - RTP_HEADER_SIZE);
+		//************************
+	}
+
+	if(janus_gateway != NULL && mixer->sending)
+	{
+		mixer->seq++;
+		gint64 now = janus_get_monotonic_time();
+		gint64 difference = mixer->previous_send ? now - mixer->previous_send : 0;
+		mixer->previous_send = now;
+		JANUS_LOG(LOG_DBG, "Sending RTP Packet #%d. Time since last packet: %"SCNi64"us\n", mixer->seq, difference);
+	}
+
+	//Take this tick's audio out of the participants' buffers and send them the mix, over the same shards
+	audio_run_shards(mixer, &audio_shard_send);
+	//The first packet after a DTX gap starts a new talkspurt
+	payload->markerbit = !mixer->sending;
+	if(janus_gateway != NULL && janus_get_monotonic_time() - mixer->last_sender_report >= SETTINGS_RTCP_INTERVAL)
+	{
+		mixer->last_sender_report = janus_get_monotonic_time();
+		audio_send_sender_reports(mixer, participants_list, peer_count);
+	}
+	lobbies_release_snapshot(room, reader);
+	return SCHEDULER_CONTINUE;
+}
+
+/* Runs a shard's step on a submixing thread, the last one to finish wakes the mixing thread back up */
+static void audio_shard_task(void* data)
+{
+	mix_shard* shard = data;
+	audio_mixer* mixer = shard->mixer;
+	shard->fn(shard);
+	pthread_mutex_lock(&mixer->shard_mutex);
+		if(--mixer->shards_pending == 0)
+			pthread_cond_signal(&mixer->shard_cond);
+	pthread_mutex_unlock(&mixer->shard_mutex);
+}
+
+/*
+ * Run one step of the tick on every shard in use and wait for them all to finish
+ * The first shard runs on the mixing thread, as does any the submixing threads couldn't take
+ */
+static void audio_run_shards(audio_mixer* mixer, worker_task_fn fn)
+{
+	for(unsigned int i = 0; i < mixer->shard_count; i++)
+		mixer->shards[i].fn = fn;
+	if(mixer->shard_count > 1)
+	{
+		pthread_mutex_lock(&mixer->shard_mutex);
+			mixer->shards_pending = mixer->shard_count - 1;
+		pthread_mutex_unlock(&mixer->shard_mutex);
+		for(unsigned int i = 1; i < mixer->shard_count; i++)
 		{
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
+			if(worker_pool_submit(submix_pool, &audio_shard_task, &mixer->shards[i], -1) != 0)
+				audio_shard_task(&mixer->shards[i]);
 		}
+	}
+	fn(&mixer->shards[0]);
+	if(mixer->shard_count > 1)
+	{
+		pthread_mutex_lock(&mixer->shard_mutex);
+			while(mixer->shards_pending > 0)
+				pthread_cond_wait(&mixer->shard_cond, &mixer->shard_mutex);
+		pthread_mutex_unlock(&mixer->shard_mutex);
+	}
+}
 
-		//Get all participants that are ready to receive A/V data (skip to next loop if there aren't any)
-		if(participants_list[0] != NULL)
-			memset(participants_list, 0, sizeof(peer*)*peer_count);
-		peer_count = 0;
-		
-		pthread_mutex_lock(&room->peerlist_mutex);
-			for(int i = 0; i < room->max_clients; i++)
+/*
+ * Sum the shard's participants' audio for this tick into its bus
+ * Nothing is taken out of their buffers yet, that waits until the mix has been encoded
+ */
+static void audio_shard_accumulate(void* data)
+{
+	mix_shard* shard = data;
+	audio_mixer* mixer = shard->mixer;
+	const int buffer_size = mixer->room->profile.frame_size*SETTINGS_CHANNELS;
+	peer** participants_list = mixer->participants;
+	unsigned char* buffering = mixer->buffering;
+	unsigned char* contributed = mixer->contributed;
+	int* mixed_samples = mixer->mixed_samples;
+	opus_int32* mix_buffer = shard->bus;
+
+	shard->skipped = 0;
+	memset(mix_buffer, 0, buffer_size*sizeof(opus_int32));
+	for(unsigned int i = shard->first; i < shard->last; i++)
+	{
+		peer* dude = participants_list[i];
+		if(!g_atomic_int_get(&dude->mixed))
+		{
+			shard->skipped++;
+			continue;
+		}
+		pthread_mutex_lock(&dude->mutex);
+			//Skip peer if they haven't sent any audio or we're still waiting for their buffer to fill
+			if(dude->sample_count == 0) {
+				dude->finished_buffering = 0;
+				pthread_mutex_unlock(&dude->mutex);
+				shard->skipped++;
+				continue;
+			}
+			if(!dude->finished_buffering)
 			{
-				if(room->participants[i] != NULL)
+				gint64 current_delay = janus_get_monotonic_time() - dude->buffering_start;
+				if(current_delay < dude->playout_delay)
 				{
-					peer* dude = room->participants[i];
-					pthread_mutex_lock(&dude->mutex);
-						if(dude->comms_ready)
-							participants_list[peer_count++] = room->participants[i];
-					pthread_mutex_unlock(&dude->mutex);
-				}
-			}
-		pthread_mutex_unlock(&room->peerlist_mutex);
-		if(peer_count == 0)
-			continue;
-
-		/*FIXME - If I decide to keep the sum buffer, each peer's buffer head needs to be moved accordingly
-		once I've grabbed the audio data. Releasing the mutex and grabbing the audio data again afterwards
-		will allow the chance for audio to be added to a peer's buffer after the sum buffer is created, which
-		can lead to some weird audio when the peer's audio is removed from the sum buffer before sending
-		the packet out*/
-		//Mix into single buffer
-		peers_skipped = 0;
-		memset(mix_buffer, 0, buffer_size*sizeof(opus_int32));
-		for(int i = 0; i < peer_count; i++)
-		{
-			peer* dude = participants_list[i];
-			pthread_mutex_lock(&dude->mutex);
-				//Skip peer if they haven't sent any audio or we're still waiting for their buffer to fill
-				if(dude->sample_count == 0) {
-					dude->finished_buffering = 0;
+					JANUS_LOG(LOG_DBG, "Elapsed time since we started buffering: %"SCNi64"us of %uus\n", current_delay, dude->playout_delay);
 					pthread_mutex_unlock(&dude->mutex);
-					peers_skipped++;
+					buffering[i] = 1;
+					shard->skipped++;
 					continue;
 				}
-				if(!dude->finished_buffering)
-				{
-					int current_delay = now.tv_usec;
-					if(now.tv_sec > dude->buffering_start.tv_sec)
-						current_delay += 1000000*(now.tv_sec-dude->buffering_start.tv_sec);
-					current_delay -= dude->buffering_start.tv_usec;
-					if(current_delay < SETTINGS_PEER_INPUT_DELAY)
-					{
-						JANUS_LOG(LOG_DBG, "Elapsed time since we started buffering: %dus\n", current_delay);
-						pthread_mutex_unlock(&dude->mutex);
-						peers_skipped++;
-						continue;
-					}
-					else
-					{
-						dude->finished_buffering = 1;
-					}
-				}
-
-				//Add audio to mixed buffer
-				int j=0, samples = buffer_size < dude->sample_count ? buffer_size : dude->sample_count;
-				opus_int32* tail = dude->buffer_tail;
-				JANUS_LOG(LOG_DBG, "Peer has currently provided %d samples. Removing %d for server output\n", dude->sample_count, samples);
-				while(samples > 0)
+				else
 				{
-					mix_buffer[j++] = *tail;
-					samples--;
-					tail++;
-					if(tail == dude->buffer_end)
-						tail = dude->buffer_start;
+					dude->finished_buffering = 1;
 				}
-			pthread_mutex_unlock(&dude->mutex);
-		}
-		//TODO - If somebody is streaming video data to the server, add the associated audio (if there is any) to the buffer as well
-		if(peers_skipped == peer_count)
-		{
-			JANUS_LOG(LOG_INFO, "Nobody's saying anything, no audio to mix\n");
-			continue;
-		}
-
-		//TODO - Write to wav file
-		wav_file_write(wavFile, mix_buffer, buffer_size);
-		/* Every 5 seconds we update the wav header */
-		gint64 wav_now = janus_get_monotonic_time();
-		if(wav_now - record_lastupdate >= 5*G_USEC_PER_SEC)
-		{
-			record_lastupdate = wav_now;
-			wav_file_update_header(wavFile);
-		}
+			}
 
-		//Update RTP header
-		seq++;
-		ts += SETTINGS_OPUS_FRAME_SIZE;
+			//Add audio to mixed buffer
+			int samples = buffer_size < dude->sample_count ? buffer_size : dude->sample_count;
+			JANUS_LOG(LOG_DBG, "Peer has currently provided %d samples. Removing %d for server output\n", dude->sample_count, samples);
+			mixer_accumulate(mix_buffer, dude->buffer_start, dude->buffer_end, dude->buffer_tail, samples);
+			contributed[i] = 1;
+			//More can be decoded into the buffer before it's sent, that's left for the next tick
+			mixed_samples[i] = samples;
+		pthread_mutex_unlock(&dude->mutex);
+	}
+}
 
-		//Send packet to participants after removing their own voice
-		for(int i = 0; i < peer_count; i++)
+/*
+ * Take this tick's audio out of the shard's participants' buffers and send them the mix
+ * Speakers' mix-minus streams are encoded here, each one only belongs to the one shard its speaker is in
+ */
+static void audio_shard_send(void* data)
+{
+	mix_shard* shard = data;
+	audio_mixer* mixer = shard->mixer;
+	lobby* room = mixer->room;
+	const int buffer_size = room->profile.frame_size*SETTINGS_CHANNELS;
+	peer** participants_list = mixer->participants;
+	unsigned char* buffering = mixer->buffering;
+	unsigned char* contributed = mixer->contributed;
+	int* mixed_samples = mixer->mixed_samples;
+	int* speaker_of = mixer->speaker_of;
+	unsigned char* tier_of = mixer->tier_of;
+	int* tier_length = mixer->tier_length;
+	opus_int32* mix_buffer = mixer->shards[0].bus;
+	opus_int32* tmp_buffer = shard->tmp_buffer;
+	opus_int16* output_buffer = shard->output_buffer;
+	rtp_wrapper* output_packet = &mixer->output_packet;
+	rtp_header* payload = output_packet->data;
+	rtp_header** fanout = shard->fanout;
+	int* fanout_pt = shard->fanout_pt;
+	int* fanout_tier = shard->fanout_tier;
+	rtp_header* speaker_payload = shard->speaker_payload;
+
+	shard->fanout_count = 0;
+	for(unsigned int i = shard->first; i < shard->last; i++)
+	{
+		peer *dude = participants_list[i];
+		memset(tmp_buffer, 0, sizeof(opus_int32)*buffer_size);
+		//Peers still buffering keep their audio for when they start playing out
+		if(!buffering[i])
 		{
-			peer *dude = participants_list[i];
-			memset(tmp_buffer, 0, sizeof(opus_int32)*buffer_size);
 			pthread_mutex_lock(&dude->mutex);
+				//Exactly what was mixed, so it's also exactly what comes back out of speakers' mix-minus
 				int j=0, samples = buffer_size < dude->sample_count ? buffer_size : dude->sample_count;
+				if(contributed[i] && mixed_samples[i] < samples)
+					samples = mixed_samples[i];
 				while(samples > 0)
 				{
 					tmp_buffer[j++] = *dude->buffer_tail;
@@ -681,95 +1163,96 @@ void* audio_mix_thread(void* data)
 					if(dude->buffer_tail >= dude->buffer_end)
 						dude->buffer_tail = dude->buffer_start;
 				}
+				//Room was made in the peer's buffer, decode whatever is still waiting
+				audio_schedule_decode(dude);
 			pthread_mutex_unlock(&dude->mutex);
+		}
+		if(janus_gateway == NULL || !mixer->sending)
+			continue;
 
-			//Remove the peer's own contribution
-			for(int j=0; j<buffer_size; j++)
+		if(speaker_of[i] >= 0)
+		{
+			//Speakers get their own stream with their voice taken back out of the mix
+			speaker_stream* stream = &mixer->speakers.streams[speaker_of[i]];
+			if(stream->tier != tier_of[i])
 			{
-				//output_buffer[j] = mix_buffer[j] - tmp_buffer[j];
-				//I'm leaving it in for now
-				output_buffer[j] = mix_buffer[j];
+				audio_apply_quality_tier(stream->encoder, &room->profile, tier_of[i]);
+				stream->tier = tier_of[i];
 			}
+			if(!contributed[i])
+				memset(tmp_buffer, 0, sizeof(opus_int32)*buffer_size);
+			mixer_saturate_minus(output_buffer, mix_buffer, tmp_buffer, buffer_size);
+			int length = opus_encode(stream->encoder, output_buffer, room->profile.frame_size, (unsigned char*) speaker_payload+RTP_HEADER_SIZE, SETTINGS_OUTPUT_BUFFER_SIZE-RTP_HEADER_SIZE);
+			if(length < 0)
+			{
+				JANUS_LOG(LOG_ERR, "[Stream Lobby] Error encoding mix-minus Opus frame: %d (%s)\n", length, opus_strerror(length));
+				continue;
+			}
+			memcpy(speaker_payload, payload, RTP_HEADER_SIZE);
+			speaker_payload->type = dude->opus_pt;
+			janus_gateway->relay_rtp(dude->session, 0, (char *)speaker_payload, length + RTP_HEADER_SIZE);
+			__atomic_fetch_add(&dude->link.packets_sent, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&dude->link.octets_sent, length, __ATOMIC_RELAXED);
+			continue;
+		}
+		int tier = tier_of[i], length = tier_length[tier];
+		if(length < 0)
+			continue;
 
-			/* Encode raw frame to Opus */
-			if(room->encoder == NULL)
+		//Only the tier and payload type differ between listeners, peers with the same ones share a copy.
+		//The tiers' own packets are shared by every shard, so they're only ever copied from
+		rtp_header* packet = NULL;
+		for(unsigned int j = 0; j < shard->fanout_count; j++)
+		{
+			if(fanout_pt[j] == dude->opus_pt && fanout_tier[j] == tier)
+			{
+				packet = fanout[j];
 				break;
-			output_packet->length = opus_encode(room->encoder, output_buffer, SETTINGS_OPUS_FRAME_SIZE, (unsigned char*) payload+RTP_HEADER_SIZE, SETTINGS_OUTPUT_BUFFER_SIZE-RTP_HEADER_SIZE);
-
-			if(output_packet->length < 0) {
-				JANUS_LOG(LOG_ERR, "[Stream Lobby] Oops! got an error encoding the Opus frame: %d (%s)\n", output_packet->length, opus_strerror(output_packet->length));
-			} else {
-				JANUS_LOG(LOG_DBG, "Encoded %d bytes of data\n", output_packet->length);
-
-				//OGG recording code block
-				//************************
-				ogg_packet* op = op_from_pkt((unsigned char*) payload+RTP_HEADER_SIZE, output_packet->length);
-				op->granulepos = SETTINGS_OPUS_FRAME_SIZE*ntohs(seq);
-				ogg_stream_packetin(room->out_ss, op);
-				free(op);
-				ogg_write(room, 'o');
-				//************************
-
-
-				output_packet->length += RTP_HEADER_SIZE;
-				output_packet->timestamp = ts;
-				output_packet->seq_number = seq;
-				payload->type = dude->opus_pt;
-				/* Update the timestamp and sequence number in the RTP packet, and send it */
-				payload->timestamp = htonl(ts);
-				payload->seq_number = htons(seq);
-
-				if(janus_gateway != NULL)
-				{
-					int difference = 0;
-					if(previous_out_packet_time.tv_sec != 0)
-					{
-						difference = now.tv_usec;
-						if(now.tv_sec > previous_out_packet_time.tv_sec)
-							difference += 1000000*(now.tv_sec-previous_out_packet_time.tv_sec);
-						difference -= previous_out_packet_time.tv_usec;
-					}
-					previous_out_packet_time.tv_sec = now.tv_sec;
-					previous_out_packet_time.tv_usec = now.tv_usec;
-
-					JANUS_LOG(LOG_DBG, "Sending RTP Packet #%d. Timestamp: %u.%.6u, Time since last packet: %uus\n", seq, now.tv_sec, now.tv_usec, difference);
-					janus_gateway->relay_rtp(dude->session, 0, (char *)payload, output_packet->length);
-				}
-
-				/* Restore the timestamp and sequence number to what the publisher set them to */
-				payload->timestamp = htonl(output_packet->timestamp);
-				payload->seq_number = htons(output_packet->seq_number);
 			}
 		}
-		payload->markerbit = 0;
+		if(packet == NULL)
+		{
+			if(shard->fanout_count < MIX_FANOUT_SIZE)
+			{
+				packet = fanout[shard->fanout_count];
+				fanout_pt[shard->fanout_count] = dude->opus_pt;
+				fanout_tier[shard->fanout_count++] = tier;
+			}
+			else
+				packet = shard->overflow;
+			memcpy(packet, mixer->tier_payload[tier], length);
+			packet->type = dude->opus_pt;
+		}
+		janus_gateway->relay_rtp(dude->session, 0, (char *)packet, length);
+		__atomic_fetch_add(&dude->link.packets_sent, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dude->link.octets_sent, length - RTP_HEADER_SIZE, __ATOMIC_RELAXED);
+		/* Restore the timestamp and sequence number in case they were rewritten on the way out */
+		packet->timestamp = htonl(output_packet->timestamp);
+		packet->seq_number = htons(output_packet->seq_number);
 	}
+}
 
-	//Close wav file
-	if(wavFile != NULL)
+/*
+ * Tell each listener how the lobby's stream lines up with the wall clock, and how much of it
+ * they've been sent. Their reports refer back to these, which is how we get their round trip time
+ */
+static void audio_send_sender_reports(audio_mixer* mixer, peer** participants, unsigned int count)
+{
+	char buf[128];
+	rtcp_sender_info info;
+	info.ssrc = mixer->ssrc;
+	info.ntp = rtcp_ntp_time(janus_get_real_time());
+	//This tick's packets just went out, so its timestamp is the one that goes with now
+	info.rtp_timestamp = mixer->ts;
+	for(unsigned int i = 0; i < count; i++)
 	{
-		wav_file_update_header(wavFile);
-		fclose(wavFile);
+		peer* dude = participants[i];
+		info.packets = __atomic_load_n(&dude->link.packets_sent, __ATOMIC_RELAXED);
+		info.octets = __atomic_load_n(&dude->link.octets_sent, __ATOMIC_RELAXED);
+		int length = rtcp_build_sender_report(buf, sizeof(buf), &info, SETTINGS_RTCP_CNAME);
+		if(length > 0)
+			janus_gateway->relay_rtcp(dude->session, 0, buf, length);
 	}
-
-	//audio recording code block
-	//************
-	fclose(room->in_file);
-	room->in_file = NULL;
-	ogg_stream_destroy(room->in_ss);
-
-	fclose(room->out_file);
-	room->out_file = NULL;
-	ogg_stream_destroy(room->out_ss);
-	//************
-
-	opus_encoder_destroy(room->encoder);
-	room->encoder = NULL;
-	g_atomic_int_dec_and_test(&audio_mix_thread_count);
-	pthread_mutex_lock(&audio_mix_threads_mutex);
-		if(stream_lobby_is_stopping() && g_atomic_int_get(&audio_mix_thread_count) == 0)
-			pthread_cond_signal(&audio_destroy_threads_cond);
-	pthread_mutex_unlock(&audio_mix_threads_mutex);
-	return NULL;
 }
 
 
@@ -781,7 +1264,7 @@ void* audio_mix_thread(void* data)
 int add_peer_audio(peer* dude, opus_int16* pcm, int samples)
 {
 	//FIXME - What to do if there's not enough room, add what we can, queue the samples up to be added later?
-	if(max_sample_count - dude->sample_count < samples)
+	if((dude->buffer_end - dude->buffer_start) - dude->sample_count < samples)
 		return -1;
 
 	int i=0;
@@ -801,15 +1284,357 @@ int add_peer_audio(peer* dude, opus_int16* pcm, int samples)
 
 
 
+/*
+ * Play out delay for a peer's next talk spurt, based on their measured jitter and bounded by the lobby's settings
+ * Peer's mutex must be locked
+ */
+unsigned int audio_get_playout_delay(peer* dude)
+{
+	lobby* room = dude->current_lobby;
+	unsigned int min = room ? room->min_playout_delay : SETTINGS_MIN_PLAYOUT_DELAY;
+	unsigned int max = room ? room->max_playout_delay : SETTINGS_MAX_PLAYOUT_DELAY;
+	unsigned int delay = SETTINGS_PLAYOUT_JITTER_FACTOR * jitter_buffer_get_jitter(&dude->packets, SETTINGS_RTP_CLOCK_RATE);
+	if(delay < min)
+		delay = min;
+	if(delay > max)
+		delay = max;
+	return delay;
+}
+
+
+
+/* Tick counters of a lobby's mixer, returns 0 if the lobby has one */
+int audio_get_mixer_stats(lobby* room, scheduler_stats* stats)
+{
+	return scheduler_get_stats(mix_scheduler, room->mix_task, stats);
+}
+
+/* Totals over the lobby's recordings. Returns non-zero if nothing's being recorded */
+int audio_get_recording_stats(lobby* room, recorder_stats* stats)
+{
+	memset(stats, 0, sizeof(recorder_stats));
+	audio_mixer* mixer = room->mixer;
+	recorder** recordings[3] = {mixer ? &mixer->wav_recorder : NULL, &room->track_recorder, &room->out_recorder};
+	int found = 0;
+	for(int i = 0; i < 3; i++)
+	{
+		if(recordings[i] == NULL || g_atomic_pointer_get(recordings[i]) == NULL)
+			continue;
+		recorder_stats part;
+		recorder_get_stats(recordings[i], &part);
+		stats->frames += part.frames;
+		stats->dropped += part.dropped;
+		stats->bytes += part.bytes;
+		found = 1;
+	}
+	return found ? 0 : 1;
+}
+
+/* Wake up a lobby's mixer if it's idle, i.e. when somebody has set up media */
+void audio_wake_mixer(lobby* room)
+{
+	scheduler_wake(mix_scheduler, room->mix_task);
+}
+
+
+
+/*
+ * Opus DTX and comfort noise frames: a TOC byte with (next to) no frame data,
+ * or a SILK-only frame too small to hold anything but background noise parameters
+ */
+int audio_packet_is_dtx(const unsigned char* payload, int len)
+{
+	if(len <= 2)
+		return 1;
+	int config = payload[0] >> 3;
+	return config < 12 && len <= SETTINGS_COMFORT_NOISE_BYTES;
+}
+
+/*
+ * Read the RFC 6464 client-to-mixer audio level from an RTP packet's one-byte header extensions
+ * Level is 0 (loudest) to 127 (silence) in -dBov. Returns 0 if the level was found
+ */
+int audio_parse_audio_level(char* buf, int len, int id, int* level)
+{
+	rtp_header* header = (rtp_header*) buf;
+	if(len < RTP_HEADER_SIZE || !header->extension)
+		return 1;
+	int offset = RTP_HEADER_SIZE + 4*header->csrccount;
+	if(len < offset + 4)
+		return 1;
+	unsigned char* ext = (unsigned char*) buf + offset;
+	uint16_t profile = (ext[0] << 8) | ext[1];
+	int ext_len = 4*((ext[2] << 8) | ext[3]);
+	if(profile != 0xBEDE || len < offset + 4 + ext_len)
+		return 1;
+	ext += 4;
+	int i = 0;
+	while(i < ext_len)
+	{
+		int ext_id = ext[i] >> 4;
+		int ext_size = (ext[i] & 0x0F) + 1;
+		if(ext[i] == 0)
+		{
+			//Padding
+			i++;
+			continue;
+		}
+		if(ext_id == 15 || i + 1 + ext_size > ext_len)
+			break;
+		if(ext_id == id)
+		{
+			*level = ext[i+1] & 0x7F;
+			return 0;
+		}
+		i += 1 + ext_size;
+	}
+	return 1;
+}
+
+
+
+/*
+ * Rough loudness of a packet on the RFC 6464 scale (0 for silence, 127 for the loudest)
+ * Without the audio level extension, the payload size has to do. Opus spends more bytes on speech than on background noise
+ */
+int audio_packet_loudness(int audio_level, int payload_length, int silent)
+{
+	if(silent)
+		return 0;
+	if(audio_level >= 0)
+		return 127 - audio_level;
+	return payload_length < 127 ? payload_length : 127;
+}
+
+/*
+ * Pick the lobby's loudest peers to be mixed this tick, everybody else's packets aren't decoded
+ * Peers that are already being mixed have to be out-shouted by SETTINGS_SPEAKER_HYSTERESIS before they're replaced
+ */
+void audio_select_speakers(lobby* room, peer** participants, unsigned int count)
+{
+	for(unsigned int i = 0; i < count; i++)
+	{
+		gint energy = g_atomic_int_get(&participants[i]->speech_energy);
+		g_atomic_int_add(&participants[i]->speech_energy, -(energy >> 3));
+	}
+	unsigned int limit = room->max_mixed_speakers;
+	if(limit == 0 || count <= limit)
+	{
+		for(unsigned int i = 0; i < count; i++)
+			g_atomic_int_set(&participants[i]->mixed, 1);
+		return;
+	}
+
+	gint score[count];
+	unsigned char picked[count];
+	memset(picked, 0, count);
+	for(unsigned int i = 0; i < count; i++)
+	{
+		//With one packet per tick, energy settles at 8 times the packet loudness
+		score[i] = g_atomic_int_get(&participants[i]->speech_energy);
+		if(g_atomic_int_get(&participants[i]->mixed))
+			score[i] += 8*SETTINGS_SPEAKER_HYSTERESIS;
+	}
+	for(unsigned int n = 0; n < limit; n++)
+	{
+		int loudest = -1;
+		for(unsigned int i = 0; i < count; i++)
+		{
+			if(!picked[i] && score[i] > 0 && (loudest < 0 || score[i] > score[loudest]))
+				loudest = i;
+		}
+		if(loudest < 0)
+			break;
+		picked[loudest] = 1;
+	}
+	for(unsigned int i = 0; i < count; i++)
+		g_atomic_int_set(&participants[i]->mixed, picked[i]);
+}
+
+
+
+void audio_profile_defaults(audio_profile* profile)
+{
+	profile->sample_rate = SETTINGS_SAMPLE_RATE;
+	profile->ptime = SETTINGS_PTIME;
+	profile->bitrate = SETTINGS_BITRATE;
+	profile->complexity = SETTINGS_OPUS_COMPLEXITY;
+	profile->application = SETTINGS_OPUS_APPLICATION;
+	profile->frame_size = profile->sample_rate/1000*profile->ptime;
+}
+
+/*
+ * Check a profile against what Opus can do and fill in its frame size
+ * Returns 0 if it's usable
+ */
+int audio_profile_validate(audio_profile* profile)
+{
+	switch(profile->sample_rate)
+	{
+		case 8000: case 12000: case 16000: case 24000: case 48000:
+			break;
+		default:
+			return 1;
+	}
+	switch(profile->ptime)
+	{
+		case 10: case 20: case 40: case 60:
+			break;
+		default:
+			return 2;
+	}
+	if(profile->bitrate < 500 || profile->bitrate > 512000)
+		return 3;
+	if(profile->complexity < 0 || profile->complexity > 10)
+		return 4;
+	if(profile->application != OPUS_APPLICATION_VOIP && profile->application != OPUS_APPLICATION_AUDIO && profile->application != OPUS_APPLICATION_RESTRICTED_LOWDELAY)
+		return 5;
+	profile->frame_size = profile->sample_rate/1000*profile->ptime;
+	return 0;
+}
+
+/* Opus encoder for everything a lobby with the given profile sends out */
+OpusEncoder* audio_create_encoder(const audio_profile* profile)
+{
+	int error = 0;
+	OpusEncoder* encoder = opus_encoder_create(profile->sample_rate, SETTINGS_CHANNELS, profile->application, &error);
+	if(error != OPUS_OK)
+		return NULL;
+	//Sample rate, the encoder keeps it under what the profile's rate can carry
+	opus_encoder_ctl(encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_FULLBAND));
+	//opus complexity setting
+	opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(profile->complexity));
+	//Variable bit rate, constrained so the tiers stay close to their budgets, quiet frames cost next to nothing
+	opus_encoder_ctl(encoder, OPUS_SET_VBR(1));
+	opus_encoder_ctl(encoder, OPUS_SET_VBR_CONSTRAINT(1));
+	//Bit rate, a ceiling rather than what every frame costs
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(profile->bitrate));
+	//FEC
+	opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(0));
+	//Stop sending once the input's been silent for a while, apart from the odd comfort noise update
+	opus_encoder_ctl(encoder, OPUS_SET_DTX(1));
+	return encoder;
+}
+
+/* Set an encoder up for one of the quality tiers, starting from the lobby's profile */
+void audio_apply_quality_tier(OpusEncoder* encoder, const audio_profile* profile, int tier)
+{
+	const quality_tier* settings = &quality_tiers[tier];
+	int bitrate = profile->bitrate*settings->bitrate_percent/100;
+	if(bitrate < SETTINGS_MIN_BITRATE)
+		bitrate = SETTINGS_MIN_BITRATE;
+	opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate));
+	opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(settings->fec));
+	opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(settings->loss_percent));
+}
+
+/*
+ * Move a listener between quality tiers based on a reception report
+ * Down a tier as soon as a report goes over their tier's limits, back up once
+ * enough reports in a row are well within the limits of the tier above
+ * Peer's mutex must be locked
+ */
+void audio_update_quality_tier(peer* dude, unsigned int loss, unsigned int jitter)
+{
+	int tier = g_atomic_int_get(&dude->quality_tier);
+	const quality_tier* current = &quality_tiers[tier];
+	if((loss > current->max_loss || jitter > current->max_jitter) && tier < SETTINGS_QUALITY_TIERS - 1)
+	{
+		dude->good_reports = 0;
+		g_atomic_int_set(&dude->quality_tier, tier + 1);
+		JANUS_LOG(LOG_VERB, "[Stream Lobby] \"%s\" moved down to quality tier %d (%u%% loss, %uus jitter)\n", dude->nick, tier + 1, loss, jitter);
+		return;
+	}
+	if(tier == 0)
+		return;
+	const quality_tier* above = &quality_tiers[tier - 1];
+	if(loss*2 > above->max_loss || jitter*2 > above->max_jitter)
+	{
+		dude->good_reports = 0;
+		return;
+	}
+	if(++dude->good_reports >= SETTINGS_TIER_UPGRADE_REPORTS)
+	{
+		dude->good_reports = 0;
+		g_atomic_int_set(&dude->quality_tier, tier - 1);
+		JANUS_LOG(LOG_VERB, "[Stream Lobby] \"%s\" moved up to quality tier %d\n", dude->nick, tier - 1);
+	}
+}
 
-//Callback for sorting a peer's audio packets when inserting into GLib list
-int audio_packet_sort(const void* a, const void* b)
+/*
+ * Give every peer that contributed to this tick's mix a mix-minus stream, and hand the encoders
+ * of peers that have been quiet for SETTINGS_SPEAKER_HANGOVER ticks (or left) back to the pool
+ * speaker_of is filled in with each participant's stream, or -1
+ */
+static void speaker_streams_update(speaker_streams* speakers, const audio_profile* profile, peer** participants, const unsigned char* contributed, int* speaker_of, unsigned int peer_count)
 {
-	rtp_wrapper* one = (rtp_wrapper*) a;
-	rtp_wrapper* two = (rtp_wrapper*) b;
-	int32_t diff = one->seq_number - two->seq_number;
-	if(abs(diff) > 10)
-		diff = 0-diff;
-	return diff;
+	unsigned char present[SETTINGS_MAX_SPEAKER_STREAMS];
+	memset(present, 0, sizeof(present));
+	for(unsigned int i = 0; i < peer_count; i++)
+	{
+		for(unsigned int j = 0; j < speakers->count; j++)
+		{
+			speaker_stream* stream = &speakers->streams[j];
+			if(stream->dude != participants[i])
+				continue;
+			present[j] = 1;
+			if(contributed[i])
+				stream->hangover = SETTINGS_SPEAKER_HANGOVER;
+			else if(stream->hangover > 0)
+				stream->hangover--;
+			break;
+		}
+	}
+	//Release streams by moving the last one into their place
+	for(int j = speakers->count - 1; j >= 0; j--)
+	{
+		if(present[j] && speakers->streams[j].hangover > 0)
+			continue;
+		speakers->pool[speakers->pool_count++] = speakers->streams[j].encoder;
+		speakers->streams[j] = speakers->streams[--speakers->count];
+	}
+
+	for(unsigned int i = 0; i < peer_count; i++)
+	{
+		speaker_of[i] = -1;
+		for(unsigned int j = 0; j < speakers->count; j++)
+		{
+			if(speakers->streams[j].dude == participants[i])
+			{
+				speaker_of[i] = j;
+				break;
+			}
+		}
+		if(speaker_of[i] >= 0 || !contributed[i] || speakers->count == SETTINGS_MAX_SPEAKER_STREAMS)
+			continue;
+		//New speaker, reuse an idle encoder if there is one
+		OpusEncoder* encoder = NULL;
+		if(speakers->pool_count > 0)
+		{
+			encoder = speakers->pool[--speakers->pool_count];
+			opus_encoder_ctl(encoder, OPUS_RESET_STATE);
+		}
+		else
+			encoder = audio_create_encoder(profile);
+		if(encoder == NULL)
+		{
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Error creating mix-minus encoder, speaker will hear themselves\n");
+			continue;
+		}
+		speaker_stream* stream = &speakers->streams[speakers->count];
+		stream->dude = participants[i];
+		stream->encoder = encoder;
+		stream->tier = -1;
+		stream->hangover = SETTINGS_SPEAKER_HANGOVER;
+		speaker_of[i] = speakers->count++;
+	}
 }
 
+static void speaker_streams_destroy(speaker_streams* speakers)
+{
+	for(unsigned int j = 0; j < speakers->count; j++)
+		opus_encoder_destroy(speakers->streams[j].encoder);
+	for(unsigned int j = 0; j < speakers->pool_count; j++)
+		opus_encoder_destroy(speakers->pool[j]);
+	speakers->count = speakers->pool_count = 0;
+}
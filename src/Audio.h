@@ -3,6 +3,8 @@
 #include <ogg/ogg.h>
 #include <janus/rtp.h>
 #include "Sessions.h"
+#include "Scheduler.h"
+#include "Recorder.h"
 
 typedef struct rtp_wrapper {
 	rtp_header *data;
@@ -10,18 +12,39 @@ typedef struct rtp_wrapper {
 	uint32_t ssrc;
 	uint32_t timestamp;
 	uint16_t seq_number;
+	int audio_level; //RFC 6464 level, -1 if the peer didn't send one
+	unsigned int silent : 1; //DTX, comfort noise or below the silence level, skip decoding
+	struct rtp_wrapper* next; //Free list link while the packet sits in a pool
+	unsigned int pooled : 1;
 } rtp_wrapper;
 
-extern unsigned int audio_mix_thread_count;
-extern pthread_mutex_t audio_mix_threads_mutex;
-extern pthread_cond_t audio_destroy_threads_cond;
-
+int	audio_init();
+int	audio_shutdown();
+void	audio_set_decode_threads(unsigned int);
+void	audio_set_mixer_threads(unsigned int);
+void	audio_set_submix_threads(unsigned int);
+void	audio_set_capture_file(const char*);
+int	audio_start_mixer(lobby*);
+void	audio_stop_mixer(lobby*);
 void	audio_setup_media(janus_plugin_session*);
 void	audio_hangup_media(janus_plugin_session*);
 void	audio_hangup_media_no_lock(janus_plugin_session*);
 void	audio_incoming_rtp(janus_plugin_session*, int, char*, int);
 void	audio_incoming_rtcp(janus_plugin_session*, int, char*, int);
-void*	peer_audio_thread(void*);
-void*	audio_mix_thread(void*);
+void	audio_schedule_decode(peer*);
+void	audio_wake_mixer(lobby*);
+void	audio_decode_task(void*);
+int	audio_mix_tick(void*, unsigned int);
+int	audio_get_mixer_stats(lobby*, scheduler_stats*);
+int	audio_get_recording_stats(lobby*, recorder_stats*);
 int	add_peer_audio(peer*, opus_int16*, int);
-int	audio_packet_sort(const void*, const void*);
+OpusEncoder*	audio_create_encoder(const audio_profile*);
+void	audio_profile_defaults(audio_profile*);
+int	audio_profile_validate(audio_profile*);
+void	audio_apply_quality_tier(OpusEncoder*, const audio_profile*, int);
+void	audio_update_quality_tier(peer*, unsigned int, unsigned int);
+unsigned int	audio_get_playout_delay(peer*);
+int	audio_packet_is_dtx(const unsigned char*, int);
+int	audio_parse_audio_level(char*, int, int, int*);
+int	audio_packet_loudness(int, int, int);
+void	audio_select_speakers(lobby*, peer**, unsigned int);
@@ -7,6 +7,8 @@
 #include "Lobbies.h"
 #include "Sessions.h"
 #include "StreamLobby.h"
+#include "Audio.h"
+#include "Messaging.h"
 static unsigned int lobby_count;
 //Allow peers to store a maximum of 20 frames of audio data (going by server settings)
 
@@ -25,9 +27,36 @@ int config_parse_file(const char* filename)
 	//We have a configuration file, so get the global stuff
 	janus_config_container* tmpLimit = janus_config_get(config, NULL, janus_config_type_item, "lobby_limit");
 	janus_config_container* tmpAdmin = janus_config_get(config, NULL, janus_config_type_item, "admin_pass");
+	janus_config_container* tmpDecode = janus_config_get(config, NULL, janus_config_type_item, "decode_threads");
+	janus_config_container* tmpMixer = janus_config_get(config, NULL, janus_config_type_item, "mixer_threads");
+	janus_config_container* tmpSubmix = janus_config_get(config, NULL, janus_config_type_item, "submix_threads");
+	janus_config_container* tmpSegmentTime = janus_config_get(config, NULL, janus_config_type_item, "record_segment_minutes");
+	janus_config_container* tmpSegmentSize = janus_config_get(config, NULL, janus_config_type_item, "record_segment_mb");
+	janus_config_container* tmpCapture = janus_config_get(config, NULL, janus_config_type_item, "capture_file");
+	janus_config_container* tmpRoster = janus_config_get(config, NULL, janus_config_type_item, "roster_interval");
 	
 	if(tmpLimit != NULL)
 		lobbies_set_limit(strtoul(tmpLimit->value, NULL, 10));
+	if(tmpDecode != NULL)
+		audio_set_decode_threads(strtoul(tmpDecode->value, NULL, 10));
+	if(tmpMixer != NULL)
+		audio_set_mixer_threads(strtoul(tmpMixer->value, NULL, 10));
+	if(tmpSubmix != NULL)
+		audio_set_submix_threads(strtoul(tmpSubmix->value, NULL, 10));
+	if(tmpSegmentTime != NULL || tmpSegmentSize != NULL)
+	{
+		gint64 segment_time = (gint64) SETTINGS_RECORDING_SEGMENT_TIME*G_USEC_PER_SEC;
+		guint64 segment_size = 0;
+		if(tmpSegmentTime != NULL)
+			segment_time = (gint64) strtoul(tmpSegmentTime->value, NULL, 10)*60*G_USEC_PER_SEC;
+		if(tmpSegmentSize != NULL)
+			segment_size = (guint64) strtoul(tmpSegmentSize->value, NULL, 10)*1024*1024;
+		recorder_set_segment_limits(segment_size, segment_time);
+	}
+	if(tmpCapture != NULL)
+		audio_set_capture_file(tmpCapture->value);
+	if(tmpRoster != NULL)
+		messaging_set_roster_interval(strtoul(tmpRoster->value, NULL, 10));
 	
 	if(tmpAdmin == NULL)
 	{
@@ -83,6 +112,16 @@ int config_parse_file(const char* filename)
 			janus_config_item* tmpVideo = janus_config_get(config, category, janus_config_type_item, "video_auth");
 			janus_config_item* tmpVideoKey = janus_config_get(config, category, janus_config_type_item, "video_key");
 			janus_config_item* tmpVideoPass = janus_config_get(config, category, janus_config_type_item, "video_pass");
+			janus_config_item* tmpMinDelay = janus_config_get(config, category, janus_config_type_item, "min_playout_delay");
+			janus_config_item* tmpMaxDelay = janus_config_get(config, category, janus_config_type_item, "max_playout_delay");
+			janus_config_item* tmpSpeakers = janus_config_get(config, category, janus_config_type_item, "max_mixed_speakers");
+			janus_config_item* tmpRecordTracks = janus_config_get(config, category, janus_config_type_item, "record_tracks");
+			janus_config_item* tmpSubmixThreshold = janus_config_get(config, category, janus_config_type_item, "submix_threshold");
+			janus_config_item* tmpRate = janus_config_get(config, category, janus_config_type_item, "sample_rate");
+			janus_config_item* tmpPtime = janus_config_get(config, category, janus_config_type_item, "ptime");
+			janus_config_item* tmpBitrate = janus_config_get(config, category, janus_config_type_item, "bitrate");
+			janus_config_item* tmpComplexity = janus_config_get(config, category, janus_config_type_item, "complexity");
+			janus_config_item* tmpApplication = janus_config_get(config, category, janus_config_type_item, "application");
 			JANUS_LOG(LOG_VERB, "[Stream Lobby] Processing config file. Lobby: %s\n", category->name);
 			
 			
@@ -106,6 +145,9 @@ int config_parse_file(const char* filename)
 			
 			if(tmpPriv != NULL && strtoul(tmpPriv->value, NULL, 10) == 1)
 				tmpLobby->is_private = 1;
+
+			if(tmpRecordTracks != NULL && strtoul(tmpRecordTracks->value, NULL, 10) == 1)
+				tmpLobby->record_tracks = 1;
 			
 			if(tmpClients == NULL)
 			{
@@ -120,27 +162,62 @@ int config_parse_file(const char* filename)
 					tmpLobby->max_clients = 100;
 			}
 			JANUS_LOG(LOG_VERB, "[Stream Lobby] Max clients: %d\n", tmpLobby->max_clients);
+
+			//Play out delay bounds are given in milliseconds
+			tmpLobby->min_playout_delay = SETTINGS_MIN_PLAYOUT_DELAY;
+			tmpLobby->max_playout_delay = SETTINGS_MAX_PLAYOUT_DELAY;
+			if(tmpMinDelay != NULL)
+				tmpLobby->min_playout_delay = 1000*strtoul(tmpMinDelay->value, NULL, 10);
+			if(tmpMaxDelay != NULL)
+				tmpLobby->max_playout_delay = 1000*strtoul(tmpMaxDelay->value, NULL, 10);
+			if(tmpLobby->max_playout_delay < tmpLobby->min_playout_delay)
+				tmpLobby->max_playout_delay = tmpLobby->min_playout_delay;
+			JANUS_LOG(LOG_VERB, "[Stream Lobby] Play out delay: %u-%uus\n", tmpLobby->min_playout_delay, tmpLobby->max_playout_delay);
+
+			tmpLobby->max_mixed_speakers = SETTINGS_MAX_MIXED_SPEAKERS;
+			if(tmpSpeakers != NULL)
+				tmpLobby->max_mixed_speakers = strtoul(tmpSpeakers->value, NULL, 10);
+			JANUS_LOG(LOG_VERB, "[Stream Lobby] Max mixed speakers: %u\n", tmpLobby->max_mixed_speakers);
+
+			tmpLobby->submix_threshold = SETTINGS_SUBMIX_THRESHOLD;
+			if(tmpSubmixThreshold != NULL)
+				tmpLobby->submix_threshold = strtoul(tmpSubmixThreshold->value, NULL, 10);
+			JANUS_LOG(LOG_VERB, "[Stream Lobby] Submix threshold: %u\n", tmpLobby->submix_threshold);
+
+			audio_profile_defaults(&tmpLobby->profile);
+			if(tmpRate != NULL)
+				tmpLobby->profile.sample_rate = strtol(tmpRate->value, NULL, 10);
+			if(tmpPtime != NULL)
+				tmpLobby->profile.ptime = strtol(tmpPtime->value, NULL, 10);
+			if(tmpBitrate != NULL)
+				tmpLobby->profile.bitrate = strtol(tmpBitrate->value, NULL, 10);
+			if(tmpComplexity != NULL)
+				tmpLobby->profile.complexity = strtol(tmpComplexity->value, NULL, 10);
+			if(tmpApplication != NULL)
+			{
+				if(strcmp(tmpApplication->value, "voip") == 0)
+					tmpLobby->profile.application = OPUS_APPLICATION_VOIP;
+				else if(strcmp(tmpApplication->value, "audio") == 0)
+					tmpLobby->profile.application = OPUS_APPLICATION_AUDIO;
+				else if(strcmp(tmpApplication->value, "lowdelay") == 0)
+					tmpLobby->profile.application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+				else
+					tmpLobby->profile.application = -1;
+			}
+			if(audio_profile_validate(&tmpLobby->profile) != 0)
+			{
+				JANUS_LOG(LOG_ERR, "[Stream Lobby] Invalid audio settings for lobby \"%s\", using the defaults\n", tmpLobby->name);
+				audio_profile_defaults(&tmpLobby->profile);
+			}
+			JANUS_LOG(LOG_VERB, "[Stream Lobby] Audio profile: %dHz, %dms, %dbps, complexity %d\n", tmpLobby->profile.sample_rate, tmpLobby->profile.ptime, tmpLobby->profile.bitrate, tmpLobby->profile.complexity);
 			
 			if(tmpAudio != NULL && strtol(tmpAudio->value, NULL, 10) == 1)
 			{
-				int error = 0;
-				//tmpLobby->encoder = opus_encoder_create(SETTINGS_SAMPLE_RATE, SETTINGS_CHANNELS, OPUS_APPLICATION_VOIP, &error);
-				tmpLobby->encoder = opus_encoder_create(SETTINGS_SAMPLE_RATE, SETTINGS_CHANNELS, OPUS_APPLICATION_AUDIO, &error);
-				if(error != OPUS_OK) {
+				tmpLobby->encoder = audio_create_encoder(&tmpLobby->profile);
+				if(tmpLobby->encoder == NULL) {
 					JANUS_LOG(LOG_ERR, "[Stream Lobby] Error creating audio encoder for lobby \"%s\". Disabling audio.\n", tmpLobby->name);
-					tmpLobby->encoder = NULL;
 				} else {
 					JANUS_LOG(LOG_DBG, "Opus Encoder successfully created for lobby \"%s\"\n", tmpLobby->name);
-					//Sample rate
-					opus_encoder_ctl(tmpLobby->encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_FULLBAND));
-					//opus complexity setting
-					opus_encoder_ctl(tmpLobby->encoder, OPUS_SET_COMPLEXITY(SETTINGS_OPUS_COMPLEXITY));
-					//constant bit rate
-					opus_encoder_ctl(tmpLobby->encoder, OPUS_SET_VBR(0));
-					//bit rate
-					opus_encoder_ctl(tmpLobby->encoder, OPUS_SET_BITRATE(SETTINGS_BITRATE));
-					//FEC
-					opus_encoder_ctl(tmpLobby->encoder, OPUS_SET_INBAND_FEC(0));
 					tmpLobby->audio_enabled = 1;
 				}
 			}
@@ -159,6 +236,9 @@ int config_parse_file(const char* filename)
 			
 			pthread_mutex_init(&tmpLobby->mutex, NULL);
 			pthread_mutex_init(&tmpLobby->peerlist_mutex, NULL);
+			pthread_mutex_init(&tmpLobby->snapshot_mutex, NULL);
+			pthread_cond_init(&tmpLobby->snapshot_cond, NULL);
+			pthread_mutex_init(&tmpLobby->roster_mutex, NULL);
 			tmpLobby->participants = calloc(tmpLobby->max_clients, sizeof(peer*));
 			
 			int result = addLobby(tmpLobby);
@@ -167,6 +247,9 @@ int config_parse_file(const char* filename)
 				JANUS_LOG(LOG_INFO, "Could not add lobby \"%s\" to hash table!\n", tmpLobby->name);
 				pthread_mutex_destroy(&tmpLobby->mutex);
 				pthread_mutex_destroy(&tmpLobby->peerlist_mutex);
+				pthread_mutex_destroy(&tmpLobby->snapshot_mutex);
+				pthread_cond_destroy(&tmpLobby->snapshot_cond);
+				pthread_mutex_destroy(&tmpLobby->roster_mutex);
 				free(tmpLobby->participants);
 				tmpLobby->participants = NULL;
 				if(tmpLobby->encoder != NULL) {
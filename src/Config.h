@@ -1,13 +1,42 @@
 #pragma once
 // Plugin settings
 #define SETTINGS_CHANNELS		1
+//Defaults for lobbies' audio profiles
 #define SETTINGS_SAMPLE_RATE		48000
 #define SETTINGS_OPUS_COMPLEXITY	10
-//Frame sizes for 48kHz: 120 [2.5ms], 240 [5ms], 480 [10ms], 960 [20ms], 1920 [40ms], 2880 [60ms]
-#define SETTINGS_OPUS_FRAME_SIZE	960
-#define SETTINGS_RAW_BUFFER_SIZE	3840	//Size in samples - support uncompressed frame sizes up to 40ms
+#define SETTINGS_PTIME			20 //Milliseconds: 10, 20, 40 or 60
 #define SETTINGS_BITRATE		256000
+#define SETTINGS_OPUS_APPLICATION	OPUS_APPLICATION_AUDIO
+#define SETTINGS_MAX_FRAME_SIZE		2880	//Size in samples - the longest frame any profile mixes, 60ms at 48kHz
+#define SETTINGS_RAW_BUFFER_SIZE	3840	//Size in samples - support uncompressed frame sizes up to 40ms
 #define SETTINGS_OUTPUT_BUFFER_SIZE	1000
-#define SETTINGS_PEER_INPUT_DELAY	50000 //Microseconds
+#define SETTINGS_MAX_PAYLOAD_TYPES	4 //Distinct Opus payload types a lobby keeps separate outgoing packets for
+#define SETTINGS_RTP_CLOCK_RATE		48000 //Opus always uses a 48kHz RTP clock
+#define SETTINGS_MIN_PLAYOUT_DELAY	10000 //Microseconds
+#define SETTINGS_MAX_PLAYOUT_DELAY	200000 //Microseconds
+#define SETTINGS_PLAYOUT_JITTER_FACTOR	4 //Play out delay is this many times the peer's jitter
+#define SETTINGS_SILENCE_AUDIO_LEVEL	90 //RFC 6464 level (-dBov) at which a peer's packets aren't decoded
+#define SETTINGS_COMFORT_NOISE_BYTES	8 //SILK frames up to this size are treated as comfort noise
+#define SETTINGS_MAX_MIXED_SPEAKERS	0 //Loudest peers mixed each tick, 0 mixes everybody
+#define SETTINGS_SPEAKER_HYSTERESIS	6 //dB a peer has to be louder by to replace somebody already being mixed
+#define SETTINGS_MAX_SPEAKER_STREAMS	32 //Speakers per lobby that get their own mix-minus stream, the rest hear themselves
+#define SETTINGS_SUBMIX_THRESHOLD	250 //Media peers a lobby needs before its mix is split between threads, 0 never splits it
+#define SETTINGS_MAX_SUBMIX_SHARDS	8 //Most pieces a lobby's mix is split into
+#define SETTINGS_SPEAKER_HANGOVER	50 //Ticks a quiet speaker keeps their mix-minus stream for
+#define SETTINGS_QUALITY_TIERS		3 //Listener quality tiers, each with its own shared encoder
+#define SETTINGS_TIER_UPGRADE_REPORTS	5 //Good receiver reports in a row before a listener moves up a tier
+#define SETTINGS_MIN_BITRATE		6000 //Lowest bitrate any tier is encoded at
+#define SETTINGS_ROSTER_INTERVAL	150 //Milliseconds a lobby's joins, leaves and nick changes are gathered for before they're sent out together
+#define SETTINGS_DIRECTORY_INTERVAL	250 //Milliseconds between rebuilds of the lobby directory, changes in between are served together by the next one
+#define SETTINGS_DIRECTORY_TOMBSTONES	64 //Removed lobbies the directory remembers for clients asking what changed since an older version
+#define SETTINGS_RTCP_INTERVAL		5000000 //Microseconds between sender reports to each listener
+#define SETTINGS_RTCP_CNAME		"streamlobby"
+#define SETTINGS_RECORDER_SLOTS		64 //Frames a recording of the mix can queue for the disk, a bit over a second at 20ms
+#define SETTINGS_RECORDER_INPUT_SLOTS	2048 //Packets the recording of everybody's incoming audio can queue
+#define SETTINGS_CAPTURE_SLOTS		8192 //Packets the traffic capture can queue, shared by every peer
+#define SETTINGS_RECORDING_SEGMENT_TIME	3600 //Seconds of recording per file before moving on to the next one, 0 for no limit
+#define SETTINGS_JITTER_BUFFER_SLOTS	64 //Packets, must be a power of two
+#define SETTINGS_PACKET_POOL_SIZE	72 //Packets, a full jitter buffer plus the ones being decoded
+#define SETTINGS_PACKET_SLOT_SIZE	1500 //Bytes, one MTU
 
 int config_parse_file(const char* filename);
@@ -0,0 +1,157 @@
+/*
+ * Per-peer jitter buffer
+ *
+ * Packets are stored by sequence number, so inserting and popping are both O(1).
+ * Sequence numbers are extended relative to the play out position, which takes
+ * care of the 16 bit wraparound.
+ * The buffer also keeps the peer's interarrival jitter estimate, used to pick
+ * the peer's play out delay.
+ */
+
+#include <stdlib.h>
+
+#include "JitterBuffer.h"
+#include "Audio.h"
+
+int jitter_buffer_init(jitter_buffer* jb, unsigned int capacity)
+{
+	//Capacity has to be a power of two
+	if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+		return 1;
+	jb->slots = calloc(capacity, sizeof(rtp_wrapper*));
+	if(jb->slots == NULL)
+		return 2;
+	jb->capacity = capacity;
+	jb->count = 0;
+	jb->next_seq = 0;
+	jb->started = 0;
+	jb->last_timestamp = 0;
+	jb->jitter = 0;
+	jb->last_arrival = 0;
+	jb->have_arrival = 0;
+	return 0;
+}
+
+/* Packets still in the buffer have to be removed with jitter_buffer_drain() first */
+void jitter_buffer_destroy(jitter_buffer* jb)
+{
+	free(jb->slots);
+	jb->slots = NULL;
+	jb->capacity = 0;
+	jb->count = 0;
+	jb->started = 0;
+}
+
+int jitter_buffer_insert(jitter_buffer* jb, rtp_wrapper* packet)
+{
+	if(!jb->started)
+	{
+		jb->next_seq = packet->seq_number;
+		jb->started = 1;
+	}
+	int16_t delta = (int16_t)(packet->seq_number - (uint16_t)jb->next_seq);
+	if(delta < 0 || delta >= (int)jb->capacity)
+	{
+		//Nothing is buffered, so the stream most likely jumped. Start playing out from here
+		if(jb->count == 0 && (delta >= (int)jb->capacity || delta <= -(int)jb->capacity))
+		{
+			jb->next_seq += delta;
+			delta = 0;
+		}
+		else if(delta < 0)
+			return JITTER_BUFFER_LATE;
+		else
+			return JITTER_BUFFER_TOO_FAR_AHEAD;
+	}
+
+	unsigned int slot = (jb->next_seq + delta) & (jb->capacity - 1);
+	if(jb->slots[slot] != NULL)
+		return JITTER_BUFFER_LATE;
+	jb->slots[slot] = packet;
+	jb->count++;
+	return JITTER_BUFFER_INSERTED;
+}
+
+/* Returns the next packet to be played out, or NULL if it hasn't arrived (yet) */
+rtp_wrapper* jitter_buffer_peek(jitter_buffer* jb)
+{
+	if(jb->count == 0)
+		return NULL;
+	return jb->slots[jb->next_seq & (jb->capacity - 1)];
+}
+
+rtp_wrapper* jitter_buffer_pop(jitter_buffer* jb)
+{
+	unsigned int slot = jb->next_seq & (jb->capacity - 1);
+	rtp_wrapper* packet = jb->slots[slot];
+	if(packet == NULL)
+		return NULL;
+	jb->slots[slot] = NULL;
+	jb->count--;
+	jb->next_seq++;
+	return packet;
+}
+
+/* Give up on the next packet (i.e. it was concealed instead) */
+void jitter_buffer_skip(jitter_buffer* jb)
+{
+	unsigned int slot = jb->next_seq & (jb->capacity - 1);
+	if(jb->slots[slot] != NULL)
+	{
+		//Shouldn't happen, the packet is there. Leave it to be popped
+		return;
+	}
+	jb->next_seq++;
+}
+
+/* Removes any packet from the buffer, used to free everything on teardown or resync */
+rtp_wrapper* jitter_buffer_drain(jitter_buffer* jb)
+{
+	if(jb->count == 0)
+	{
+		jb->started = 0;
+		return NULL;
+	}
+	for(unsigned int i = 0; i < jb->capacity; i++)
+	{
+		if(jb->slots[i] != NULL)
+		{
+			rtp_wrapper* packet = jb->slots[i];
+			jb->slots[i] = NULL;
+			jb->count--;
+			return packet;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Update the interarrival jitter estimate with a packet's RTP timestamp and arrival time (microseconds)
+ * Uses the integer form from RFC 3550 appendix A.8
+ */
+void jitter_buffer_update_jitter(jitter_buffer* jb, uint32_t timestamp, int64_t arrival, int clock_rate)
+{
+	if(!jb->have_arrival)
+	{
+		jb->last_timestamp = timestamp;
+		jb->last_arrival = arrival;
+		jb->have_arrival = 1;
+		return;
+	}
+	//Difference in transit times, D(i,j) = (Rj - Ri) - (Sj - Si)
+	int64_t d = (arrival - jb->last_arrival)*clock_rate/1000000 - (int32_t)(timestamp - jb->last_timestamp);
+	jb->last_timestamp = timestamp;
+	jb->last_arrival = arrival;
+	if(d < 0)
+		d = -d;
+	//Anything over a second is a discontinuity in the stream, not jitter
+	if(d > clock_rate)
+		return;
+	jb->jitter += d - ((jb->jitter + 8) >> 4);
+}
+
+/* Current jitter estimate in microseconds */
+unsigned int jitter_buffer_get_jitter(jitter_buffer* jb, int clock_rate)
+{
+	return (uint64_t)(jb->jitter >> 4) * 1000000 / clock_rate;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+#define JITTER_BUFFER_INSERTED		0
+#define JITTER_BUFFER_LATE		1	//Already played or duplicate, caller keeps ownership
+#define JITTER_BUFFER_TOO_FAR_AHEAD	2	//Outside the buffer window, caller keeps ownership
+
+struct rtp_wrapper;
+
+/*
+ * Fixed capacity jitter buffer with one slot per RTP sequence number
+ * Slot index is the extended sequence number modulo the capacity (which is a power of two)
+ */
+typedef struct jitter_buffer {
+	struct rtp_wrapper** slots;
+	unsigned int capacity;
+	unsigned int count;
+	uint32_t next_seq; //Extended sequence number of the next packet to be played out
+	//Interarrival jitter (RFC 3550 section 6.4.1)
+	uint32_t last_timestamp;
+	uint32_t jitter; //Timestamp units, scaled by 16
+	int64_t last_arrival;
+	unsigned int started : 1;
+	unsigned int have_arrival : 1;
+} jitter_buffer;
+
+int			jitter_buffer_init(jitter_buffer*, unsigned int);
+void			jitter_buffer_destroy(jitter_buffer*);
+int			jitter_buffer_insert(jitter_buffer*, struct rtp_wrapper*);
+struct rtp_wrapper*	jitter_buffer_peek(jitter_buffer*);
+struct rtp_wrapper*	jitter_buffer_pop(jitter_buffer*);
+void			jitter_buffer_skip(jitter_buffer*);
+struct rtp_wrapper*	jitter_buffer_drain(jitter_buffer*);
+void			jitter_buffer_update_jitter(jitter_buffer*, uint32_t, int64_t, int);
+unsigned int		jitter_buffer_get_jitter(jitter_buffer*, int);
@@ -1,64 +1,75 @@
+#include <janus/utils.h> //janus_get_monotonic_time
+
 #include "Lobbies.h"
 #include "Sessions.h"
 #include "Audio.h"
 #include "Messaging.h"
+#include "Config.h"
 static unsigned int lobby_limit = 50;
 static unsigned int lobby_count;
-static int threadinit_result;
 static GHashTable* lobbies;
 static pthread_mutex_t lobby_mutex;
+//Lobby directory for list_rooms
+static lobby_directory* directory; //Atomic, NULL until somebody first asks for it
+static pthread_mutex_t directory_mutex; //Replacing directory and taking references to it
+static pthread_mutex_t directory_build_mutex; //Rebuilding it. Everything below, and the lobbies' directory entries
+static json_t* directory_tombstones; //Removed lobbies, oldest first
+static guint64 directory_version, directory_oldest;
+static gint64 directory_built;
+static int directory_removals; //Lobbies removed since the last rebuild
+static gint directory_dirty = 1; //Atomic
+
+static void lobbies_free_snapshots(lobby*);
+static void lobbies_reclaim_snapshots(lobby*);
+static void lobbies_directory_remove(lobby*);
 
 int lobbies_init()
 {
 	lobbies = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
 	pthread_mutex_init(&lobby_mutex, NULL);
-	pthread_mutex_init(&audio_mix_threads_mutex, NULL);
+	directory_tombstones = json_array();
+	pthread_mutex_init(&directory_mutex, NULL);
+	pthread_mutex_init(&directory_build_mutex, NULL);
 	return 0;
 }
 
+static void lobbies_free_directory()
+{
+	lobbies_release_directory(directory);
+	directory = NULL;
+	json_decref(directory_tombstones);
+	directory_tombstones = NULL;
+	pthread_mutex_destroy(&directory_mutex);
+	pthread_mutex_destroy(&directory_build_mutex);
+}
+
 int lobbies_shutdown()
 {
 	if(g_atomic_int_get(&lobby_count) == 0)
+	{
+		lobbies_free_directory();
 		return 0;
+	}
 
 	GList *items, *current_item;
 	lobby* room;
-	char wait = 0;
 	
 	items = lobbies_get_lobbies();
 	current_item = items;
 
-	//Remove all peers and mark rooms with audio for shutdown
+	//Remove all peers and stop mixing audio
 	while(current_item)
 	{
 		room = current_item->data;
-		
-		pthread_mutex_lock(&room->mutex);
-			if(room->audio_enabled)
-			{
-				wait = 1;
-				room->die = 1;
-			}
-		pthread_mutex_unlock(&room->mutex);
+		g_atomic_int_set(&room->die, 1);
+		lobbies_directory_remove(room);
 		if(g_atomic_int_get(&room->current_clients) > 0)
 			lobbies_remove_all_peers(current_item->data);
+		audio_stop_mixer(room);
+		message_stop_roster(room);
 		current_item = current_item->next;
 	}
 	
-	//Wait on audio mixing threads
-	if(wait)
-	{
-		pthread_cond_init(&audio_destroy_threads_cond, NULL);
-		
-		pthread_mutex_lock(&audio_mix_threads_mutex);
-			while(g_atomic_int_get(&audio_mix_thread_count) > 0)
-				pthread_cond_wait(&audio_destroy_threads_cond, &audio_mix_threads_mutex);
-		pthread_mutex_unlock(&audio_mix_threads_mutex);
-
-		pthread_cond_destroy(&audio_destroy_threads_cond);
-		pthread_mutex_destroy(&audio_mix_threads_mutex);
-	}
-	
 	//Free lobby resources
 	current_item = items;
 	while(current_item)
@@ -70,6 +81,8 @@ int lobbies_shutdown()
 		free(room->participants);
 		room->participants = NULL;
 		pthread_mutex_destroy(&room->peerlist_mutex);
+		pthread_mutex_destroy(&room->roster_mutex);
+		lobbies_free_snapshots(room);
 		//Opus stuff
 		opus_encoder_destroy(room->encoder);
 		room->encoder = NULL;
@@ -90,6 +103,7 @@ int lobbies_shutdown()
 	}
 
 	g_list_free(items);
+	lobbies_free_directory();
 
 	pthread_mutex_lock(&lobby_mutex);
 		g_hash_table_destroy(lobbies);
@@ -117,25 +131,10 @@ int addLobby(lobby* newLobby)
 	
 	if(newLobby->audio_enabled)
 	{
-		//audio mixing thread
-		threadinit_result = pthread_create(&newLobby->mix_thread, NULL, &audio_mix_thread, newLobby);
-		if(threadinit_result != 0) //failure
+		//Mixing is shared between lobbies, this just gives it the lobby to tick
+		if(audio_start_mixer(newLobby) != 0) //failure
 		{
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create audio mixing thread for lobby \"%s\". Disabling audio.\n", newLobby->name);
-			switch(threadinit_result) {
-				case EAGAIN:
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] EAGAIN - Insufficient resources OR a system-imposed thread limit was violated\n");
-					break;
-				case EINVAL:
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] EINVAL - Invalid thread attributes\n");
-					break;
-				case EPERM:
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] EPERM - No permission to set the scheduling policy and parameters specified in attr\n");
-					break;
-				default:
-					JANUS_LOG(LOG_ERR, "[Stream Lobby] Unknown error code for creating thread\n");
-					break;
-			}
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't start mixing audio for lobby \"%s\". Disabling audio.\n", newLobby->name);
 			newLobby->audio_enabled = 0;
 			newLobby->audio_failed = 1;
 			opus_encoder_destroy(newLobby->encoder);
@@ -143,10 +142,14 @@ int addLobby(lobby* newLobby)
 		}
 	}
 	
+	if(message_start_roster(newLobby) != 0)
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't schedule roster events for lobby \"%s\", they'll be sent one change at a time\n", newLobby->name);
+
 	pthread_mutex_lock(&lobby_mutex);
 		g_hash_table_insert(lobbies, newLobby->name, newLobby);
 	pthread_mutex_unlock(&lobby_mutex);
 	g_atomic_int_inc(&lobby_count);
+	lobbies_directory_changed(newLobby);
 	JANUS_LOG(LOG_INFO, "Lobby \"%s\" created\n", newLobby->name);
 	return 0;
 }
@@ -157,23 +160,19 @@ void removeLobby(lobby* room)
 		return;
 	
 	//Mark lobby for death
-	pthread_mutex_lock(&room->mutex);
-		if(room->die == 1)
-		{
-			pthread_mutex_unlock(&room->mutex);
-			return;
-		}
-		JANUS_LOG(LOG_INFO, "Removing lobby \"%s\"\n", room->name);
-		room->die = 1;
-	pthread_mutex_unlock(&room->mutex);
+	if(!g_atomic_int_compare_and_exchange(&room->die, 0, 1))
+		return;
+	JANUS_LOG(LOG_INFO, "Removing lobby \"%s\"\n", room->name);
+	lobbies_directory_remove(room);
 	
 	//Kick everybody out
 	if(g_atomic_int_get(&room->current_clients) > 0)
 		lobbies_remove_all_peers(room);
+	message_stop_roster(room);
 
-	//Wait on the audio mixing thread and destroy audio resources
+	//Wait on the lobby's mixer and destroy audio resources
 	if(room->audio_enabled) {
-		pthread_join(room->mix_thread, NULL);
+		audio_stop_mixer(room);
 		opus_encoder_destroy(room->encoder);
 		room->encoder = NULL;
 	}
@@ -183,6 +182,8 @@ void removeLobby(lobby* room)
 	room->participants = NULL;
 	pthread_mutex_destroy(&room->mutex);
 	pthread_mutex_destroy(&room->peerlist_mutex);
+	pthread_mutex_destroy(&room->roster_mutex);
+	lobbies_free_snapshots(room);
 	//Destroy the lobby structure
 	pthread_mutex_lock(&lobby_mutex);
 		int result = g_hash_table_remove(lobbies, room->name);
@@ -206,7 +207,7 @@ void lobbies_remove_peer(peer* dude)
 	if(dude == NULL)
 		return;
 	pthread_mutex_lock(&dude->mutex);
-		if(dude->comms_ready)
+		if(g_atomic_int_get(&dude->comms_ready))
 			audio_hangup_media_no_lock(dude->session);
 		if(dude->current_lobby == NULL)
 		{
@@ -214,16 +215,20 @@ void lobbies_remove_peer(peer* dude)
 			JANUS_LOG(LOG_VERB, "[Stream Lobby] Peer is not in any lobby\n");
 			return;
 		}
-		char* lobby_name = dude->current_lobby->name;
-		message_lobby(dude->current_lobby, "peer_leave", dude);
-		g_atomic_int_dec_and_test(&dude->current_lobby->current_clients);
+		lobby* room = dude->current_lobby;
+		message_lobby(room, "peer_leave", dude);
+		g_atomic_int_dec_and_test(&room->current_clients);
+		lobbies_directory_changed(room);
 		//TODO - I'm not certain about this line, particularly the ampersand
-		g_atomic_pointer_set(&dude->current_lobby->participants[dude->lobby_id], NULL);
+		g_atomic_pointer_set(&room->participants[dude->lobby_id], NULL);
+		lobbies_publish_snapshot(room);
 		dude->current_lobby = NULL;
 		char id[37];
 		uuid_unparse(dude->uuid, id);
-		JANUS_LOG(LOG_INFO, "Session %s (%s) removed from lobby (%s)\n", id, dude->nick, lobby_name);
+		JANUS_LOG(LOG_INFO, "Session %s (%s) removed from lobby (%s)\n", id, dude->nick, room->name);
 	pthread_mutex_unlock(&dude->mutex);
+	//The mixer locks peers while it has a snapshot, so this has to wait until the peer's lock is released
+	lobbies_synchronize_snapshots(room);
 }
 
 /*
@@ -236,11 +241,11 @@ void lobbies_remove_all_peers(lobby* room)
 	pthread_mutex_lock(&room->peerlist_mutex);
 		for(int i = 0; i < room->max_clients; i++)
 		{
-			if(room->participants[i] == NULL);
+			dude = g_atomic_pointer_get(&room->participants[i]);
+			if(dude == NULL)
 				continue;
-			dude = room->participants[i];
 			pthread_mutex_lock(&dude->mutex);
-				if(dude->comms_ready)
+				if(g_atomic_int_get(&dude->comms_ready))
 					audio_hangup_media_no_lock(dude->session);
 				if(dude->current_lobby == NULL)
 				{
@@ -254,7 +259,316 @@ void lobbies_remove_all_peers(lobby* room)
 				dude->current_lobby = NULL;
 			pthread_mutex_unlock(&dude->mutex);
 		}
+		lobbies_publish_snapshot(room);
 	pthread_mutex_unlock(&room->peerlist_mutex);
+	lobbies_directory_changed(room);
+	lobbies_synchronize_snapshots(room);
+}
+
+/*
+ * Replace the lobby's participant snapshot with one built from the participants array
+ * Called after every change to the array or to a participant's comms_ready
+ */
+void lobbies_publish_snapshot(lobby* room)
+{
+	pthread_mutex_lock(&room->snapshot_mutex);
+		unsigned int count = 0;
+		for(unsigned int i = 0; i < room->max_clients; i++)
+		{
+			if(g_atomic_pointer_get(&room->participants[i]) != NULL)
+				count++;
+		}
+		participant_snapshot* snapshot = malloc(sizeof(participant_snapshot) + count*sizeof(peer*));
+		if(snapshot == NULL)
+		{
+			//Readers keep using the old one, which is still safe, just out of date
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Memory allocation failure, participant list of lobby \"%s\" not updated\n", room->name);
+			pthread_mutex_unlock(&room->snapshot_mutex);
+			return;
+		}
+		//Media peers at the front, everybody else at the back. Slots can change while
+		//we're looking at them, anything that doesn't fit is caught by the next publish
+		unsigned int front = 0, back = count;
+		for(unsigned int i = 0; i < room->max_clients && front < back; i++)
+		{
+			peer* dude = g_atomic_pointer_get(&room->participants[i]);
+			if(dude == NULL)
+				continue;
+			if(g_atomic_int_get(&dude->comms_ready))
+				snapshot->peers[front++] = dude;
+			else
+				snapshot->peers[--back] = dude;
+		}
+		//Close the gap left by peers that went away since they were counted
+		if(back > front)
+			memmove(&snapshot->peers[front], &snapshot->peers[back], (count - back)*sizeof(peer*));
+		snapshot->media_count = front;
+		snapshot->count = front + count - back;
+		snapshot->retired_next = NULL;
+
+		participant_snapshot* old = g_atomic_pointer_get(&room->snapshot);
+		g_atomic_pointer_set(&room->snapshot, snapshot);
+		if(old != NULL)
+		{
+			old->generation = g_atomic_int_get(&room->snapshot_generation);
+			old->retired_next = room->retired;
+			room->retired = old;
+		}
+		lobbies_reclaim_snapshots(room);
+	pthread_mutex_unlock(&room->snapshot_mutex);
+}
+
+/*
+ * Free the replaced snapshots nobody can be using anymore, and start the next grace period if
+ * there are more waiting. Generations only move on once the previous one's readers are gone, so
+ * readers that started before a snapshot was replaced are all counted under its generation.
+ * Needs the lobby's snapshot lock
+ */
+static void lobbies_reclaim_snapshots(lobby* room)
+{
+	while(1)
+	{
+		guint generation = g_atomic_int_get(&room->snapshot_generation);
+		if(room->snapshot_grace)
+		{
+			if(g_atomic_int_get(&room->snapshot_readers[(generation - 1) & 1]) > 0)
+				return;
+			//Newest first, so everything from the first one replaced before this generation on can go
+			participant_snapshot** link = &room->retired;
+			while(*link != NULL && (*link)->generation == generation)
+				link = &(*link)->retired_next;
+			while(*link != NULL)
+			{
+				participant_snapshot* old = *link;
+				*link = old->retired_next;
+				free(old);
+			}
+			room->snapshot_grace = 0;
+			pthread_cond_broadcast(&room->snapshot_cond);
+		}
+		if(room->retired == NULL)
+			return;
+		//Readers from here on are counted apart from the ones that might have the retired snapshots
+		g_atomic_int_inc(&room->snapshot_generation);
+		room->snapshot_grace = 1;
+	}
+}
+
+/* May return NULL if nobody has joined yet. Has to be released even then, with what's put in reader */
+participant_snapshot* lobbies_acquire_snapshot(lobby* room, int* reader)
+{
+	guint generation;
+	do
+	{
+		generation = g_atomic_int_get(&room->snapshot_generation);
+		g_atomic_int_inc(&room->snapshot_readers[generation & 1]);
+		//If the generation moved on in between, a grace period might already have stopped waiting on us
+		if((guint) g_atomic_int_get(&room->snapshot_generation) == generation)
+			break;
+		g_atomic_int_add(&room->snapshot_readers[generation & 1], -1);
+	} while(1);
+	*reader = generation & 1;
+	return g_atomic_pointer_get(&room->snapshot);
+}
+
+/* The last reader of a generation a grace period is waiting on finishes it */
+void lobbies_release_snapshot(lobby* room, int reader)
+{
+	if(!g_atomic_int_dec_and_test(&room->snapshot_readers[reader]))
+		return;
+	if(reader == (g_atomic_int_get(&room->snapshot_generation) & 1))
+		return;
+	pthread_mutex_lock(&room->snapshot_mutex);
+		lobbies_reclaim_snapshots(room);
+	pthread_mutex_unlock(&room->snapshot_mutex);
+}
+
+/*
+ * Wait for everybody who might be using a snapshot from before the call to let it go, so peers
+ * taken out of the lobby before it can't be referenced anymore. Readers that start afterwards
+ * aren't waited on. Must not be called with any peer's lock held
+ */
+void lobbies_synchronize_snapshots(lobby* room)
+{
+	pthread_mutex_lock(&room->snapshot_mutex);
+		//Snapshots replaced up to now are in this generation or earlier ones. They're gone once its
+		//grace period, which starts when the generation moves on, is over
+		guint generation = g_atomic_int_get(&room->snapshot_generation);
+		lobbies_reclaim_snapshots(room);
+		while(room->retired != NULL)
+		{
+			guint passed = g_atomic_int_get(&room->snapshot_generation) - generation;
+			if(passed >= 2 || (passed == 1 && !room->snapshot_grace))
+				break;
+			pthread_cond_wait(&room->snapshot_cond, &room->snapshot_mutex);
+			lobbies_reclaim_snapshots(room);
+		}
+	pthread_mutex_unlock(&room->snapshot_mutex);
+}
+
+static void lobbies_free_snapshots(lobby* room)
+{
+	free(room->snapshot);
+	room->snapshot = NULL;
+	while(room->retired != NULL)
+	{
+		participant_snapshot* old = room->retired;
+		room->retired = old->retired_next;
+		free(old);
+	}
+	pthread_mutex_destroy(&room->snapshot_mutex);
+	pthread_cond_destroy(&room->snapshot_cond);
+}
+
+/* Has the lobby's directory entry rebuilt, along with the directory, the next time it's asked for */
+void lobbies_directory_changed(lobby* room)
+{
+	g_atomic_int_set(&room->directory_dirty, 1);
+	g_atomic_int_set(&directory_dirty, 1);
+}
+
+static json_t* lobbies_directory_entry(lobby* room, guint64 version)
+{
+	json_t* entry = json_object();
+	pthread_mutex_lock(&room->mutex);
+		json_object_set_new(entry, "name", json_string(room->name));
+		json_object_set_new(entry, "subject", json_string(room->subj));
+		json_object_set_new(entry, "description", json_string(room->desc));
+		json_object_set_new(entry, "audio_enabled", json_integer(room->audio_enabled));
+		json_object_set_new(entry, "video_enabled", json_integer(room->video_enabled));
+		json_object_set_new(entry, "video_active", json_integer(room->video_active));
+		json_object_set_new(entry, "max_clients", json_integer(room->max_clients));
+	pthread_mutex_unlock(&room->mutex);
+	json_object_set_new(entry, "connected_clients", json_integer(g_atomic_int_get(&room->current_clients)));
+	json_object_set_new(entry, "version", json_integer(version));
+	return entry;
+}
+
+/*
+ * Take a lobby that's been marked for death out of the directory, leaving a tombstone
+ * for clients that last saw it. Waits for any rebuild that might be looking at it
+ */
+static void lobbies_directory_remove(lobby* room)
+{
+	pthread_mutex_lock(&directory_build_mutex);
+		//No entry means it's never been in a directory anybody was given
+		if(room->directory_entry != NULL)
+		{
+			json_t* tombstone = json_object();
+			json_object_set_new(tombstone, "name", json_string(room->name));
+			json_object_set_new(tombstone, "private", json_integer(room->is_private));
+			json_object_set_new(tombstone, "version", json_integer(directory_version + 1));
+			json_array_append_new(directory_tombstones, tombstone);
+			while(json_array_size(directory_tombstones) > SETTINGS_DIRECTORY_TOMBSTONES)
+			{
+				directory_oldest = json_integer_value(json_object_get(json_array_get(directory_tombstones, 0), "version"));
+				json_array_remove(directory_tombstones, 0);
+			}
+			json_decref(room->directory_entry);
+			room->directory_entry = NULL;
+			directory_removals = 1;
+			g_atomic_int_set(&directory_dirty, 1);
+		}
+	pthread_mutex_unlock(&directory_build_mutex);
+}
+
+/*
+ * Publish a new directory if anything's changed since the last one. Entries of lobbies
+ * that haven't changed are shared with it rather than built again. Needs the build lock
+ */
+static void lobbies_rebuild_directory()
+{
+	g_atomic_int_set(&directory_dirty, 0);
+	directory_built = janus_get_monotonic_time();
+	guint64 version = directory_version + 1;
+	int changed = directory_removals || directory == NULL;
+	json_t* rooms = json_array();
+	json_t* public_rooms = json_array();
+	GList* items = lobbies_get_lobbies();
+	for(GList* item = items; item != NULL; item = item->next)
+	{
+		lobby* room = item->data;
+		//Its entry's gone already, or is about to be
+		if(g_atomic_int_get(&room->die))
+			continue;
+		if(g_atomic_int_compare_and_exchange(&room->directory_dirty, 1, 0) || room->directory_entry == NULL)
+		{
+			json_decref(room->directory_entry);
+			room->directory_entry = lobbies_directory_entry(room, version);
+			changed = 1;
+		}
+		json_array_append(rooms, room->directory_entry);
+		if(!room->is_private)
+			json_array_append(public_rooms, room->directory_entry);
+	}
+	g_list_free(items);
+	lobby_directory* snapshot = changed ? malloc(sizeof(lobby_directory)) : NULL;
+	if(snapshot == NULL)
+	{
+		if(changed)
+		{
+			//Entries already built with the new version go out with the next one
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Memory allocation failure, lobby directory not updated\n");
+			g_atomic_int_set(&directory_dirty, 1);
+		}
+		json_decref(rooms);
+		json_decref(public_rooms);
+		return;
+	}
+	snapshot->version = version;
+	snapshot->oldest = directory_oldest;
+	snapshot->rooms = rooms;
+	snapshot->public_rooms = public_rooms;
+	snapshot->removed = json_copy(directory_tombstones);
+	snapshot->refs = 1;
+	directory_version = version;
+	directory_removals = 0;
+
+	pthread_mutex_lock(&directory_mutex);
+		lobby_directory* old = directory;
+		g_atomic_pointer_set(&directory, snapshot);
+	pthread_mutex_unlock(&directory_mutex);
+	lobbies_release_directory(old);
+}
+
+/*
+ * The current lobby directory, rebuilt first if something's changed and it's been long enough
+ * since the last rebuild. Joins and leaves in between go out together in the next one.
+ * Returns NULL if it couldn't be built, has to be released otherwise
+ */
+lobby_directory* lobbies_acquire_directory()
+{
+	if(g_atomic_int_get(&directory_dirty))
+	{
+		//Whoever's rebuilding it already will do, unless there's nothing to hand out in the meantime
+		int locked;
+		if(g_atomic_pointer_get(&directory) == NULL)
+			locked = pthread_mutex_lock(&directory_build_mutex) == 0;
+		else
+			locked = pthread_mutex_trylock(&directory_build_mutex) == 0;
+		if(locked)
+		{
+			if(g_atomic_int_get(&directory_dirty) && (directory == NULL || janus_get_monotonic_time() - directory_built >= SETTINGS_DIRECTORY_INTERVAL*1000))
+				lobbies_rebuild_directory();
+			pthread_mutex_unlock(&directory_build_mutex);
+		}
+	}
+	pthread_mutex_lock(&directory_mutex);
+		lobby_directory* snapshot = directory;
+		if(snapshot != NULL)
+			g_atomic_int_inc(&snapshot->refs);
+	pthread_mutex_unlock(&directory_mutex);
+	return snapshot;
+}
+
+void lobbies_release_directory(lobby_directory* snapshot)
+{
+	if(snapshot == NULL || !g_atomic_int_dec_and_test(&snapshot->refs))
+		return;
+	json_decref(snapshot->rooms);
+	json_decref(snapshot->public_rooms);
+	json_decref(snapshot->removed);
+	free(snapshot);
 }
 
 /*
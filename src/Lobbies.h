@@ -6,22 +6,92 @@
 #include <ogg/ogg.h>
 #include <opus/opus.h>
 
+#include <jansson.h>
 #include <janus/plugins/plugin.h>
 #include <uuid/uuid.h>
 
 #define LOBBY_ERROR_LOBBY_LIMIT_REACHED		100
 
+/*
+ * The lobby directory and roster events hand the same JSON to many responses and events, which
+ * Janus serializes on its own threads at the same time. Older jansson marks values as visited while
+ * encoding them, so concurrent encodes of a shared value can fail as circular references, and before
+ * 2.11 its reference counts weren't atomic either. 2.13 is the first that's safe to share values with
+ */
+#if JANSSON_VERSION_HEX < 0x020d00
+#error "Stream Lobby needs jansson 2.13 or newer"
+#endif
+
+/* Lobby's audio settings, everything it decodes, mixes, sends and records follows them */
+typedef struct audio_profile {
+	int sample_rate; //Mixing rate, one of the rates Opus supports (8, 12, 16, 24 or 48kHz)
+	int ptime; //Milliseconds of audio per tick and per packet sent
+	int frame_size; //Samples per channel in a tick
+	int bitrate;
+	int complexity;
+	int application; //OPUS_APPLICATION_*
+} audio_profile;
+
+/*
+ * Read-only copy of a lobby's participants, replaced whenever somebody joins, leaves,
+ * sets up media or hangs up. Used without any locking between lobbies_acquire_snapshot()
+ * and lobbies_release_snapshot(), peers in it aren't freed until it's released.
+ * Readers are counted by the generation they started in, a replaced snapshot is freed once
+ * every reader from the generation it was replaced in is done, see lobbies_reclaim_snapshots()
+ */
+typedef struct participant_snapshot {
+	unsigned int count;
+	unsigned int media_count; //The first media_count peers have media set up
+	guint generation; //Lobby's snapshot generation when it was replaced
+	struct participant_snapshot* retired_next;
+	struct peer* peers[];
+} participant_snapshot;
+
+/*
+ * Read-only listing of the lobbies for list_rooms, replaced when one of them changes.
+ * Shared by every request between lobbies_acquire_directory() and lobbies_release_directory(),
+ * so its JSON is only ever referenced, never modified, see the jansson check above.
+ * Each entry has the version it last changed in
+ */
+typedef struct lobby_directory {
+	guint64 version;
+	guint64 oldest; //Removed lobbies older than this have been forgotten, changes since earlier versions can't be told
+	json_t* rooms; //Array of every lobby's entry, private ones included
+	json_t* public_rooms; //Array of the entries of lobbies that aren't private
+	json_t* removed; //Array of {"name", "private", "version"} of lobbies removed since oldest
+	gint refs; //Atomic, the published directory holds one
+} lobby_directory;
+
 typedef struct lobby {
 	char name[256], desc[256], subj[128], video_auth[64], video_key[256];
 	unsigned int max_clients;
 	unsigned int current_clients;
-	pthread_t mix_thread;
+	unsigned int min_playout_delay, max_playout_delay; //Microseconds
+	unsigned int max_mixed_speakers; //0 for no limit
+	unsigned int submix_threshold; //Media peers per submix shard, 0 mixes on one thread
+	audio_profile profile;
+	struct audio_mixer* mixer;
+	struct scheduler_task* mix_task;
 	struct peer** participants; //array
 	pthread_mutex_t mutex; //for lobby properties (i.e. name, desc, etc.)
 	pthread_mutex_t peerlist_mutex; //for participants array and client count
+	participant_snapshot* snapshot; //Atomic, NULL until somebody first joins
+	participant_snapshot* retired; //Replaced snapshots that readers might still be using, newest first
+	gint snapshot_generation; //Atomic, moved on to start a grace period for the snapshots replaced before
+	gint snapshot_readers[2]; //Atomic, readers that started in even and odd generations
+	unsigned int snapshot_grace	: 1; //Waiting on the readers from before the last generation
+	pthread_mutex_t snapshot_mutex; //Publishing and retiring snapshots. No other lock is taken while it's held
+	pthread_cond_t snapshot_cond; //Signalled when a grace period ends
+	//Roster changes waiting to go out, see message_lobby()
+	pthread_mutex_t roster_mutex; //Lives as long as the lobby, no other lock is taken while it's held
+	json_t* roster_changes; //Array, NULL if nothing's changed since the last roster event
+	GHashTable* roster_pending; //Peer's uuid to their roster_entry, see message_journal_change()
+	struct scheduler_task* roster_task;
+	//Its entry in the lobby directory, see lobbies_acquire_directory()
+	json_t* directory_entry; //Only touched while the directory is being rebuilt
+	gint directory_dirty; //Atomic, properties or occupancy changed since the entry was built
 	OpusEncoder* encoder;
-	ogg_stream_state* in_ss, *out_ss;
-	FILE* in_file, *out_file;
+	struct recorder* track_recorder, *out_recorder; //Everybody's incoming packets as they were sent, one track each, and the top tier's mix
 	char video_vcodec[16], video_acodec[16];
 	int video_asample, video_achannels;
 	unsigned int audio_enabled	: 1;
@@ -29,7 +99,9 @@ typedef struct lobby {
 	unsigned int video_enabled	: 1;
 	unsigned int video_active	: 1;
 	unsigned int is_private		: 1;
-	unsigned int die		: 1;
+	unsigned int record_tracks	: 1;
+	gint die; //Atomic
+	gint media_peers; //Participants with media set up, atomic
 } lobby;
 
 int lobbies_init();
@@ -40,6 +112,13 @@ void removeLobby(lobby*);
 void lobbies_remove_peer(struct peer*);
 void lobbies_remove_all_peers(lobby*);
 lobby* lobbies_get_lobby(const char*);
+void lobbies_publish_snapshot(lobby*);
+participant_snapshot* lobbies_acquire_snapshot(lobby*, int*);
+void lobbies_release_snapshot(lobby*, int);
+void lobbies_synchronize_snapshots(lobby*);
+void lobbies_directory_changed(lobby*);
+lobby_directory* lobbies_acquire_directory();
+void lobbies_release_directory(lobby_directory*);
 void lobbies_set_limit(unsigned int);
 GList* lobbies_get_lobbies();
 
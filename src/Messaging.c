@@ -1,13 +1,156 @@
 #include <pthread.h>
+#include <ctype.h> //tolower
 #include <strings.h> //strcasecmp
 #include <janus/utils.h> //janus_get_monotonic_time
 #include <janus/plugins/plugin.h>
 #include <janus/apierror.h>
+#include <janus/rtp.h>
 
 #include "Messaging.h"
 #include "StreamLobby.h"
 #include "Config.h"
 #include "Sessions.h"
+#include "Scheduler.h"
+
+static int message_list_rooms(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_join_room(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_leave_room(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_list_peers(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_sdp_pass(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_request_sdp_offer(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_change_nick(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+static int message_not_implemented(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+
+/* Every request a peer can make. Names are lower case, requests are matched without regard to case */
+static message_command commands[] = {
+	{"list_rooms", &message_list_rooms, {{"include_hidden", MSG_ARG_BOOLEAN, 0}, {"since_version", MSG_ARG_INTEGER, 0}}},
+	{"join_room", &message_join_room, {{"room", MSG_ARG_STRING, 1}}},
+	{"leave_room", &message_leave_room},
+	{"list_peers", &message_list_peers},
+	{"sdp_pass", &message_sdp_pass},
+	{"request_sdp_offer", &message_request_sdp_offer, {{"audio", MSG_ARG_INTEGER, 0}, {"video", MSG_ARG_INTEGER, 0}}},
+	{"change_nick", &message_change_nick, {{"nick", MSG_ARG_STRING, 1}}},
+	{"say", &message_not_implemented},
+	{"upload_image", &message_not_implemented},
+	{"mute", &message_not_implemented},
+	{"request_admin", &message_not_implemented},
+};
+static GHashTable* command_table; //Name to its entry in commands, never changed after messaging_init()
+static gint unknown_commands; //Atomic
+static scheduler* roster_scheduler;
+static unsigned int roster_interval = SETTINGS_ROSTER_INTERVAL;
+
+int messaging_init()
+{
+	command_table = g_hash_table_new(g_str_hash, g_str_equal);
+	if(command_table == NULL)
+		return 1;
+	for(unsigned int i = 0; i < G_N_ELEMENTS(commands); i++)
+		g_hash_table_insert(command_table, (gpointer) commands[i].name, &commands[i]);
+	//Roster events can still go out without it, one per change
+	roster_scheduler = scheduler_create("roster", 1);
+	if(roster_scheduler == NULL)
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't create the roster thread, joins and leaves won't be batched\n");
+	return 0;
+}
+
+/* Lobbies' rosters have to be stopped first */
+int messaging_shutdown()
+{
+	scheduler_destroy(roster_scheduler);
+	roster_scheduler = NULL;
+	if(command_table != NULL)
+		g_hash_table_destroy(command_table);
+	command_table = NULL;
+	return 0;
+}
+
+/* Milliseconds between a lobby's roster events. Only applies to lobbies created afterwards */
+void messaging_set_roster_interval(unsigned int interval)
+{
+	if(interval > 0)
+		roster_interval = interval;
+}
+
+static message_command* message_find_command(const char* request)
+{
+	char name[MSG_MAX_COMMAND_LENGTH];
+	size_t length = strlen(request);
+	if(length >= MSG_MAX_COMMAND_LENGTH)
+		return NULL;
+	for(size_t i = 0; i <= length; i++)
+		name[i] = tolower((unsigned char) request[i]);
+	return g_hash_table_lookup(command_table, name);
+}
+
+/* Arguments the command knows about have to be the right type, and the required ones have to be there */
+static int message_check_args(const message_command* command, json_t* message, char* error)
+{
+	for(unsigned int i = 0; i < MSG_MAX_ARGS && command->args[i].name != NULL; i++)
+	{
+		const message_arg* arg = &command->args[i];
+		json_t* value = json_object_get(message, arg->name);
+		if(value == NULL)
+		{
+			if(!arg->required)
+				continue;
+			snprintf(error, 256, "Missing element (%s)", arg->name);
+			return MSG_ERROR_JSON_MISSING_ELEMENT;
+		}
+		int valid = 0;
+		switch(arg->type)
+		{
+			case MSG_ARG_STRING:
+				valid = json_is_string(value);
+			break;
+			case MSG_ARG_INTEGER:
+				valid = json_is_integer(value);
+			break;
+			case MSG_ARG_BOOLEAN:
+				valid = json_is_boolean(value);
+			break;
+		}
+		if(!valid)
+		{
+			snprintf(error, 256, "Invalid element (%s should be %s)", arg->name,
+				arg->type == MSG_ARG_STRING ? "a string" : arg->type == MSG_ARG_INTEGER ? "an integer" : "a boolean");
+			return MSG_ERROR_JSON_INVALID_ELEMENT;
+		}
+	}
+	return 0;
+}
+
+/* Latency buckets are powers of two, bucket n counts calls that took under 2^(n+1) microseconds */
+static void message_record_call(message_command* command, int error, gint64 latency)
+{
+	unsigned int bucket = 0;
+	while(bucket < MSG_LATENCY_BUCKETS - 1 && latency >= ((gint64) 2 << bucket))
+		bucket++;
+	g_atomic_int_inc(&command->calls);
+	if(error != 0)
+		g_atomic_int_inc(&command->errors);
+	g_atomic_int_inc(&command->latency[bucket]);
+}
+
+/* Call counts, error counts and latency histograms of every command, for the admin API */
+json_t* message_get_stats()
+{
+	json_t* stats_json = json_object();
+	for(unsigned int i = 0; i < G_N_ELEMENTS(commands); i++)
+	{
+		message_command* command = &commands[i];
+		json_t* command_json = json_object();
+		json_t* latency_json = json_array();
+		json_object_set_new(command_json, "calls", json_integer(g_atomic_int_get(&command->calls)));
+		json_object_set_new(command_json, "errors", json_integer(g_atomic_int_get(&command->errors)));
+		for(unsigned int bucket = 0; bucket < MSG_LATENCY_BUCKETS; bucket++)
+			json_array_append_new(latency_json, json_integer(g_atomic_int_get(&command->latency[bucket])));
+		json_object_set_new(command_json, "latency", latency_json);
+		json_object_set_new(stats_json, command->name, command_json);
+	}
+	json_object_set_new(stats_json, "unknown", json_integer(g_atomic_int_get(&unknown_commands)));
+	return stats_json;
+}
 
 int message_sanity_checks(janus_plugin_session* handle, json_t* message, char* error)
 {
@@ -47,7 +190,7 @@ struct janus_plugin_result* handle_message(janus_plugin_session *handle, char* t
 	JANUS_LOG(LOG_DBG, "handle_message() start\n");
 	if(stream_lobby_is_stopping() || !stream_lobby_is_initialized() || handle == NULL || handle->plugin_handle == NULL || message == NULL)
 		return janus_plugin_result_new(JANUS_PLUGIN_ERROR, "Error with Janus Gateway", NULL);
-	
+
 	char error_msg[256];
 	int error = message_sanity_checks(handle, message, error_msg);
 	JANUS_LOG(LOG_DBG, "Sanity check result: %d\n", error);
@@ -57,407 +200,427 @@ struct janus_plugin_result* handle_message(janus_plugin_session *handle, char* t
 		return janus_plugin_result_new(JANUS_PLUGIN_OK, error_msg, NULL);
 	}
 	json_t* response = json_object();
-	char response_sdp[1024] = {0};
 	const char* request = json_string_value(json_object_get(message, "request"));
-	
+
 	//TODO - Have to put a safeguard in here to stop clients from blocking everything with stupid shit like while(1){ send_message("list_rooms"); }
-	if(strcasecmp(request, "list_rooms") == 0)
+	message_command* command = message_find_command(request);
+	if(command == NULL)
 	{
-		JANUS_LOG(LOG_DBG, "list_rooms start\n");
-		
-		peer* dude = handle->plugin_handle;
-		char all_rooms = 0;
-		pthread_mutex_lock(&dude->mutex);
-			if(dude->is_admin)
-			{
-				json_t* hidden_json = json_object_get(message, "include_hidden");
-				if(hidden_json != NULL && json_is_boolean(hidden_json))
-					all_rooms = json_is_true(hidden_json);
-			}
-		pthread_mutex_unlock(&dude->mutex);
-		
-		json_t* rooms_json = json_array();
-		GList *rooms, *cr;
-		rooms = lobbies_get_lobbies();
-		cr = rooms;
-		while(cr)
-		{
-			lobby* room = cr->data;
-			if(room->is_private && !all_rooms)
-			{
-				cr = cr->next;
-				continue;
-			}
-			json_t* tmp_json = json_object();
-			pthread_mutex_lock(&room->mutex);
-				json_object_set_new(tmp_json, "name", json_string(room->name));
-				json_object_set_new(tmp_json, "subject", json_string(room->subj));
-				json_object_set_new(tmp_json, "description", json_string(room->desc));
-				json_object_set_new(tmp_json, "audio_enabled", json_integer(room->audio_enabled));
-				json_object_set_new(tmp_json, "video_enabled", json_integer(room->video_enabled));
-				json_object_set_new(tmp_json, "video_active", json_integer(room->video_active));
-				json_object_set_new(tmp_json, "max_clients", json_integer(room->max_clients));
-			pthread_mutex_unlock(&room->mutex);
-			pthread_mutex_lock(&room->peerlist_mutex);
-				json_object_set_new(tmp_json, "connected_clients", json_integer(g_atomic_int_get(&room->current_clients)));
-			pthread_mutex_unlock(&room->peerlist_mutex);
-			json_array_append_new(rooms_json, tmp_json);
-			cr = cr->next;
-		}
-		json_object_set_new(response, "status", json_string("ok"));
-		json_object_set(response, "stuff", rooms_json);
-		json_decref(rooms_json);
-	} //end list_rooms
-	
-	else if(strcasecmp(request, "join_room") == 0)
-	{
-		JANUS_LOG(LOG_DBG, "join_room start\n");
-		peer* dude = handle->plugin_handle;
-		lobby* room;
-		json_t* room_json = json_object_get(message, "room");
-		if(room_json == NULL)
-		{
-			error = MSG_ERROR_JSON_MISSING_ELEMENT;
-			snprintf(error_msg, 256, "No lobby name provided");
-			goto error;
-		}
-		if(!json_is_string(room_json))
-		{
-			error = MSG_ERROR_JSON_INVALID_ELEMENT;
-			snprintf(error_msg, 256, "Lobby name is not a string");
-			goto error;
-		}
-		room = lobbies_get_lobby(json_string_value(room_json));
-		if(room == NULL)
-		{
-			error = MSG_ERROR_JOIN_INVALID_LOBBY;
-			snprintf(error_msg, 256, "Requested lobby does not exist");
-			goto error;
-		}
-		pthread_mutex_lock(&room->mutex);
-			if(room->die)
-			{
-				pthread_mutex_unlock(&room->mutex);
-				error = MSG_ERROR_JOIN_INVALID_LOBBY;
-				snprintf(error_msg, 256, "Requested lobby is shutting down");
-				goto error;
-			}
-		pthread_mutex_unlock(&room->mutex);
-		if(g_atomic_int_get(&room->current_clients) >= room->max_clients)
-		{
-			error = MSG_ERROR_JOIN_LOBBY_FULL;
-			snprintf(error_msg, 256, "Requested lobby is full");
-			goto error;
-		}
-		
-		//Error checks finished, start setting stuff up
-		lobbies_remove_peer(dude);
-		
-		//Generate lobby id for session, and assign session to that slot
-		srand(time(NULL));
-		unsigned int tmp_id;
-		char joined;
-		do
-		{
-			tmp_id = rand() % room->max_clients;
-			//TODO - I'm uncertain about this line, particularly the ampersand
-			joined = g_atomic_pointer_compare_and_exchange(&room->participants[tmp_id], NULL, dude);
-		} while(g_atomic_int_get(&room->current_clients) < room->max_clients && !joined);
+		g_atomic_int_inc(&unknown_commands);
+		error = MSG_ERROR_UNKNOWN_COMMAND;
+		snprintf(error_msg, 256, "Unknown command %s", request);
+	}
+	else
+	{
+		JANUS_LOG(LOG_DBG, "%s start\n", command->name);
+		gint64 start = janus_get_monotonic_time();
+		error = message_check_args(command, message, error_msg);
+		if(error == 0)
+			error = command->handler(handle, message, jsep, response, error_msg);
+		message_record_call(command, error, janus_get_monotonic_time() - start);
+	}
+	json_decref(message);
+	if(error != 0)
+	{
+		json_decref(response);
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error %d processing message: %s\n", error, error_msg);
+		json_t* err_json = json_object();
+		json_object_set_new(err_json, "status", json_string("error"));
+		json_object_set_new(err_json, "error_code", json_integer(error));
+		json_object_set_new(err_json, "error_message", json_string(error_msg));
+		return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, err_json);
+	}
+
+	char* result_text = json_dumps(response, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+	JANUS_LOG(LOG_DBG, "Response to peer: %s\n", result_text);
+	free(result_text);
+	return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, response);
+}
+
+
 
-		if(!joined)
+/*
+ * Command handlers
+ * Called with arguments already checked against the command's schema. They fill in the response and return 0,
+ * or write what went wrong to error (256 bytes) and return one of the MSG_ERROR codes
+ */
+
+/*list_rooms response:
+  {
+	  "status": "ok",
+	  "version": <int>, //Of the directory the response comes from, to be passed back as since_version
+	  "update": "full" | "changes" | "unchanged",
+	  "stuff": [
+		  {
+			  "name": <string>, "subject": <string>, "description": <string>,
+			  "audio_enabled": <int>, "video_enabled": <int>, "video_active": <int>,
+			  "max_clients": <int>, "connected_clients": <int>,
+			  "version": <int> //Last one the lobby changed in
+		  },
+		  ...
+	  ] (not present if unchanged),
+	  "removed": [<string>, ...] (names, only present with changes)
+  }
+  Without since_version, or if it's too old to tell what changed since, every lobby is listed.
+  Otherwise just the lobbies that changed after since_version, and the ones removed since.
+  The directory is rebuilt at most every SETTINGS_DIRECTORY_INTERVAL, so it can be that far behind
+*/
+static int message_list_rooms(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	peer* dude = handle->plugin_handle;
+	char all_rooms = 0;
+	pthread_mutex_lock(&dude->mutex);
+		if(dude->is_admin)
 		{
-			error = MSG_ERROR_JOIN_LOBBY_FULL;
-			snprintf(error_msg, 256, "Requested lobby is full");
-			goto error;
+			json_t* hidden_json = json_object_get(message, "include_hidden");
+			if(hidden_json != NULL)
+				all_rooms = json_is_true(hidden_json);
 		}
-		
-		pthread_mutex_lock(&dude->mutex);
-			do
-			{
-				dude->lobby_id = rand() % room->max_clients;
-			} while(room->participants[dude->lobby_id] != NULL);
-			room->participants[dude->lobby_id] = dude;
-			dude->current_lobby = room;
-			g_atomic_int_inc(&room->current_clients);
-			if(!dude->comms_ready)
-			{
-				dude->opus_pt = 0;
-			}
-		pthread_mutex_unlock(&dude->mutex);
-		message_lobby(room, "peer_join", dude);
-		json_object_set_new(response, "status", json_string("ok"));
-		//TODO - Return the lobby's properties in the json (i.e. if there's a video stream available)
-	} //end join_room
+	pthread_mutex_unlock(&dude->mutex);
 
-	else if(strcasecmp(request, "leave_room") == 0)
+	lobby_directory* directory = lobbies_acquire_directory();
+	if(directory == NULL)
 	{
-		JANUS_LOG(LOG_DBG, "leave_room start\n");
-		peer* dude = handle->plugin_handle;
-		lobbies_remove_peer(dude);
-		json_object_set_new(response, "status", json_string("ok"));
+		snprintf(error, 256, "Couldn't list the lobbies");
+		return MSG_ERROR_JSON_GENERIC_ERROR;
+	}
+	json_t* rooms_json = all_rooms ? directory->rooms : directory->public_rooms;
+	json_t* since_json = json_object_get(message, "since_version");
+	json_int_t since = since_json != NULL ? json_integer_value(since_json) : -1;
+	json_object_set_new(response, "status", json_string("ok"));
+	json_object_set_new(response, "version", json_integer(directory->version));
+	if(since < 0 || (guint64) since < directory->oldest || (guint64) since > directory->version)
+	{
+		//The directory's entries are shared, not copied, which needs the jansson Lobbies.h checks for
+		json_object_set_new(response, "update", json_string("full"));
+		json_object_set(response, "stuff", rooms_json);
+		lobbies_release_directory(directory);
+		return 0;
+	}
+	json_t* changed_json = json_array();
+	json_t* removed_json = json_array();
+	size_t index;
+	json_t* entry;
+	json_array_foreach(rooms_json, index, entry)
+	{
+		if(json_integer_value(json_object_get(entry, "version")) > since)
+			json_array_append(changed_json, entry);
+	}
+	json_array_foreach(directory->removed, index, entry)
+	{
+		if(json_integer_value(json_object_get(entry, "version")) <= since)
+			continue;
+		if(json_integer_value(json_object_get(entry, "private")) && !all_rooms)
+			continue;
+		json_array_append(removed_json, json_object_get(entry, "name"));
 	}
+	lobbies_release_directory(directory);
+	if(json_array_size(changed_json) == 0 && json_array_size(removed_json) == 0)
+	{
+		json_object_set_new(response, "update", json_string("unchanged"));
+		json_decref(changed_json);
+		json_decref(removed_json);
+		return 0;
+	}
+	json_object_set_new(response, "update", json_string("changes"));
+	json_object_set_new(response, "stuff", changed_json);
+	json_object_set_new(response, "removed", removed_json);
+	return 0;
+}
 
-	else if(strcasecmp(request, "list_peers") == 0)
+static int message_join_room(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	peer* dude = handle->plugin_handle;
+	lobby* room = lobbies_get_lobby(json_string_value(json_object_get(message, "room")));
+	if(room == NULL)
+	{
+		snprintf(error, 256, "Requested lobby does not exist");
+		return MSG_ERROR_JOIN_INVALID_LOBBY;
+	}
+	if(g_atomic_int_get(&room->die))
+	{
+		snprintf(error, 256, "Requested lobby is shutting down");
+		return MSG_ERROR_JOIN_INVALID_LOBBY;
+	}
+	if(g_atomic_int_get(&room->current_clients) >= room->max_clients)
 	{
-		JANUS_LOG(LOG_DBG, "list_peers start\n");
+		snprintf(error, 256, "Requested lobby is full");
+		return MSG_ERROR_JOIN_LOBBY_FULL;
 	}
 
-	else if(strcasecmp(request, "sdp_pass") == 0)
+	//Error checks finished, start setting stuff up
+	lobbies_remove_peer(dude);
+
+	//Generate lobby id for session, and assign session to that slot
+	srand(time(NULL));
+	unsigned int tmp_id;
+	char joined;
+	do
 	{
-		JANUS_LOG(LOG_DBG, "sdp_passthrough start\n");
-		if(jsep == NULL)
-		{
-			error = MSG_ERROR_SDP_ERROR;
-			snprintf(error_msg, 256, "No JSEP object to process");
-			goto error;
-		}
-		char* sdp = json_dumps(jsep, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-		const char* sdp_type = json_string_value(json_object_get(jsep, "type"));
-		//If its an SDP offer, create an answer, otherwise let janus do it's thing
-		if(!strcasecmp(sdp_type, "offer"))
+		tmp_id = rand() % room->max_clients;
+		//TODO - I'm uncertain about this line, particularly the ampersand
+		joined = g_atomic_pointer_compare_and_exchange(&room->participants[tmp_id], NULL, dude);
+	} while(g_atomic_int_get(&room->current_clients) < room->max_clients && !joined);
+
+	if(!joined)
+	{
+		snprintf(error, 256, "Requested lobby is full");
+		return MSG_ERROR_JOIN_LOBBY_FULL;
+	}
+
+	pthread_mutex_lock(&dude->mutex);
+		//The slot claimed above is the only one the peer has, the snapshot takes every filled slot as a peer
+		dude->lobby_id = tmp_id;
+		dude->current_lobby = room;
+		g_atomic_int_inc(&room->current_clients);
+		lobbies_directory_changed(room);
+		if(!g_atomic_int_get(&dude->comms_ready))
 		{
-			//Reject offer if it isn't sendonly
-			if(strstr(sdp, "sendonly") == NULL)
-			{
-				error = MSG_ERROR_SDP_INVALID_OFFER;
-				snprintf(error_msg, 256, "SDP offers must be sendonly");
-				goto error;
-			}
-			peer* dude = handle->plugin_handle;
-			pthread_mutex_lock(&dude->mutex);
-			if(dude->current_lobby == NULL)
-			{
-				pthread_mutex_unlock(&dude->mutex);
-				error = MSG_ERROR_SDP_NO_LOBBY;
-				snprintf(error_msg, 256, "Cannot process SDP before client has entered a lobby");
-				goto error;
-			}
-			lobby* room = dude->current_lobby;
-			if(!room->audio_enabled)
-			{
-				pthread_mutex_unlock(&dude->mutex);
-				error = MSG_ERROR_SDP_NO_LOBBY;
-				snprintf(error_msg, 256, "Lobby does not support audio");
-				goto error;
-			}
-			pthread_mutex_unlock(&dude->mutex);
-
-			dude->opus_pt = janus_get_codec_pt(sdp, "opus");
-			if(dude->opus_pt == -1)
-				dude->opus_pt = 0;
-			int offset = snprintf(response_sdp, 1024, "v=0\n"
-					"o=server %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\n"
-					"s=stream session\n"
-					"t=0 0\n",
-					janus_get_monotonic_time(),
-					janus_get_monotonic_time());
-			if(offset < 0)
-			{
-				error = MSG_ERROR_SDP_ERROR;
-				snprintf(error_msg, 256, "Error while creating SDP response");
-				goto error;
-			}
-			//Audio
-			if(strstr(sdp, "m=audio") == NULL)
-			{
-				error = MSG_ERROR_SDP_NO_MEDIA;
-				snprintf(error_msg, 256, "SDP offers must have at least one audio track");
-				goto error;
-			}
-			else
-			{
-				offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF %d\r\n", dude->opus_pt);
-				offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:%d opus/48000/2\r\n", dude->opus_pt);
-				offset += snprintf(response_sdp+offset, 1024-offset, "a=fmtp:%d maxplaybackrate=%d;stereo=0;\r\n", dude->opus_pt, SETTINGS_SAMPLE_RATE);
-				offset += snprintf(response_sdp+offset, 1024-offset, "a=recvonly\r\n");
-				offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
-			}
-			//Reject video
-			if(strstr(sdp, "m=video") != NULL)
-				offset += snprintf(response_sdp+offset, 1024-offset, "m=video 0 RTP/AVP 0\r\n");
-			//Reject data channels
-			if(strstr(sdp, "DTLS/SCTP") != NULL)
-				offset += snprintf(response_sdp+offset, 1024-offset, "m=application 0 DTLS/SCTP 0\r\n");
-
-
-			json_t* sdp_json = json_object();
-			json_object_set_new(sdp_json, "status", json_string("ok"));
-			json_t* offer_jsep = json_pack("{ssss}", "type", "answer", "sdp", response_sdp);
-			int result = janus_gateway->push_event(handle, &stream_lobby_plugin, "sdp_answer", sdp_json, offer_jsep);
-			if(result != JANUS_OK)
-			{
-				error = MSG_ERROR_SDP_SEND_FAIL;
-				snprintf(error_msg, 256, "Error sending you the SDP offer");
-				goto error;
-			}
+			dude->opus_pt = 0;
 		}
+		lobbies_publish_snapshot(room);
+	pthread_mutex_unlock(&dude->mutex);
+	message_lobby(room, "peer_join", dude);
+	json_object_set_new(response, "status", json_string("ok"));
+	//TODO - Return the lobby's properties in the json (i.e. if there's a video stream available)
+	return 0;
+}
+
+static int message_leave_room(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	peer* dude = handle->plugin_handle;
+	lobbies_remove_peer(dude);
+	json_object_set_new(response, "status", json_string("ok"));
+	return 0;
+}
 
+static int message_list_peers(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	return 0;
+}
+
+static int message_sdp_pass(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	if(jsep == NULL)
+	{
+		snprintf(error, 256, "No JSEP object to process");
+		return MSG_ERROR_SDP_ERROR;
+	}
+	const char* sdp_type = json_string_value(json_object_get(jsep, "type"));
+	//If its an SDP offer, create an answer, otherwise let janus do it's thing
+	if(sdp_type == NULL || strcasecmp(sdp_type, "offer"))
+	{
 		json_object_set_new(response, "status", json_string("ok"));
-		//json_object_set_new(response, "stuff", json_string(response_sdp));
-		free(sdp);
+		return 0;
 	}
-
-	else if(strcasecmp(request, "request_sdp_offer") == 0)
+	char* sdp = json_dumps(jsep, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
+	char response_sdp[1024] = {0};
+	int error_code = 0;
+	//Reject offer if it isn't sendonly
+	if(strstr(sdp, "sendonly") == NULL)
+	{
+		error_code = MSG_ERROR_SDP_INVALID_OFFER;
+		snprintf(error, 256, "SDP offers must be sendonly");
+		goto done;
+	}
+	peer* dude = handle->plugin_handle;
+	pthread_mutex_lock(&dude->mutex);
+	if(dude->current_lobby == NULL)
 	{
-		JANUS_LOG(LOG_DBG, "request_sdp_offer start\n");
-		peer* dude = handle->plugin_handle;
-		pthread_mutex_lock(&dude->mutex);
-		if(dude->current_lobby == NULL)
-		{
-			pthread_mutex_unlock(&dude->mutex);
-			error = MSG_ERROR_SDP_NO_LOBBY;
-			snprintf(error_msg, 256, "Cannot process SDP before client has entered a lobby");
-			goto error;
-		}
-		lobby* room = dude->current_lobby;
-		if(!room->audio_enabled && !room->video_enabled)
-		{
-			pthread_mutex_unlock(&dude->mutex);
-			error = MSG_ERROR_SDP_NO_LOBBY;
-			snprintf(error_msg, 256, "Lobby does not support audio or video");
-			goto error;
-		}
 		pthread_mutex_unlock(&dude->mutex);
-		char audio = json_integer_value(json_object_get(message, "audio"));
-		char video = json_integer_value(json_object_get(message, "video"));
-		if(!audio && !video)
-		{
-			error = MSG_ERROR_SDP_NO_MEDIA;
-			snprintf(error_msg, 256, "No media specified");
-			goto error;
-		}
-
+		error_code = MSG_ERROR_SDP_NO_LOBBY;
+		snprintf(error, 256, "Cannot process SDP before client has entered a lobby");
+		goto done;
+	}
+	lobby* room = dude->current_lobby;
+	if(!room->audio_enabled)
+	{
+		pthread_mutex_unlock(&dude->mutex);
+		error_code = MSG_ERROR_SDP_NO_LOBBY;
+		snprintf(error, 256, "Lobby does not support audio");
+		goto done;
+	}
+	pthread_mutex_unlock(&dude->mutex);
 
-		int no_media = 1, offset = snprintf(response_sdp, 1024, "v=0\r\n"
-			/*username,id,version number,IP addr*/
-			"o=server %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n"
-			"s=stream session\r\n"
-			"t=0 0\r\n",
+	dude->opus_pt = janus_get_codec_pt(sdp, "opus");
+	if(dude->opus_pt == -1)
+		dude->opus_pt = 0;
+	//Audio levels let us skip decoding peers that aren't saying anything
+	const char* offer_sdp = json_string_value(json_object_get(jsep, "sdp"));
+	int audio_level_ext_id = offer_sdp ? janus_rtp_header_extension_get_id(offer_sdp, JANUS_RTP_EXTMAP_AUDIO_LEVEL) : -1;
+	pthread_mutex_lock(&dude->mutex);
+		dude->audio_level_ext_id = audio_level_ext_id > 0 ? audio_level_ext_id : 0;
+	pthread_mutex_unlock(&dude->mutex);
+	int offset = snprintf(response_sdp, 1024, "v=0\n"
+			"o=server %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\n"
+			"s=stream session\n"
+			"t=0 0\n",
 			janus_get_monotonic_time(),
 			janus_get_monotonic_time());
-		if(offset<0)
-		{
-			error = MSG_ERROR_SDP_ERROR;
-			snprintf(error_msg, 256, "Error while creating SDP offer");
-			goto error;
-		}
-		if(audio && room->audio_enabled)
-		{
-			/*Payload types in the range 96-127 are dynamically defined payload types
-			Reference: https://tools.ietf.org/html/rfc3551#section-5*/
-			offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF 96\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:96 opus/48000/2\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=fmtp:96 maxplaybackrate=48000;stereo=%d;sprop-stereo=%d;useinbandfec=0\r\n", SETTINGS_CHANNELS-1, SETTINGS_CHANNELS-1);
-			dude->opus_pt = 96;
-			no_media = 0;
-		}
-		if(video && room->video_active)
-		{
-			offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF 97\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=sendonly\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:97 %s/%d/%d\r\n", room->video_acodec, room->video_asample, room->video_achannels);
-			offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "m=video 1 RTP/SAVPF 98\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=sendonly\r\n");
-			offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:98 %s/90000\r\n", room->video_vcodec);
-			offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
-			no_media = 0;
-		}
+	if(offset < 0)
+	{
+		error_code = MSG_ERROR_SDP_ERROR;
+		snprintf(error, 256, "Error while creating SDP response");
+		goto done;
+	}
+	//Audio
+	if(strstr(sdp, "m=audio") == NULL)
+	{
+		error_code = MSG_ERROR_SDP_NO_MEDIA;
+		snprintf(error, 256, "SDP offers must have at least one audio track");
+		goto done;
+	}
+	else
+	{
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF %d\r\n", dude->opus_pt);
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:%d opus/48000/2\r\n", dude->opus_pt);
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=fmtp:%d maxplaybackrate=%d;stereo=0;\r\n", dude->opus_pt, room->profile.sample_rate);
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=ptime:%d\r\n", room->profile.ptime);
+		if(audio_level_ext_id > 0)
+			offset += snprintf(response_sdp+offset, 1024-offset, "a=extmap:%d %s\r\n", audio_level_ext_id, JANUS_RTP_EXTMAP_AUDIO_LEVEL);
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=recvonly\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
+	}
+	//Reject video
+	if(strstr(sdp, "m=video") != NULL)
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=video 0 RTP/AVP 0\r\n");
+	//Reject data channels
+	if(strstr(sdp, "DTLS/SCTP") != NULL)
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=application 0 DTLS/SCTP 0\r\n");
 
-		if(no_media)
-		{
-			error = MSG_ERROR_SDP_NO_MEDIA;
-			snprintf(error_msg, 256, "This lobby does not support the requested media");
-		}
-		else
-		{
-			json_object_set_new(response, "status", json_string("ok"));
-			json_t* sdp_json = json_object();
-			json_object_set_new(sdp_json, "status", json_string("ok"));
-			json_t* offer_jsep = json_pack("{ssss}", "type", "offer", "sdp", response_sdp);
-			int result = janus_gateway->push_event(handle, &stream_lobby_plugin, "sdp_offer", sdp_json, offer_jsep);
-			if(result != JANUS_OK)
-			{
-				error = MSG_ERROR_SDP_SEND_FAIL;
-				snprintf(error_msg, 256, "Error sending SDP offer");
-			}
-			json_decref(sdp_json);
-			json_decref(offer_jsep);
-		}
+
+	json_t* sdp_json = json_object();
+	json_object_set_new(sdp_json, "status", json_string("ok"));
+	json_t* offer_jsep = json_pack("{ssss}", "type", "answer", "sdp", response_sdp);
+	int result = janus_gateway->push_event(handle, &stream_lobby_plugin, "sdp_answer", sdp_json, offer_jsep);
+	json_decref(sdp_json);
+	json_decref(offer_jsep);
+	if(result != JANUS_OK)
+	{
+		error_code = MSG_ERROR_SDP_SEND_FAIL;
+		snprintf(error, 256, "Error sending you the SDP offer");
+		goto done;
 	}
+	json_object_set_new(response, "status", json_string("ok"));
+	//json_object_set_new(response, "stuff", json_string(response_sdp));
 
-	else if(strcasecmp(request, "change_nick") == 0)
+done:
+	free(sdp);
+	return error_code;
+}
+
+static int message_request_sdp_offer(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	peer* dude = handle->plugin_handle;
+	char response_sdp[1024] = {0};
+	pthread_mutex_lock(&dude->mutex);
+	if(dude->current_lobby == NULL)
 	{
-		JANUS_LOG(LOG_DBG, "[Stream Lobby] change_nick start\n");
-		//TODO - Limit on how often nick can be changed
-		peer* dude = handle->plugin_handle;
-		const char* new_nick = json_string_value(json_object_get(jsep, "nick"));
-		if(strlen(new_nick) == 0)
-		{
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] Empty nick given\n");
-			error = MSG_ERROR_NICK_EMPTY;
-			snprintf(error_msg, 256, "Empty nick given");
-			goto error;
-		}
-		//TODO - More sanitizing. stop nicks that are just spaces or underscores and the like
-		pthread_mutex_lock(&dude->mutex);
-			snprintf(dude->nick, 64, "%s", new_nick);
-			lobby* room = dude->current_lobby;
 		pthread_mutex_unlock(&dude->mutex);
-		message_lobby(room, "nick_change", dude);
+		snprintf(error, 256, "Cannot process SDP before client has entered a lobby");
+		return MSG_ERROR_SDP_NO_LOBBY;
 	}
-
-	else if(strcasecmp(request, "say") == 0)
+	lobby* room = dude->current_lobby;
+	if(!room->audio_enabled && !room->video_enabled)
 	{
-		JANUS_LOG(LOG_DBG, "[Stream Lobby] say start\n");
-		error = MSG_ERROR_COMMAND_NOT_IMPLEMENTED;
-		snprintf(error_msg, 256, "Command not implemented");
+		pthread_mutex_unlock(&dude->mutex);
+		snprintf(error, 256, "Lobby does not support audio or video");
+		return MSG_ERROR_SDP_NO_LOBBY;
 	}
-
-	else if(strcasecmp(request, "upload_image") == 0)
+	pthread_mutex_unlock(&dude->mutex);
+	char audio = json_integer_value(json_object_get(message, "audio"));
+	char video = json_integer_value(json_object_get(message, "video"));
+	if(!audio && !video)
 	{
-		JANUS_LOG(LOG_DBG, "[Stream Lobby] upload_image start\n");
-		error = MSG_ERROR_COMMAND_NOT_IMPLEMENTED;
-		snprintf(error_msg, 256, "Command not implemented");
+		snprintf(error, 256, "No media specified");
+		return MSG_ERROR_SDP_NO_MEDIA;
 	}
 
-	else if(strcasecmp(request, "mute") == 0)
+
+	int no_media = 1, offset = snprintf(response_sdp, 1024, "v=0\r\n"
+		/*username,id,version number,IP addr*/
+		"o=server %"SCNu64" %"SCNu64" IN IP4 127.0.0.1\r\n"
+		"s=stream session\r\n"
+		"t=0 0\r\n",
+		janus_get_monotonic_time(),
+		janus_get_monotonic_time());
+	if(offset<0)
 	{
-		JANUS_LOG(LOG_DBG, "[Stream Lobby] mute start\n");
-		error = MSG_ERROR_COMMAND_NOT_IMPLEMENTED;
-		snprintf(error_msg, 256, "Command not implemented");
+		snprintf(error, 256, "Error while creating SDP offer");
+		return MSG_ERROR_SDP_ERROR;
 	}
-
-	else if(strcasecmp(request, "request_admin") == 0)
+	if(audio && room->audio_enabled)
 	{
-		JANUS_LOG(LOG_DBG, "[Stream Lobby] request_admin start\n");
-		error = MSG_ERROR_COMMAND_NOT_IMPLEMENTED;
-		snprintf(error_msg, 256, "Command not implemented");
+		/*Payload types in the range 96-127 are dynamically defined payload types
+		Reference: https://tools.ietf.org/html/rfc3551#section-5*/
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF 96\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:96 opus/48000/2\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=fmtp:96 maxplaybackrate=%d;sprop-maxcapturerate=%d;stereo=%d;sprop-stereo=%d;useinbandfec=0\r\n", room->profile.sample_rate, room->profile.sample_rate, SETTINGS_CHANNELS-1, SETTINGS_CHANNELS-1);
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=ptime:%d\r\n", room->profile.ptime);
+		dude->opus_pt = 96;
+		no_media = 0;
+	}
+	if(video && room->video_active)
+	{
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=audio 1 RTP/SAVPF 97\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=sendonly\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:97 %s/%d/%d\r\n", room->video_acodec, room->video_asample, room->video_achannels);
+		offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "m=video 1 RTP/SAVPF 98\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=sendonly\r\n");
+		offset += snprintf(response_sdp+offset, 1024-offset, "a=rtpmap:98 %s/90000\r\n", room->video_vcodec);
+		offset += snprintf(response_sdp+offset, 1024-offset, "c=IN IP4 1.1.1.1\r\n");
+		no_media = 0;
 	}
 
-	else
+	if(no_media)
 	{
-		error = MSG_ERROR_UNKNOWN_COMMAND;
-		snprintf(error_msg, 256, "Unknown command %s", request);
+		snprintf(error, 256, "This lobby does not support the requested media");
+		return MSG_ERROR_SDP_NO_MEDIA;
 	}
+	json_t* sdp_json = json_object();
+	json_object_set_new(sdp_json, "status", json_string("ok"));
+	json_t* offer_jsep = json_pack("{ssss}", "type", "offer", "sdp", response_sdp);
+	int result = janus_gateway->push_event(handle, &stream_lobby_plugin, "sdp_offer", sdp_json, offer_jsep);
+	json_decref(sdp_json);
+	json_decref(offer_jsep);
+	if(result != JANUS_OK)
+	{
+		snprintf(error, 256, "Error sending SDP offer");
+		return MSG_ERROR_SDP_SEND_FAIL;
+	}
+	json_object_set_new(response, "status", json_string("ok"));
+	return 0;
+}
 
-	json_decref(message);
-	char* result_text = json_dumps(response, JSON_INDENT(3) | JSON_PRESERVE_ORDER);
-	JANUS_LOG(LOG_DBG, "Response to peer: %s\n", result_text);
-	free(result_text);
-	return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, response);
+static int message_change_nick(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	//TODO - Limit on how often nick can be changed
+	peer* dude = handle->plugin_handle;
+	const char* new_nick = json_string_value(json_object_get(message, "nick"));
+	if(strlen(new_nick) == 0)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Empty nick given\n");
+		snprintf(error, 256, "Empty nick given");
+		return MSG_ERROR_NICK_EMPTY;
+	}
+	//TODO - More sanitizing. stop nicks that are just spaces or underscores and the like
+	pthread_mutex_lock(&dude->mutex);
+		snprintf(dude->nick, 64, "%s", new_nick);
+		lobby* room = dude->current_lobby;
+	pthread_mutex_unlock(&dude->mutex);
+	message_lobby(room, "nick_change", dude);
+	return 0;
+}
 
-error:
-	json_decref(message);
-	JANUS_LOG(LOG_ERR, "[Stream Lobby] Error %d processing message: %s\n", error, error_msg);
-	json_t* err_json = json_object();
-	json_object_set_new(err_json, "status", json_string("error"));
-	json_object_set_new(err_json, "error_code", json_integer(error));
-	json_object_set_new(err_json, "error_message", json_string(error_msg));
-	return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, err_json);
+static int message_not_implemented(janus_plugin_session* handle, json_t* message, json_t* jsep, json_t* response, char* error)
+{
+	snprintf(error, 256, "Command not implemented");
+	return MSG_ERROR_COMMAND_NOT_IMPLEMENTED;
 }
 
+
 /*Event message structure
   {
 	  "event": <string>,
@@ -467,146 +630,219 @@ error:
 		  "nick": <strong> (not always present),
 	  }
   }
+
+  Joins, leaves and nick changes are journaled per lobby and go out together, at most once every roster_interval:
+  {
+	  "event": "roster",
+	  "stuff": {
+		  "changes": [
+			  {
+				  "event": "peer_join" | "peer_leave" | "nick_change",
+				  "uuid": <string>,
+				  "nick": <string> (not present for peer_leave)
+			  },
+			  ...
+		  ]
+	  }
+  }
+  Each peer is in there once, with where everything they did since the last roster event left them.
+  Peers that joined and left in between aren't in it at all. Everybody in the lobby gets it, their own changes included
+  Peers still in a lobby when it's removed are sent a peer_leave about themselves, on its own, instead
 */
+/* Send an event to everybody in the lobby but the peer it's about, if there is one */
+static void message_participants(lobby* room, json_t* event_json, peer* dude)
+{
+	int reader;
+	participant_snapshot* snapshot = lobbies_acquire_snapshot(room, &reader);
+	for(unsigned int i = 0; snapshot != NULL && i < snapshot->count; i++)
+	{
+		peer* p = snapshot->peers[i];
+		if(p == dude)
+			continue;
+		janus_gateway->push_event(p->session, &stream_lobby_plugin, NULL, event_json, NULL);
+	}
+	lobbies_release_snapshot(room, reader);
+}
+
+/* Send out the lobby's journaled roster changes, one event shared by every recipient (see the jansson check in Lobbies.h) */
+static int message_flush_roster(void* data, unsigned int skipped)
+{
+	lobby* room = data;
+	pthread_mutex_lock(&room->roster_mutex);
+		json_t* changes = room->roster_changes;
+		room->roster_changes = NULL;
+		if(room->roster_pending != NULL)
+			g_hash_table_remove_all(room->roster_pending);
+	pthread_mutex_unlock(&room->roster_mutex);
+	if(changes == NULL)
+		return SCHEDULER_PARK;
+
+	//Changes that cancelled each other out were emptied rather than taken out of the journal
+	json_t* deltas_json = json_array();
+	for(size_t i = 0; i < json_array_size(changes); i++)
+	{
+		json_t* change = json_array_get(changes, i);
+		if(json_object_size(change) > 0)
+			json_array_append(deltas_json, change);
+	}
+	json_decref(changes);
+	if(json_array_size(deltas_json) == 0)
+	{
+		json_decref(deltas_json);
+		return SCHEDULER_PARK;
+	}
+	json_t* event_json = json_object();
+	json_t* data_json = json_object();
+	json_object_set_new(data_json, "changes", deltas_json);
+	json_object_set_new(event_json, "event", json_string("roster"));
+	json_object_set_new(event_json, "stuff", data_json);
+	message_participants(room, event_json, NULL);
+	json_decref(event_json);
+	//Woken up again by the next change
+	return SCHEDULER_PARK;
+}
+
+/* A peer's entry in a lobby's roster journal */
+typedef struct roster_entry {
+	json_t* change; //In roster_changes
+	int joined; //Opened with a join, so the peer wasn't in the lobby as of the last roster event
+} roster_entry;
+
+/* Fold a change into the lobby's journal, which has at most one entry per peer. Needs the lobby's roster lock */
+static void message_journal_change(lobby* room, const char* msg_type, const char* uid, const char* nick)
+{
+	roster_entry* entry = g_hash_table_lookup(room->roster_pending, uid);
+	if(entry == NULL)
+	{
+		entry = g_malloc(sizeof(roster_entry));
+		entry->change = json_object();
+		entry->joined = !strcmp(msg_type, "peer_join");
+		json_object_set_new(entry->change, "event", json_string(msg_type));
+		json_object_set_new(entry->change, "uuid", json_string(uid));
+		if(nick != NULL)
+			json_object_set_new(entry->change, "nick", json_string(nick));
+		if(room->roster_changes == NULL)
+			room->roster_changes = json_array();
+		json_array_append_new(room->roster_changes, entry->change);
+		g_hash_table_insert(room->roster_pending, g_strdup(uid), entry);
+		return;
+	}
+	json_t* change = entry->change;
+	const char* pending = json_string_value(json_object_get(change, "event"));
+	if(entry->joined && !strcmp(msg_type, "peer_leave"))
+	{
+		//Nobody needs to hear about somebody that's already gone again. Peers who were there
+		//at the last roster event, left and came back still have to be reported leaving
+		json_object_clear(change);
+		g_hash_table_remove(room->roster_pending, uid);
+		return;
+	}
+	//Nick changes keep a pending join a join, anything else replaces what was there
+	if(strcmp(pending, "peer_join") || strcmp(msg_type, "nick_change"))
+		json_object_set_new(change, "event", json_string(msg_type));
+	if(nick != NULL)
+		json_object_set_new(change, "nick", json_string(nick));
+	else
+		json_object_del(change, "nick");
+}
+
+/* The journal's flushed on its own task, or straight away if there's no roster thread */
+int message_start_roster(lobby* room)
+{
+	room->roster_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	room->roster_changes = NULL;
+	if(roster_scheduler == NULL)
+		return 0;
+	room->roster_task = scheduler_add(roster_scheduler, &message_flush_roster, room, (gint64) roster_interval*1000);
+	return room->roster_task == NULL;
+}
+
+/*
+ * Changes still in the journal are thrown away, everybody's been kicked out by now.
+ * The roster lock outlives it, changes journaled afterwards find nothing to go into and are dropped
+ */
+void message_stop_roster(lobby* room)
+{
+	pthread_mutex_lock(&room->roster_mutex);
+		GHashTable* pending = room->roster_pending;
+		json_t* changes = room->roster_changes;
+		scheduler_task* task = room->roster_task;
+		room->roster_pending = NULL;
+		room->roster_changes = NULL;
+		room->roster_task = NULL;
+	pthread_mutex_unlock(&room->roster_mutex);
+	if(pending == NULL)
+		return;
+	//Waits on a flush in progress, which needs the roster lock
+	scheduler_remove(roster_scheduler, task);
+	if(changes != NULL)
+		json_decref(changes);
+	g_hash_table_destroy(pending);
+}
+
+/* Journal a peer_join, peer_leave or nick_change, it's sent to the lobby with the next roster event */
 void message_lobby(lobby* room, const char* msg_type, peer* dude)
 {
-	if(room == NULL || msg_type == NULL)
+	if(room == NULL || msg_type == NULL || dude == NULL)
 	{
 		JANUS_LOG(LOG_ERR, "[Stream Lobby] Missing argument, abandoning message_lobby()\n");
 		return;
 	}
-	
-	json_t* event_json = json_object();
-	json_object_set_new(event_json, "event", json_string(msg_type));
-	if(!strcasecmp(msg_type, "peer_leave"))
+	if(strcasecmp(msg_type, "peer_leave") && strcasecmp(msg_type, "peer_join") && strcasecmp(msg_type, "nick_change"))
 	{
-		if(!dude)
-		{
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] No peer argument, abandoning message_lobby()\n");
-			return;
-		}
-		int j = 0;
-		char uid[37] = {0};
-		uuid_unparse(dude->uuid, uid);
-		json_t* data_json = json_object();
-		
-		json_object_set_new(data_json, "uuid", json_string(uid));
-		json_object_set_new(event_json, "stuff", data_json);
-		
-		peer* participants_list[room->max_clients];
-		memset(participants_list, 0, sizeof(peer*) * room->max_clients);
-		pthread_mutex_lock(&room->peerlist_mutex);
-			for(int i = 0; i < room->max_clients; i++)
-			{
-				if(room->participants[i] != NULL)
-					participants_list[j++] = room->participants[i];
-			}
-		pthread_mutex_unlock(&room->peerlist_mutex);
-		for(int i = 0; i < j; i++)
-		{
-			peer* p = participants_list[i];
-			if(p == dude)
-				continue;
-			janus_gateway->push_event(p->session, &stream_lobby_plugin, NULL, event_json, NULL);
-			json_decref(event_json);
-		}
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Unknown lobby event %s\n", msg_type);
+		return;
 	}
-	else if(!strcasecmp(msg_type, "peer_join"))
+	char uid[37] = {0}, nick[64];
+	uuid_unparse(dude->uuid, uid);
+	//Leaves don't lock the peer, they're journaled with the peer already locked
+	int leaving = !strcasecmp(msg_type, "peer_leave");
+	if(!leaving)
 	{
-		if(!dude)
-		{
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] No peer argument, abandoning message_lobby()\n");
-			return;
-		}
-		int j = 0;
-		char uid[37] = {0};
-		uuid_unparse(dude->uuid, uid);
-		json_t* data_json = json_object();
-		
-		json_object_set_new(data_json, "uuid", json_string(uid));
 		pthread_mutex_lock(&dude->mutex);
-			json_object_set_new(data_json, "nick", json_string(dude->nick));
+			snprintf(nick, 64, "%s", dude->nick);
 		pthread_mutex_unlock(&dude->mutex);
-		json_object_set_new(event_json, "stuff", data_json);
-		
-		peer* participants_list[room->max_clients];
-		memset(participants_list, 0, sizeof(peer*) * room->max_clients);
-		pthread_mutex_lock(&room->peerlist_mutex);
-			for(int i = 0; i < room->max_clients; i++)
-			{
-				if(room->participants[i] != NULL)
-					participants_list[j++] = room->participants[i];
-			}
-		pthread_mutex_unlock(&room->peerlist_mutex);
-		for(int i = 0; i < j; i++)
-		{
-			peer* p = participants_list[i];
-			if(p == dude)
-				continue;
-			janus_gateway->push_event(p->session, &stream_lobby_plugin, NULL, event_json, NULL);
-			json_decref(event_json);
-		}
 	}
-	else if(!strcasecmp(msg_type, "nick_change"))
-	{
-		if(!dude)
-		{
-			JANUS_LOG(LOG_ERR, "[Stream Lobby] No peer argument, abandoning message_lobby()\n");
-			return;
-		}
-		int j = 0;
-		char uid[37] = {0};
-		uuid_unparse(dude->uuid, uid);
-		json_t* data_json = json_object();
 
-		json_object_set_new(data_json, "uuid", json_string(uid));
-		pthread_mutex_lock(&dude->mutex);
-			json_object_set_new(data_json, "nick", json_string(dude->nick));
-		pthread_mutex_unlock(&dude->mutex);
-		json_object_set_new(event_json, "stuff", data_json);
-
-		peer* participants_list[room->max_clients];
-		memset(participants_list, 0, sizeof(peer*) * room->max_clients);
-		pthread_mutex_lock(&room->peerlist_mutex);
-			for(int i = 0; i < room->max_clients; i++)
-			{
-				if(room->participants[i] != NULL)
-					participants_list[j++] = room->participants[i];
-			}
-		pthread_mutex_unlock(&room->peerlist_mutex);
-		for(int i = 0; i < j; i++)
+	pthread_mutex_lock(&room->roster_mutex);
+		//The roster's been stopped, the lobby's going away
+		if(room->roster_pending == NULL)
 		{
-			peer* p = participants_list[i];
-			if(p == dude)
-				continue;
-			janus_gateway->push_event(p->session, &stream_lobby_plugin, NULL, event_json, NULL);
-			json_decref(event_json);
+			pthread_mutex_unlock(&room->roster_mutex);
+			return;
 		}
-	}
-	json_decref(event_json);
+		message_journal_change(room, leaving ? "peer_leave" : !strcasecmp(msg_type, "peer_join") ? "peer_join" : "nick_change", uid, leaving ? NULL : nick);
+		//Woken with the lock held so the task can't be removed in between
+		int scheduled = room->roster_task != NULL;
+		if(scheduled)
+			scheduler_wake(roster_scheduler, room->roster_task);
+	pthread_mutex_unlock(&room->roster_mutex);
+	if(!scheduled)
+		message_flush_roster(room, 0);
 }
 
-void message_peer(peer* room, const char* msg_type, peer* dude)
+/*
+ * Send one peer an event about another, or about themselves, straight away rather than through the roster.
+ * The lock of the peer the event is about has to be held
+ */
+void message_peer(peer* recipient, const char* msg_type, peer* dude)
 {
-	if(room == NULL || msg_type == NULL)
+	if(recipient == NULL || msg_type == NULL || dude == NULL)
 	{
-		JANUS_LOG(LOG_ERR, "[Stream Lobby] Missing argument, abandoning message_lobby()\n");
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Missing argument, abandoning message_peer()\n");
 		return;
 	}
+	if(janus_gateway == NULL)
+		return;
+	char uid[37] = {0};
+	uuid_unparse(dude->uuid, uid);
 	json_t* event_json = json_object();
+	json_t* data_json = json_object();
+	json_object_set_new(data_json, "uuid", json_string(uid));
+	if(strcasecmp(msg_type, "peer_leave"))
+		json_object_set_new(data_json, "nick", json_string(dude->nick));
 	json_object_set_new(event_json, "event", json_string(msg_type));
-
-	if(!strcasecmp(msg_type, "peer_leave"))
-	{
-		JANUS_LOG(LOG_INFO, "Sending peer_leave message to peer");
-	}
-	else if(!strcasecmp(msg_type, "peer_join"))
-	{
-		JANUS_LOG(LOG_INFO, "Sending peer_join message to peer");
-	}
-	else if(!strcasecmp(msg_type, "nick_change"))
-	{
-		JANUS_LOG(LOG_INFO, "Sending nick_change message to peer");
-	}
+	json_object_set_new(event_json, "stuff", data_json);
+	janus_gateway->push_event(recipient->session, &stream_lobby_plugin, NULL, event_json, NULL);
 	json_decref(event_json);
 }
@@ -21,6 +21,39 @@
 #define MSG_ERROR_JOIN_LOBBY_FULL		231
 #define MSG_ERROR_NICK_EMPTY			240
 
+#define MSG_MAX_ARGS			4	//Arguments a command's schema can check
+#define MSG_MAX_COMMAND_LENGTH		32	//Longest request name, plus its terminator
+#define MSG_LATENCY_BUCKETS		20	//Powers of two of microseconds, the last one takes everything over half a second
+
+//Types a command's arguments are checked against
+#define MSG_ARG_STRING	0
+#define MSG_ARG_INTEGER	1
+#define MSG_ARG_BOOLEAN	2
+
+typedef int (*message_handler)(janus_plugin_session*, json_t*, json_t*, json_t*, char*);
+
+typedef struct message_arg {
+	const char* name; //NULL past the last one
+	int type;
+	int required;
+} message_arg;
+
+/* Request peers can make, the handler that carries it out and what it's called with */
+typedef struct message_command {
+	const char* name;
+	message_handler handler;
+	message_arg args[MSG_MAX_ARGS];
+	//Stats, atomic
+	gint calls, errors;
+	gint latency[MSG_LATENCY_BUCKETS];
+} message_command;
+
+int messaging_init();
+int messaging_shutdown();
+void messaging_set_roster_interval(unsigned int);
+int message_start_roster(lobby*);
+void message_stop_roster(lobby*);
+json_t* message_get_stats();
 int message_sanity_checks(janus_plugin_session*, json_t*, char*);
 void message_lobby(lobby*, const char*, peer*);
 void message_peer(peer*, const char*, peer*);
@@ -0,0 +1,197 @@
+/*
+ * Mixing kernels
+ *
+ * Sums are kept in 32 bits so any number of 16 bit inputs can be added without
+ * overflowing, then clipped once on the way out. The SIMD variants are built with
+ * target attributes, so the rest of the plugin doesn't need any special flags,
+ * and are only used if the CPU reports support for them.
+ */
+
+#include "Mixer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static mixer_add_fn mixer_add = &mixer_add_scalar;
+static mixer_saturate_fn mixer_saturate_impl = &mixer_saturate_scalar;
+static mixer_saturate_minus_fn mixer_saturate_minus_impl = &mixer_saturate_minus_scalar;
+static const char* kernel_name = "scalar";
+
+int mixer_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		mixer_add = &mixer_add_avx2;
+		mixer_saturate_impl = &mixer_saturate_avx2;
+		mixer_saturate_minus_impl = &mixer_saturate_minus_avx2;
+		kernel_name = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		mixer_add = &mixer_add_sse2;
+		mixer_saturate_impl = &mixer_saturate_sse2;
+		mixer_saturate_minus_impl = &mixer_saturate_minus_sse2;
+		kernel_name = "sse2";
+	}
+#endif
+	return 0;
+}
+
+const char* mixer_kernel_name()
+{
+	return kernel_name;
+}
+
+/*
+ * Add samples from a ring buffer (start/end bounds, reading from tail) to the bus
+ * The read wraps around at most once, so this is at most two straight runs
+ */
+void mixer_accumulate(int32_t* bus, const int32_t* start, const int32_t* end, const int32_t* tail, int samples)
+{
+	int first = end - tail;
+	if(first > samples)
+		first = samples;
+	mixer_add(bus, tail, first);
+	if(samples > first)
+		mixer_add(bus + first, start, samples - first);
+}
+
+/* Add one bus to another, i.e. a submix into the lobby's mix */
+void mixer_add_bus(int32_t* bus, const int32_t* in, int samples)
+{
+	mixer_add(bus, in, samples);
+}
+
+void mixer_saturate(int16_t* out, const int32_t* bus, int samples)
+{
+	mixer_saturate_impl(out, bus, samples);
+}
+
+/* Same as mixer_saturate(), with one input taken back out of the bus first (mix-minus) */
+void mixer_saturate_minus(int16_t* out, const int32_t* bus, const int32_t* own, int samples)
+{
+	mixer_saturate_minus_impl(out, bus, own, samples);
+}
+
+
+
+void mixer_add_scalar(int32_t* bus, const int32_t* in, int samples)
+{
+	for(int i = 0; i < samples; i++)
+		bus[i] += in[i];
+}
+
+void mixer_saturate_scalar(int16_t* out, const int32_t* bus, int samples)
+{
+	for(int i = 0; i < samples; i++)
+	{
+		int32_t sample = bus[i];
+		if(sample > INT16_MAX)
+			sample = INT16_MAX;
+		else if(sample < INT16_MIN)
+			sample = INT16_MIN;
+		out[i] = sample;
+	}
+}
+
+void mixer_saturate_minus_scalar(int16_t* out, const int32_t* bus, const int32_t* own, int samples)
+{
+	for(int i = 0; i < samples; i++)
+	{
+		int32_t sample = bus[i] - own[i];
+		if(sample > INT16_MAX)
+			sample = INT16_MAX;
+		else if(sample < INT16_MIN)
+			sample = INT16_MIN;
+		out[i] = sample;
+	}
+}
+
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void mixer_add_sse2(int32_t* bus, const int32_t* in, int samples)
+{
+	int i = 0;
+	for(; i + 4 <= samples; i += 4)
+	{
+		__m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(bus + i)), _mm_loadu_si128((const __m128i*)(in + i)));
+		_mm_storeu_si128((__m128i*)(bus + i), sum);
+	}
+	for(; i < samples; i++)
+		bus[i] += in[i];
+}
+
+__attribute__((target("sse2")))
+void mixer_saturate_sse2(int16_t* out, const int32_t* bus, int samples)
+{
+	int i = 0;
+	for(; i + 8 <= samples; i += 8)
+	{
+		//packs clips to the int16 range
+		__m128i lo = _mm_loadu_si128((const __m128i*)(bus + i));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(bus + i + 4));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+	}
+	mixer_saturate_scalar(out + i, bus + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+void mixer_saturate_minus_sse2(int16_t* out, const int32_t* bus, const int32_t* own, int samples)
+{
+	int i = 0;
+	for(; i + 8 <= samples; i += 8)
+	{
+		__m128i lo = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(bus + i)), _mm_loadu_si128((const __m128i*)(own + i)));
+		__m128i hi = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(bus + i + 4)), _mm_loadu_si128((const __m128i*)(own + i + 4)));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(lo, hi));
+	}
+	mixer_saturate_minus_scalar(out + i, bus + i, own + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void mixer_add_avx2(int32_t* bus, const int32_t* in, int samples)
+{
+	int i = 0;
+	for(; i + 8 <= samples; i += 8)
+	{
+		__m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(bus + i)), _mm256_loadu_si256((const __m256i*)(in + i)));
+		_mm256_storeu_si256((__m256i*)(bus + i), sum);
+	}
+	for(; i < samples; i++)
+		bus[i] += in[i];
+}
+
+__attribute__((target("avx2")))
+void mixer_saturate_avx2(int16_t* out, const int32_t* bus, int samples)
+{
+	int i = 0;
+	for(; i + 16 <= samples; i += 16)
+	{
+		__m256i lo = _mm256_loadu_si256((const __m256i*)(bus + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i*)(bus + i + 8));
+		//packs works within 128 bit lanes, put the 64 bit quarters back in order afterwards
+		__m256i packed = _mm256_packs_epi32(lo, hi);
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	mixer_saturate_scalar(out + i, bus + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+void mixer_saturate_minus_avx2(int16_t* out, const int32_t* bus, const int32_t* own, int samples)
+{
+	int i = 0;
+	for(; i + 16 <= samples; i += 16)
+	{
+		__m256i lo = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(bus + i)), _mm256_loadu_si256((const __m256i*)(own + i)));
+		__m256i hi = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(bus + i + 8)), _mm256_loadu_si256((const __m256i*)(own + i + 8)));
+		__m256i packed = _mm256_packs_epi32(lo, hi);
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	mixer_saturate_minus_scalar(out + i, bus + i, own + i, samples - i);
+}
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Mixing kernels
+ * Peers' audio is summed into a 32 bit bus and saturated back down to 16 bit samples.
+ * mixer_init() picks the fastest implementation the CPU supports, until then the scalar one is used.
+ */
+
+typedef void (*mixer_add_fn)(int32_t*, const int32_t*, int);
+typedef void (*mixer_saturate_fn)(int16_t*, const int32_t*, int);
+typedef void (*mixer_saturate_minus_fn)(int16_t*, const int32_t*, const int32_t*, int);
+
+int		mixer_init();
+const char*	mixer_kernel_name();
+void		mixer_accumulate(int32_t*, const int32_t*, const int32_t*, const int32_t*, int);
+void		mixer_add_bus(int32_t*, const int32_t*, int);
+void		mixer_saturate(int16_t*, const int32_t*, int);
+void		mixer_saturate_minus(int16_t*, const int32_t*, const int32_t*, int);
+
+/* Individual implementations, for benchmarking */
+void		mixer_add_scalar(int32_t*, const int32_t*, int);
+void		mixer_saturate_scalar(int16_t*, const int32_t*, int);
+void		mixer_saturate_minus_scalar(int16_t*, const int32_t*, const int32_t*, int);
+#if defined(__x86_64__) || defined(__i386__)
+void		mixer_add_sse2(int32_t*, const int32_t*, int);
+void		mixer_saturate_sse2(int16_t*, const int32_t*, int);
+void		mixer_saturate_minus_sse2(int16_t*, const int32_t*, const int32_t*, int);
+void		mixer_add_avx2(int32_t*, const int32_t*, int);
+void		mixer_saturate_avx2(int16_t*, const int32_t*, int);
+void		mixer_saturate_minus_avx2(int16_t*, const int32_t*, const int32_t*, int);
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Slab allocator for incoming RTP packets
+ *
+ * Every slot holds an rtp_wrapper immediately followed by room for the raw packet
+ */
+
+#include <stdlib.h>
+
+#include "PacketPool.h"
+#include "Audio.h"
+
+static size_t slot_stride(packet_pool* pool)
+{
+	//Keep every wrapper in the slab properly aligned
+	size_t stride = sizeof(rtp_wrapper) + pool->slot_size;
+	return (stride + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+/* Capacity is in packets and gets rounded up to whole slabs */
+int packet_pool_init(packet_pool* pool, unsigned int capacity, unsigned int slot_size)
+{
+	if(capacity == 0 || slot_size == 0)
+		return 1;
+	pool->max_slabs = (capacity + PACKET_POOL_SLAB_SLOTS - 1) / PACKET_POOL_SLAB_SLOTS;
+	pool->slabs = calloc(pool->max_slabs, sizeof(void*));
+	if(pool->slabs == NULL)
+		return 2;
+	pool->slab_count = 0;
+	pool->slot_size = slot_size;
+	pool->free_list = NULL;
+	pool->in_use = 0;
+	pool->allocations = pool->slab_allocations = pool->heap_fallbacks = 0;
+	return 0;
+}
+
+/* Every packet has to be released before the pool is destroyed */
+void packet_pool_destroy(packet_pool* pool)
+{
+	for(unsigned int i = 0; i < pool->slab_count; i++)
+		free(pool->slabs[i]);
+	free(pool->slabs);
+	pool->slabs = NULL;
+	pool->slab_count = pool->max_slabs = 0;
+	pool->free_list = NULL;
+}
+
+static int packet_pool_grow(packet_pool* pool)
+{
+	if(pool->slab_count >= pool->max_slabs)
+		return 1;
+	size_t stride = slot_stride(pool);
+	unsigned char* slab = malloc(stride * PACKET_POOL_SLAB_SLOTS);
+	if(slab == NULL)
+		return 2;
+	pool->slabs[pool->slab_count++] = slab;
+	pool->slab_allocations++;
+	for(int i = 0; i < PACKET_POOL_SLAB_SLOTS; i++)
+	{
+		rtp_wrapper* slot = (rtp_wrapper*)(slab + i*stride);
+		slot->data = (rtp_header*)(slot + 1);
+		slot->pooled = 1;
+		slot->next = pool->free_list;
+		pool->free_list = slot;
+	}
+	return 0;
+}
+
+/* Returns a packet with room for at least len bytes at packet->data */
+rtp_wrapper* packet_pool_alloc(packet_pool* pool, int len)
+{
+	rtp_wrapper* packet = NULL;
+	if(len <= pool->slot_size && (pool->free_list != NULL || packet_pool_grow(pool) == 0))
+	{
+		packet = pool->free_list;
+		pool->free_list = packet->next;
+	}
+	else
+	{
+		//Exhausted or oversized, fall back on the heap
+		packet = malloc(sizeof(rtp_wrapper) + len);
+		if(packet == NULL)
+			return NULL;
+		packet->data = (rtp_header*)(packet + 1);
+		packet->pooled = 0;
+		pool->heap_fallbacks++;
+	}
+	packet->next = NULL;
+	pool->allocations++;
+	pool->in_use++;
+	return packet;
+}
+
+void packet_pool_release(packet_pool* pool, rtp_wrapper* packet)
+{
+	if(packet == NULL)
+		return;
+	pool->in_use--;
+	if(!packet->pooled)
+	{
+		free(packet);
+		return;
+	}
+	packet->next = pool->free_list;
+	pool->free_list = packet;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+#define PACKET_POOL_SLAB_SLOTS		8
+
+struct rtp_wrapper;
+
+/*
+ * Per-peer allocator for incoming RTP packets
+ * Slots are carved out of slabs that are only allocated while the pool grows,
+ * so once a peer's stream has settled no heap calls are made on the ingest path.
+ * Not thread safe, the owner's mutex has to be held.
+ */
+typedef struct packet_pool {
+	struct rtp_wrapper* free_list;
+	void** slabs;
+	unsigned int slab_count, max_slabs;
+	unsigned int slot_size;
+	unsigned int in_use;
+	//Counters
+	uint64_t allocations;		//Packets handed out
+	uint64_t slab_allocations;	//Heap calls made to grow the pool
+	uint64_t heap_fallbacks;	//Heap calls made because the pool was exhausted or the packet too big
+} packet_pool;
+
+int			packet_pool_init(packet_pool*, unsigned int, unsigned int);
+void			packet_pool_destroy(packet_pool*);
+struct rtp_wrapper*	packet_pool_alloc(packet_pool*, int);
+void			packet_pool_release(packet_pool*, struct rtp_wrapper*);
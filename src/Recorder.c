@@ -0,0 +1,622 @@
+/*
+ * Asynchronous recording
+ *
+ * Threads that produce audio (the mixers, the RTP ingest path) only copy frames into
+ * a recording's ring. Producers claim slots with a compare and swap on the ring's tail,
+ * fill them in and then mark them ready, so they never wait on each other or on the disk.
+ * A full ring drops the frame and counts it instead of blocking.
+ *
+ * One writer thread goes over every open recording each RECORDER_WRITE_INTERVAL, pages
+ * Opus packets into their Ogg streams and gathers whatever's ready into one batch per
+ * recording, which goes to the file in a single unbuffered write.
+ *
+ * Ogg recordings hold one logical stream per track (RTP SSRC), multiplexed into the one
+ * file. Packets are stored as they came in, and their granule positions follow the
+ * tracks' RTP timestamps. Missing packets are filled in with empty frames so a decoder
+ * plays the gaps out as silence and the tracks stay lined up with each other.
+ *
+ * Recordings are closed through the pointer they were opened into, which is cleared first.
+ * Producers read that pointer inside recorder_write(), and the writer only frees a closed
+ * recording once every producer that could have read it before it was cleared has left.
+ *
+ * Traffic captures keep every peer's raw RTP and media events as timestamped records
+ * (Recording.h) for tools/replay.c to feed back into the plugin.
+ *
+ * Next to every file is an index (Recording.h) mapping wall clock and RTP timestamps to
+ * byte offsets, with an entry each RECORDER_INDEX_INTERVAL. Recordings move on to a new
+ * file once the current one reaches a size or length limit, so any point of a recording
+ * that runs for days is a lookup in one small index and a seek in one bounded file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <janus/debug.h>
+#include <janus/utils.h> //janus_get_monotonic_time
+#include <opus/opus.h>
+
+#include "Recorder.h"
+#include "Recording.h"
+#include "Config.h"
+
+static recorder* recordings;
+static pthread_t writer;
+static pthread_mutex_t recorder_mutex = PTHREAD_MUTEX_INITIALIZER; //Recording list, never held while the disk's written to
+static pthread_cond_t recorder_cond;
+static int writer_started;
+static gint writer_stopping;
+static unsigned char* batch; //Writer only
+static size_t batch_length;
+static guint64 segment_size_limit; //Bytes, 0 for no limit
+static gint64 segment_time_limit = (gint64) SETTINGS_RECORDING_SEGMENT_TIME*G_USEC_PER_SEC; //Microseconds, 0 for no limit
+//Threads using a recording through the pointer it was opened into, counted by the generation they started in.
+//Closed recordings are freed once everybody from the generation they were closed in is done with them
+static gint producer_generation; //Atomic, only moved on by the writer
+static gint producers[2]; //Atomic
+static int grace; //Writer only, waiting on the producers from before the last generation
+static guint safe_generation; //Writer only, recordings closed before this generation can be freed
+
+static void* recorder_thread(void*);
+
+static recorder_frame* recorder_slot(recorder* rec, guint position)
+{
+	return (recorder_frame*)(rec->slots + (size_t)(position & (rec->capacity - 1))*rec->stride);
+}
+
+static void recorder_timespec(gint64 time, struct timespec* ts)
+{
+	ts->tv_sec = time / G_USEC_PER_SEC;
+	ts->tv_nsec = (time % G_USEC_PER_SEC) * 1000;
+}
+
+int recorder_init()
+{
+	batch = malloc(RECORDER_BATCH_SIZE);
+	if(batch == NULL)
+		return 1;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&recorder_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	g_atomic_int_set(&writer_stopping, 0);
+	int result = pthread_create(&writer, NULL, &recorder_thread, NULL);
+	if(result != 0)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create the recording thread (error %d)\n", result);
+		pthread_cond_destroy(&recorder_cond);
+		free(batch);
+		batch = NULL;
+		return 2;
+	}
+	writer_started = 1;
+	return 0;
+}
+
+/* Recordings still open are written out and closed */
+void recorder_shutdown()
+{
+	if(!writer_started)
+		return;
+	g_atomic_int_set(&writer_stopping, 1);
+	pthread_mutex_lock(&recorder_mutex);
+		pthread_cond_signal(&recorder_cond);
+	pthread_mutex_unlock(&recorder_mutex);
+	pthread_join(writer, NULL);
+	writer_started = 0;
+	pthread_cond_destroy(&recorder_cond);
+	free(batch);
+	batch = NULL;
+}
+
+/* Size and length recordings' files are limited to, 0 for no limit. Only applies to recordings opened afterwards */
+void recorder_set_segment_limits(guint64 bytes, gint64 duration)
+{
+	segment_size_limit = bytes;
+	segment_time_limit = duration;
+}
+
+/* Open the recording's current file and its index. Later files are <name>.<number>.<extension> */
+static int recorder_open_segment(recorder* rec)
+{
+	char filename[512], index_filename[520];
+	const char* extension = strrchr(rec->filename, '.');
+	if(rec->segment == 0)
+		snprintf(filename, sizeof(filename), "%s", rec->filename);
+	else if(extension == NULL || strchr(extension, '/') != NULL)
+		snprintf(filename, sizeof(filename), "%s.%05u", rec->filename, rec->segment);
+	else
+		snprintf(filename, sizeof(filename), "%.*s.%05u%s", (int)(extension - rec->filename), rec->filename, rec->segment, extension);
+	snprintf(index_filename, sizeof(index_filename), "%s.idx", filename);
+
+	if(rec->format == RECORDER_WAV)
+		rec->file = wav_file_init(filename, rec->sample_rate);
+	else if(rec->format == RECORDER_CAPTURE)
+		rec->file = capture_file_init(filename);
+	else
+	{
+		rec->file = fopen(filename, "wb");
+		//Writes come in whole batches already, stdio's buffer would only split them up.
+		//WAV and capture files are set up the same way before their headers are written
+		if(rec->file != NULL)
+			setvbuf(rec->file, NULL, _IONBF, 0);
+	}
+	if(rec->file == NULL)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't open recording %s\n", filename);
+		return 1;
+	}
+	rec->index = index_file_init(index_filename, rec->format, rec->sample_rate, rec->segment, RECORDER_INDEX_INTERVAL);
+	if(rec->index == NULL)
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Couldn't open recording index %s\n", index_filename);
+	rec->segment_bytes = 0;
+	if(rec->format == RECORDER_WAV)
+		rec->segment_bytes = sizeof(wav_header);
+	else if(rec->format == RECORDER_CAPTURE)
+		rec->segment_bytes = sizeof(capture_header);
+	rec->segment_start = 0;
+	rec->last_index = 0;
+	return 0;
+}
+
+/*
+ * Start recording to a file
+ * Frames up to slot_size bytes are queued, at most slots of them (rounded up to a power of two) at a time.
+ * Ogg recordings start empty, each track's headers are written when its first packet is
+ */
+recorder* recorder_open(const char* filename, int format, int sample_rate, unsigned int slots, unsigned int slot_size)
+{
+	if(!writer_started || filename == NULL || filename[0] == '\0' || slots == 0 || slot_size == 0)
+		return NULL;
+	recorder* rec = calloc(1, sizeof(recorder));
+	if(rec == NULL)
+		return NULL;
+	rec->format = format;
+	rec->sample_rate = sample_rate;
+	rec->capacity = 1;
+	while(rec->capacity < slots)
+		rec->capacity <<= 1;
+	rec->slot_size = slot_size;
+	rec->stride = (sizeof(recorder_frame) + slot_size + 7) & ~7;
+	rec->slots = calloc(rec->capacity, rec->stride);
+	if(rec->slots == NULL)
+	{
+		free(rec);
+		return NULL;
+	}
+	for(unsigned int i = 0; i < rec->capacity; i++)
+		recorder_slot(rec, i)->sequence = i;
+
+	rec->filename = strdup(filename);
+	if(rec->filename == NULL || recorder_open_segment(rec) != 0)
+	{
+		free(rec->filename);
+		free(rec->slots);
+		free(rec);
+		return NULL;
+	}
+
+	if(format == RECORDER_OGG)
+		rec->tracks = g_hash_table_new(g_direct_hash, g_direct_equal);
+	rec->last_header = janus_get_monotonic_time();
+
+	pthread_mutex_lock(&recorder_mutex);
+		rec->next = recordings;
+		recordings = rec;
+	pthread_mutex_unlock(&recorder_mutex);
+	return rec;
+}
+
+/* Count the calling thread in, returns what it has to be counted back out with */
+static int recorder_enter()
+{
+	guint generation;
+	do
+	{
+		generation = g_atomic_int_get(&producer_generation);
+		g_atomic_int_inc(&producers[generation & 1]);
+		//If the generation moved on in between, the writer might already have stopped waiting on us
+		if((guint) g_atomic_int_get(&producer_generation) == generation)
+			break;
+		g_atomic_int_add(&producers[generation & 1], -1);
+	} while(1);
+	return generation & 1;
+}
+
+static void recorder_leave(int producer)
+{
+	g_atomic_int_add(&producers[producer], -1);
+}
+
+/*
+ * Clear the pointer the recording was opened into, after which nothing can be queued to it.
+ * The writer finishes off the file and frees the recording once nobody can still be using it
+ */
+void recorder_close(recorder** ref)
+{
+	recorder* rec = g_atomic_pointer_get(ref);
+	if(rec == NULL || !g_atomic_pointer_compare_and_exchange(ref, rec, NULL))
+		return;
+	g_atomic_int_set(&rec->closing, 1);
+	pthread_mutex_lock(&recorder_mutex);
+		pthread_cond_signal(&recorder_cond);
+	pthread_mutex_unlock(&recorder_mutex);
+}
+
+static int recorder_queue(recorder* rec, guint32 track, guint32 timestamp, const void* data, int length)
+{
+	if(rec == NULL)
+		return 1;
+	if(length < 0 || (unsigned int)length > rec->slot_size)
+	{
+		g_atomic_int_inc(&rec->dropped);
+		return 2;
+	}
+	guint position = g_atomic_int_get(&rec->tail);
+	recorder_frame* frame;
+	for(;;)
+	{
+		frame = recorder_slot(rec, position);
+		gint difference = (gint)((guint)g_atomic_int_get(&frame->sequence) - position);
+		if(difference == 0)
+		{
+			if(g_atomic_int_compare_and_exchange(&rec->tail, (gint)position, (gint)(position + 1)))
+				break;
+		}
+		else if(difference < 0)
+		{
+			//The writer hasn't got to this slot since it last went round, the disk is falling behind
+			g_atomic_int_inc(&rec->dropped);
+			return 3;
+		}
+		position = g_atomic_int_get(&rec->tail);
+	}
+	memcpy(frame->data, data, length);
+	frame->length = length;
+	frame->track = track;
+	frame->timestamp = timestamp;
+	frame->time = janus_get_real_time();
+	g_atomic_int_set(&frame->sequence, position + 1);
+	g_atomic_int_inc(&rec->frames);
+	return 0;
+}
+
+/*
+ * Queue a frame to the recording ref points to, copied into its ring. Returns 0 if it was queued, non-zero if it was dropped
+ * or there's no recording. Ogg frames are Opus packets, with the SSRC and RTP timestamp they were sent with. WAV frames are
+ * samples, the track and timestamp are ignored. Capture frames are a record's data, with the peer's capture id as the track
+ * and the kind of record as the timestamp
+ */
+int recorder_write(recorder** ref, guint32 track, guint32 timestamp, const void* data, int length)
+{
+	int producer = recorder_enter();
+	int result = recorder_queue(g_atomic_pointer_get(ref), track, timestamp, data, length);
+	recorder_leave(producer);
+	return result;
+}
+
+void recorder_get_stats(recorder** ref, recorder_stats* stats)
+{
+	memset(stats, 0, sizeof(recorder_stats));
+	int producer = recorder_enter();
+	recorder* rec = g_atomic_pointer_get(ref);
+	if(rec != NULL)
+	{
+		stats->frames = (guint) g_atomic_int_get(&rec->frames);
+		stats->dropped = (guint) g_atomic_int_get(&rec->dropped);
+		stats->bytes = __atomic_load_n(&rec->bytes, __ATOMIC_RELAXED);
+	}
+	recorder_leave(producer);
+}
+
+
+
+static void recorder_flush_batch(recorder* rec)
+{
+	if(batch_length == 0)
+		return;
+	if(fwrite(batch, 1, batch_length, rec->file) != batch_length)
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error writing recording\n");
+	__atomic_fetch_add(&rec->bytes, batch_length, __ATOMIC_RELAXED);
+	rec->segment_bytes += batch_length;
+	batch_length = 0;
+}
+
+static void recorder_append(recorder* rec, const unsigned char* data, size_t length)
+{
+	if(batch_length + length > RECORDER_BATCH_SIZE)
+		recorder_flush_batch(rec);
+	if(length > RECORDER_BATCH_SIZE)
+	{
+		if(fwrite(data, 1, length, rec->file) != length)
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Error writing recording\n");
+		__atomic_fetch_add(&rec->bytes, length, __ATOMIC_RELAXED);
+		rec->segment_bytes += length;
+		return;
+	}
+	memcpy(batch + batch_length, data, length);
+	batch_length += length;
+}
+
+static void recorder_append_pages(recorder* rec, recorder_track* track, int flush)
+{
+	ogg_page page;
+	while(flush ? ogg_stream_flush(&track->ogg, &page) : ogg_stream_pageout(&track->ogg, &page))
+	{
+		recorder_append(rec, page.header, page.header_len);
+		recorder_append(rec, page.body, page.body_len);
+	}
+}
+
+static void recorder_packetin(recorder_track* track, unsigned char* data, int length)
+{
+	ogg_packet op;
+	memset(&op, 0, sizeof(op));
+	op.packet = data;
+	op.bytes = length;
+	op.granulepos = track->granulepos;
+	op.packetno = track->packetno++;
+	ogg_stream_packetin(&track->ogg, &op);
+}
+
+/* Start the track's logical stream in the current file, its headers get a page of their own */
+static void recorder_open_track(recorder* rec, recorder_track* track, guint32 serial)
+{
+	ogg_stream_init(&track->ogg, (int) serial);
+	ogg_packet* op = op_opushead(rec->sample_rate);
+	ogg_stream_packetin(&track->ogg, op);
+	op_free(op);
+	op = op_opustags();
+	ogg_stream_packetin(&track->ogg, op);
+	op_free(op);
+	track->packetno = 2;
+	track->open = 1;
+	recorder_append_pages(rec, track, 1);
+}
+
+/* Page an Opus packet into its track, after empty frames for anything missing since the track's last one */
+static void recorder_write_packet(recorder* rec, recorder_frame* frame)
+{
+	int samples = opus_packet_get_nb_samples(frame->data, frame->length, 48000);
+	if(samples <= 0)
+		return;
+	recorder_track* track = g_hash_table_lookup(rec->tracks, GUINT_TO_POINTER(frame->track));
+	if(track == NULL)
+	{
+		track = calloc(1, sizeof(recorder_track));
+		if(track == NULL)
+			return;
+		track->next_timestamp = frame->timestamp;
+		g_hash_table_insert(rec->tracks, GUINT_TO_POINTER(frame->track), track);
+	}
+	//Tracks carry on into the next file with their granule positions, which then tell players where in the recording they start
+	if(!track->open)
+		recorder_open_track(rec, track, frame->track);
+	gint32 gap = (gint32)(frame->timestamp - track->next_timestamp);
+	//Reordered or repeated, the track's already past it
+	if(gap < 0 && gap > -RECORDER_MAX_GAP)
+		return;
+	if(gap > 0 && gap <= RECORDER_MAX_GAP)
+	{
+		//A TOC byte on its own is a frame with nothing in it, which decodes to the same as a lost one
+		unsigned char filler = frame->data[0] & 0xFC;
+		int frame_size = opus_packet_get_samples_per_frame(frame->data, 48000);
+		for(; gap >= frame_size; gap -= frame_size)
+		{
+			track->granulepos += frame_size;
+			recorder_packetin(track, &filler, 1);
+		}
+	}
+	track->granulepos += samples;
+	track->next_timestamp = frame->timestamp + samples;
+	recorder_packetin(track, frame->data, frame->length);
+	recorder_append_pages(rec, track, 0);
+}
+
+/* Every file of a capture starts with its own header, so records are only ever split up between files whole */
+static void recorder_write_record(recorder* rec, recorder_frame* frame)
+{
+	capture_record record;
+	memset(&record, 0, sizeof(record));
+	record.time = frame->time;
+	record.session = frame->track;
+	record.kind = frame->timestamp;
+	record.length = frame->length;
+	recorder_append(rec, (const unsigned char*) &record, sizeof(record));
+	recorder_append(rec, frame->data, frame->length);
+}
+
+/* Finish off the current file. Ogg tracks are flushed and start new logical streams in the next one */
+static void recorder_close_segment(recorder* rec)
+{
+	if(rec->format == RECORDER_OGG)
+	{
+		GList* tracks = g_hash_table_get_values(rec->tracks);
+		for(GList* item = tracks; item != NULL; item = item->next)
+		{
+			recorder_track* track = item->data;
+			if(!track->open)
+				continue;
+			recorder_append_pages(rec, track, 1);
+			ogg_stream_clear(&track->ogg);
+			track->open = 0;
+		}
+		g_list_free(tracks);
+	}
+	recorder_flush_batch(rec);
+	if(rec->format == RECORDER_WAV)
+		wav_file_update_header(rec->file);
+	fclose(rec->file);
+	rec->file = NULL;
+	if(rec->index != NULL)
+		fclose(rec->index);
+	rec->index = NULL;
+}
+
+/* Index entries and moving on to the next file happen between frames */
+static void recorder_mark(recorder* rec, recorder_frame* frame)
+{
+	if(rec->segment_start != 0 && ((segment_size_limit > 0 && rec->segment_bytes + batch_length >= segment_size_limit)
+		|| (segment_time_limit > 0 && frame->time - rec->segment_start >= segment_time_limit)))
+	{
+		recorder_close_segment(rec);
+		rec->segment++;
+		if(recorder_open_segment(rec) != 0)
+			return;
+	}
+	if(rec->segment_start == 0)
+		rec->segment_start = frame->time;
+	if(rec->last_index != 0 && frame->time - rec->last_index < RECORDER_INDEX_INTERVAL)
+		return;
+	rec->last_index = frame->time;
+	index_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.time = frame->time;
+	entry.offset = rec->segment_bytes + batch_length;
+	entry.timestamp = frame->timestamp;
+	entry.serial = frame->track;
+	if(rec->format == RECORDER_OGG)
+	{
+		recorder_track* track = g_hash_table_lookup(rec->tracks, GUINT_TO_POINTER(frame->track));
+		//A track that isn't in this file yet starts at page 0, its headers are the first two
+		entry.pageno = track != NULL && track->open ? track->ogg.pageno : 0;
+	}
+	index_file_write(rec->index, &entry);
+}
+
+/* Write out everything that's ready in a recording's ring */
+static void recorder_drain(recorder* rec)
+{
+	//The recording couldn't move on to its next file, frames are thrown away until it can
+	int writable = rec->file != NULL || recorder_open_segment(rec) == 0;
+	for(;;)
+	{
+		recorder_frame* frame = recorder_slot(rec, rec->head);
+		//Claimed by a producer that's still copying its frame in, it'll be picked up next pass
+		if((guint)g_atomic_int_get(&frame->sequence) != rec->head + 1)
+			break;
+		if(writable)
+		{
+			recorder_mark(rec, frame);
+			writable = rec->file != NULL;
+		}
+		if(!writable)
+			g_atomic_int_inc(&rec->dropped);
+		else if(rec->format == RECORDER_OGG)
+			recorder_write_packet(rec, frame);
+		else if(rec->format == RECORDER_CAPTURE)
+			recorder_write_record(rec, frame);
+		else
+			recorder_append(rec, frame->data, frame->length);
+		g_atomic_int_set(&frame->sequence, rec->head + rec->capacity);
+		rec->head++;
+	}
+	if(rec->file != NULL)
+		recorder_flush_batch(rec);
+	else
+		batch_length = 0;
+	if(rec->index != NULL)
+		fflush(rec->index);
+
+	guint64 dropped = (guint) g_atomic_int_get(&rec->dropped);
+	if(dropped != rec->reported_drops)
+	{
+		JANUS_LOG(LOG_WARN, "[Stream Lobby] Recording fell behind or couldn't be written, dropped %"SCNu64" frames\n", dropped - rec->reported_drops);
+		rec->reported_drops = dropped;
+	}
+	if(rec->format == RECORDER_WAV && rec->file != NULL && janus_get_monotonic_time() - rec->last_header >= RECORDER_HEADER_INTERVAL)
+	{
+		rec->last_header = janus_get_monotonic_time();
+		wav_file_update_header(rec->file);
+	}
+}
+
+static void recorder_finish(recorder* rec)
+{
+	if(rec->file != NULL)
+		recorder_close_segment(rec);
+	if(rec->format == RECORDER_OGG)
+	{
+		GList* tracks = g_hash_table_get_values(rec->tracks);
+		for(GList* item = tracks; item != NULL; item = item->next)
+			free(item->data);
+		g_list_free(tracks);
+		g_hash_table_destroy(rec->tracks);
+	}
+	free(rec->filename);
+	free(rec->slots);
+	free(rec);
+}
+
+static void* recorder_thread(void* data)
+{
+	struct timespec wakeup;
+	for(;;)
+	{
+		int stopping = g_atomic_int_get(&writer_stopping);
+		//Recordings are only added at the front and only this thread takes them out,
+		//so the ones already there can be gone over without the lock
+		pthread_mutex_lock(&recorder_mutex);
+			recorder* first = recordings;
+		pthread_mutex_unlock(&recorder_mutex);
+		guint generation = g_atomic_int_get(&producer_generation);
+		for(recorder* rec = first; rec != NULL; rec = rec->next)
+		{
+			//Read before draining, anything queued before the recording was closed is still written
+			int closing = g_atomic_int_get(&rec->closing);
+			recorder_drain(rec);
+			if((closing || stopping) && !rec->retired)
+			{
+				rec->retired = 1;
+				rec->retired_generation = generation;
+			}
+		}
+		//Producers that read a closed recording's pointer before it was cleared all started in its generation or earlier
+		if(grace && g_atomic_int_get(&producers[(generation - 1) & 1]) == 0)
+		{
+			grace = 0;
+			safe_generation = generation;
+		}
+		recorder* finished = NULL;
+		int retired = 0;
+		pthread_mutex_lock(&recorder_mutex);
+			recorder** link = &recordings;
+			while(*link != NULL)
+			{
+				recorder* rec = *link;
+				if(!rec->retired || (gint)(safe_generation - rec->retired_generation) <= 0)
+				{
+					retired |= rec->retired;
+					link = &rec->next;
+					continue;
+				}
+				*link = rec->next;
+				rec->next = finished;
+				finished = rec;
+			}
+			int empty = recordings == NULL;
+		pthread_mutex_unlock(&recorder_mutex);
+		if(retired && !grace)
+		{
+			//Producers from here on can't get to the retired recordings, the ones from before are waited out
+			g_atomic_int_inc(&producer_generation);
+			grace = 1;
+		}
+		while(finished != NULL)
+		{
+			recorder* rec = finished;
+			finished = rec->next;
+			//Producers that had it might have queued more since it was last drained
+			recorder_drain(rec);
+			recorder_finish(rec);
+		}
+		if(stopping && empty)
+			break;
+		//Stopping only waits on the last producers to leave
+		recorder_timespec(janus_get_monotonic_time() + (stopping ? 1000 : RECORDER_WRITE_INTERVAL), &wakeup);
+		pthread_mutex_lock(&recorder_mutex);
+			pthread_cond_timedwait(&recorder_cond, &recorder_mutex, &wakeup);
+		pthread_mutex_unlock(&recorder_mutex);
+	}
+	return NULL;
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdio.h>
+#include <pthread.h>
+#include <ogg/ogg.h>
+#include <glib.h>
+
+#define RECORDER_OGG	0	//Opus packets, paged into one logical Ogg stream per track by the writer
+#define RECORDER_WAV	1	//16 bit PCM
+#define RECORDER_CAPTURE	2	//Traffic capture records, see Recording.h
+
+#define RECORDER_BATCH_SIZE		262144	//Bytes the writer gathers before handing them to the file
+#define RECORDER_WRITE_INTERVAL		100000	//Microseconds between the writer's passes over the recordings
+#define RECORDER_HEADER_INTERVAL	5000000	//Microseconds between WAV header updates
+#define RECORDER_INDEX_INTERVAL		1000000	//Microseconds of recording between index entries
+#define RECORDER_MAX_GAP		(48000*600)	//Longest gap in a track's timestamps that's filled in, longer ones are taken as the stream restarting
+
+/* Slot in a recording's ring, followed by room for the frame */
+typedef struct recorder_frame {
+	gint sequence; //Atomic. Ring position the slot is free for, or one past the one it holds a frame for
+	int length;
+	guint32 track; //Ogg: the track's serial number, i.e. its RTP SSRC. Capture: the peer's capture id
+	guint32 timestamp; //Ogg: RTP timestamp, 48kHz. Capture: kind of record
+	gint64 time; //Wall clock when the frame was queued
+	unsigned char data[];
+} recorder_frame;
+
+/* Logical stream in an Ogg recording, created when the track's first packet is written */
+typedef struct recorder_track {
+	ogg_stream_state ogg;
+	ogg_int64_t packetno;
+	ogg_int64_t granulepos; //End of the last packet, in 48kHz samples from the start of the track
+	guint32 next_timestamp; //Where the next packet would start if none were missing
+	int open; //Has a logical stream in the current file
+} recorder_track;
+
+typedef struct recorder_stats {
+	guint64 frames; //Queued
+	guint64 dropped; //Lost because the ring was full or the frame too big
+	guint64 bytes; //Written to the file
+} recorder_stats;
+
+/*
+ * File being recorded to
+ * Any number of threads queue frames into the ring without locking, only the writer thread touches the file.
+ * Used through the pointer it was opened into, which recorder_close() clears
+ */
+typedef struct recorder {
+	int format;
+	int sample_rate;
+	char* filename; //Of the first file, later ones get their number put in before the extension
+	FILE* file;
+	FILE* index;
+	//Ring
+	char* slots;
+	unsigned int capacity; //Slots, a power of two
+	unsigned int slot_size, stride;
+	gint tail; //Atomic, next position handed to a producer
+	guint head; //Writer only
+	//Writer only
+	GHashTable* tracks; //Ogg, SSRC to recorder_track
+	unsigned int segment; //Number of the current file
+	guint64 segment_bytes; //Written to the current file
+	gint64 segment_start, last_index; //Wall clock times of the current file's first frame and last index entry
+	gint64 last_header;
+	guint64 reported_drops;
+	int retired; //Closed, freed once nobody can be using it anymore
+	guint retired_generation; //Producer generation it was retired in
+	//Counters, atomic
+	gint frames, dropped;
+	guint64 bytes; //Over every file
+	gint closing;
+	struct recorder* next;
+} recorder;
+
+int		recorder_init();
+void		recorder_shutdown();
+void		recorder_set_segment_limits(guint64, gint64);
+recorder*	recorder_open(const char*, int, int, unsigned int, unsigned int);
+void		recorder_close(recorder**);
+int		recorder_write(recorder**, guint32, guint32, const void*, int);
+void		recorder_get_stats(recorder**, recorder_stats*);
@@ -23,7 +23,7 @@ void le16(unsigned char *p, int v) {
 	p[1] = (v >> 8) & 0xff;
 }
 /* Manufacture a generic OpusHead packet */
-ogg_packet *op_opushead(void) {
+ogg_packet *op_opushead(int sample_rate) {
 	int size = 19;
 	unsigned char *data = g_malloc0(size);
 	ogg_packet *op = g_malloc0(sizeof(*op));
@@ -41,7 +41,7 @@ ogg_packet *op_opushead(void) {
 	data[8] = 1;                  /* version */
 	data[9] = 1;                  /* channels */
 	le16(data+10, 0);             /* pre-skip */
-	le32(data + 12, 48000);       /* original sample rate */
+	le32(data + 12, sample_rate); /* original sample rate */
 	le16(data + 16, 0);           /* gain */
 	data[18] = 0;                 /* channel mapping family */
 
@@ -109,79 +109,16 @@ void op_free(ogg_packet *op) {
 		g_free(op);
 	}
 }
-/* Write out available ogg pages */
-void ogg_write(lobby* room, char thing) {
-	ogg_page page;
-	size_t written;
-	ogg_stream_state* ss;
-	FILE* outfile;
-	if(thing == 'i')
-	{
-		ss = room->in_ss;
-		outfile = room->in_file;
-	}
-	else if(thing == 'o')
-	{
-		ss = room->out_ss;
-		outfile = room->out_file;
-	}
-	else
-		return;
-
-	while (ogg_stream_pageout(ss, &page)) {
-		written = fwrite(page.header, 1, page.header_len, outfile);
-		if(written != (size_t)page.header_len) {
-			JANUS_LOG(LOG_ERR, "Error writing Ogg page header\n");
-			return;
-		}
-		written = fwrite(page.body, 1, page.body_len, outfile);
-		if(written != (size_t)page.body_len) {
-			JANUS_LOG(LOG_ERR, "Error writing Ogg page body\n");
-			return;
-		}
-	}
-}
-/* Flush remaining ogg data */
-void ogg_flush(lobby* room, char thing) {
-	ogg_page page;
-	size_t written;
-	ogg_stream_state* ss;
-	FILE* outfile;
-	if(thing == 'i')
-	{
-		ss = room->in_ss;
-		outfile = room->in_file;
-	}
-	else if(thing == 'o')
-	{
-		ss = room->out_ss;
-		outfile = room->out_file;
-	}
-	else
-		return;
 
-	while (ogg_stream_flush(ss, &page)) {
-		written = fwrite(page.header, 1, page.header_len, outfile);
-		if(written != (size_t)page.header_len) {
-			JANUS_LOG(LOG_ERR, "Error writing Ogg page header\n");
-			return;
-		}
-		written = fwrite(page.body, 1, page.body_len, outfile);
-		if(written != (size_t)page.body_len) {
-			JANUS_LOG(LOG_ERR, "Error writing Ogg page body\n");
-			return;
-		}
-	}
-}
-
-
-FILE* wav_file_init(const char* filename)
+FILE* wav_file_init(const char* filename, int sample_rate)
 {
 	if(strlen(filename) == 0)
 		return NULL;
 	FILE* wavFile = fopen(filename, "wb");
 	if(!wavFile)
 		return NULL;
+	//The recorder writes whole batches, stdio's buffer would only split them up. Has to be set before the header goes in
+	setvbuf(wavFile, NULL, _IONBF, 0);
 
 	wav_header header;
 	header.riff[0] = 'R';
@@ -200,11 +137,11 @@ FILE* wav_file_init(const char* filename)
 	header.formatsize = 16;
 	header.format = 1;
 	header.channels = SETTINGS_CHANNELS;
-	header.samplerate = 48000;
+	header.samplerate = sample_rate;
 	//header.avgbyterate = 96000; //mono
 	//header.avgbyterate = 19200; //stereo
 	//avg byte rate    = sample rate * channels * bytes per sample [opus_int16 = 2 bytes]
-	header.avgbyterate = SETTINGS_SAMPLE_RATE * SETTINGS_CHANNELS * 2;
+	header.avgbyterate = sample_rate * SETTINGS_CHANNELS * 2;
 	header.samplebytes = 2;
 	header.channelbits = 16;
 	header.data[0] = 'd';
@@ -221,17 +158,6 @@ FILE* wav_file_init(const char* filename)
 	return wavFile;
 }
 
-void wav_file_write(FILE* wavFile, int32_t* in_buffer, int length)
-{
-	if(!wavFile)
-		return;
-
-	int16_t out_buffer[length];
-	for(int i = 0; i < length; i++)
-		out_buffer[i] = in_buffer[i];
-	fwrite(out_buffer, sizeof(int16_t), length, wavFile);
-}
-
 void wav_file_update_header(FILE* wavFile)
 {
 	fseek(wavFile, 0, SEEK_END);
@@ -248,3 +174,49 @@ void wav_file_update_header(FILE* wavFile)
 		fseek(wavFile, 0, SEEK_END);
 	}
 }
+
+FILE* capture_file_init(const char* filename)
+{
+	FILE* captureFile = fopen(filename, "wb");
+	if(!captureFile)
+		return NULL;
+	setvbuf(captureFile, NULL, _IONBF, 0);
+
+	capture_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SLCP", 4);
+	header.version = 1;
+	if(fwrite(&header, 1, sizeof(header), captureFile) != sizeof(header)) {
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error writing capture header...\n");
+	}
+	return captureFile;
+}
+
+FILE* index_file_init(const char* filename, int format, int sample_rate, unsigned int segment, unsigned int interval)
+{
+	FILE* indexFile = fopen(filename, "wb");
+	if(!indexFile)
+		return NULL;
+
+	index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SLIX", 4);
+	header.version = 1;
+	header.format = format;
+	header.sample_rate = sample_rate;
+	header.segment = segment;
+	header.interval = interval;
+	if(fwrite(&header, 1, sizeof(header), indexFile) != sizeof(header)) {
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error writing index header...\n");
+	}
+	return indexFile;
+}
+
+void index_file_write(FILE* indexFile, const index_entry* entry)
+{
+	if(!indexFile)
+		return;
+	if(fwrite(entry, 1, sizeof(index_entry), indexFile) != sizeof(index_entry)) {
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error writing index entry...\n");
+	}
+}
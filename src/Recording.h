@@ -3,8 +3,6 @@
 #include <ogg/ogg.h>
 #include <opus/opus.h>
 
-#include "Lobbies.h"
-
 
 typedef struct wav_header {
 	char riff[4];
@@ -22,15 +20,59 @@ typedef struct wav_header {
 	uint32_t blocksize;
 } wav_header;
 
+/*
+ * Recording index sidecar (<recording>.idx): this header, then entries in the order they were written
+ * An entry's offset is where the recording's first byte written after its time is, i.e. an Ogg page
+ * boundary that any track can be read from, or a WAV sample
+ */
+typedef struct index_header {
+	char magic[4]; //"SLIX"
+	uint32_t version;
+	uint32_t format; //RECORDER_OGG, RECORDER_WAV or RECORDER_CAPTURE
+	uint32_t sample_rate;
+	uint32_t segment; //Number of the recording's file, the first one is 0
+	uint32_t interval; //Microseconds between entries
+} index_header;
+
+typedef struct index_entry {
+	int64_t time; //Wall clock, microseconds since the epoch
+	uint64_t offset; //Bytes into the recording
+	uint32_t timestamp; //RTP timestamp of the first frame at or after the offset
+	uint32_t serial; //Ogg: that frame's track
+	uint32_t pageno; //Ogg: sequence number of that track's next page
+	uint32_t reserved;
+} index_entry;
+
+/*
+ * Traffic capture (RECORDER_CAPTURE): this header, then records in the order they were queued, each followed by length bytes
+ * of data. RTP records hold the packet as it came in, header and all. Media records hold the peer's Opus payload type and
+ * audio level extension id (0 if none), one byte each, then the name of the lobby their media started in. Hangups have no data
+ */
+#define CAPTURE_RTP	0
+#define CAPTURE_MEDIA	1
+#define CAPTURE_HANGUP	2
+
+typedef struct capture_header {
+	char magic[4]; //"SLCP"
+	uint32_t version;
+} capture_header;
+
+typedef struct capture_record {
+	int64_t time; //Wall clock when the record was queued, microseconds since the epoch
+	uint32_t session; //Peer's capture id
+	uint16_t kind;
+	uint16_t length;
+} capture_record;
+
 /* OGG/Opus helpers */
 void		le32(unsigned char *p, int v);
 void		le16(unsigned char *p, int v);
-ogg_packet*	op_opushead(void);
+ogg_packet*	op_opushead(int);
 ogg_packet*	op_opustags(void);
 ogg_packet*	op_from_pkt(const unsigned char *pkt, int len);
 void		op_free(ogg_packet *op);
-void		ogg_write(lobby*, char);
-void		ogg_flush(lobby*, char);
-FILE*		wav_file_init(const char*);
-void		wav_file_write(FILE*, opus_int32*, int);
+FILE*		wav_file_init(const char*, int);
+FILE*		capture_file_init(const char*);
+FILE*		index_file_init(const char*, int, int, unsigned int, unsigned int);
+void		index_file_write(FILE*, const index_entry*);
 void		wav_file_update_header(FILE*);
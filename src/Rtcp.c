@@ -0,0 +1,156 @@
+/*
+ * RTCP parsing and sender reports
+ *
+ * Just enough of RFC 3550 to read the reports peers send us, and to tell listeners
+ * how the lobby's stream lines up with the wall clock so they can work out their
+ * round trip time. Packets are walked straight out of the compound packet Janus
+ * hands us, nothing is copied.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "Rtcp.h"
+
+#define NTP_UNIX_OFFSET	2208988800ULL //Seconds between 1900 and 1970
+
+static uint32_t rtcp_read32(const unsigned char* p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return ntohl(value);
+}
+
+static void rtcp_write32(unsigned char* p, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(p, &value, 4);
+}
+
+/*
+ * Find the reception report block about the given source in a compound RTCP packet,
+ * from either a receiver or a sender report. Peers can report on other streams too,
+ * video or anything they're forwarding, so the others are skipped
+ * Returns 0 if a block was found
+ */
+int rtcp_get_report_block(const char* buf, int len, uint32_t ssrc, rtcp_report_block* block)
+{
+	const unsigned char* p = (const unsigned char*) buf;
+	while(len >= 4)
+	{
+		int version = p[0] >> 6, count = p[0] & 0x1F, type = p[1];
+		int length = 4*(((p[2] << 8) | p[3]) + 1);
+		if(version != 2 || length > len)
+			return 1;
+		//Report blocks come after the reporter's SSRC, and after the sender info in a sender report
+		int offset = type == RTCP_SR ? 28 : 8;
+		for(int i = 0; (type == RTCP_RR || type == RTCP_SR) && i < count && offset + 24 <= length; i++, offset += 24)
+		{
+			const unsigned char* rb = p + offset;
+			if(rtcp_read32(rb) != ssrc)
+				continue;
+			block->ssrc = ssrc;
+			block->fraction_lost = rb[4];
+			//24 bit signed
+			block->cumulative_lost = (int32_t)(((uint32_t) rb[5] << 24) | ((uint32_t) rb[6] << 16) | ((uint32_t) rb[7] << 8)) >> 8;
+			block->highest_seq = rtcp_read32(rb + 8);
+			block->jitter = rtcp_read32(rb + 12);
+			block->lsr = rtcp_read32(rb + 16);
+			block->dlsr = rtcp_read32(rb + 20);
+			return 0;
+		}
+		p += length;
+		len -= length;
+	}
+	return 1;
+}
+
+/* Sender info from the first sender report in a compound RTCP packet. Returns 0 if there was one */
+int rtcp_get_sender_info(const char* buf, int len, rtcp_sender_info* info)
+{
+	const unsigned char* p = (const unsigned char*) buf;
+	while(len >= 4)
+	{
+		int version = p[0] >> 6, type = p[1];
+		int length = 4*(((p[2] << 8) | p[3]) + 1);
+		if(version != 2 || length > len)
+			return 1;
+		if(type == RTCP_SR && length >= 28)
+		{
+			info->ssrc = rtcp_read32(p + 4);
+			info->ntp = ((uint64_t) rtcp_read32(p + 8) << 32) | rtcp_read32(p + 12);
+			info->rtp_timestamp = rtcp_read32(p + 16);
+			info->packets = rtcp_read32(p + 20);
+			info->octets = rtcp_read32(p + 24);
+			return 0;
+		}
+		p += length;
+		len -= length;
+	}
+	return 1;
+}
+
+/*
+ * Compound packet with a sender report (no report blocks, we don't receive the
+ * listener's stream) and the CNAME every compound packet has to carry
+ * Returns the packet's length, or -1 if it doesn't fit
+ */
+int rtcp_build_sender_report(char* buf, int size, const rtcp_sender_info* info, const char* cname)
+{
+	int cname_length = strlen(cname);
+	if(cname_length > 255)
+		cname_length = 255;
+	//SDES header and one chunk: SSRC, CNAME item, at least one null octet to end the item list, padded to 32 bits
+	int sdes_length = 4 + ((4 + 2 + cname_length + 1 + 3) & ~3);
+	if(size < 28 + sdes_length)
+		return -1;
+	unsigned char* p = (unsigned char*) buf;
+	memset(p, 0, 28 + sdes_length);
+
+	p[0] = 2 << 6;
+	p[1] = RTCP_SR;
+	p[2] = 0;
+	p[3] = 6; //Length in 32 bit words, minus one
+	rtcp_write32(p + 4, info->ssrc);
+	rtcp_write32(p + 8, info->ntp >> 32);
+	rtcp_write32(p + 12, info->ntp & 0xFFFFFFFF);
+	rtcp_write32(p + 16, info->rtp_timestamp);
+	rtcp_write32(p + 20, info->packets);
+	rtcp_write32(p + 24, info->octets);
+
+	p += 28;
+	p[0] = (2 << 6) | 1;
+	p[1] = RTCP_SDES;
+	p[2] = 0;
+	p[3] = sdes_length/4 - 1;
+	rtcp_write32(p + 4, info->ssrc);
+	p[8] = RTCP_SDES_CNAME;
+	p[9] = cname_length;
+	memcpy(p + 10, cname, cname_length);
+	return 28 + sdes_length;
+}
+
+/* NTP timestamp for a wall clock time in microseconds since the epoch */
+uint64_t rtcp_ntp_time(int64_t real_time)
+{
+	uint64_t seconds = real_time/1000000 + NTP_UNIX_OFFSET;
+	uint64_t fraction = ((uint64_t)(real_time % 1000000) << 32)/1000000;
+	return (seconds << 32) | fraction;
+}
+
+/*
+ * Round trip time in microseconds from a report block about one of our sender reports,
+ * given the NTP time the report arrived at (RFC 3550 section 6.4.1)
+ * Returns -1 if the report doesn't refer to a sender report
+ */
+int64_t rtcp_round_trip_time(uint64_t arrival, const rtcp_report_block* block)
+{
+	if(block->lsr == 0)
+		return -1;
+	//Middle 32 bits of the NTP time, 16.16 fixed point seconds
+	uint32_t now = (arrival >> 16) & 0xFFFFFFFF;
+	uint32_t rtt = now - block->lsr - block->dlsr;
+	if(rtt > now - block->lsr) //Clock went backwards or a bogus delay
+		return -1;
+	return ((int64_t) rtt*1000000) >> 16;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+#define RTCP_SR		200
+#define RTCP_RR		201
+#define RTCP_SDES	202
+
+#define RTCP_SDES_CNAME	1
+
+/* Reception report block (RFC 3550 section 6.4.1), in host byte order */
+typedef struct rtcp_report_block {
+	uint32_t ssrc; //Source the report is about
+	uint8_t fraction_lost; //Fraction of packets lost since the last report, out of 256
+	int32_t cumulative_lost;
+	uint32_t highest_seq; //Extended highest sequence number received
+	uint32_t jitter; //Interarrival jitter, RTP timestamp units
+	uint32_t lsr; //Middle 32 bits of the last SR's NTP timestamp
+	uint32_t dlsr; //Delay since the last SR, 1/65536 seconds
+} rtcp_report_block;
+
+/* Sender info of a sender report, in host byte order */
+typedef struct rtcp_sender_info {
+	uint32_t ssrc;
+	uint64_t ntp; //NTP timestamp, 32.32 fixed point seconds since 1900
+	uint32_t rtp_timestamp; //RTP timestamp corresponding to the NTP one
+	uint32_t packets;
+	uint32_t octets; //Payload octets
+} rtcp_sender_info;
+
+int		rtcp_get_report_block(const char*, int, uint32_t, rtcp_report_block*);
+int		rtcp_get_sender_info(const char*, int, rtcp_sender_info*);
+int		rtcp_build_sender_report(char*, int, const rtcp_sender_info*, const char*);
+uint64_t	rtcp_ntp_time(int64_t);
+int64_t		rtcp_round_trip_time(uint64_t, const rtcp_report_block*);
@@ -0,0 +1,341 @@
+/*
+ * Periodic task scheduler
+ *
+ * A fixed number of threads run any number of periodic tasks (i.e. the lobbies' mixers)
+ * against deadlines on the monotonic clock. Each task has its own period. New tasks are
+ * spread over phase slots within their period so their ticks don't all line up, and go
+ * to the least loaded worker. Workers
+ * regularly compare loads and move tasks over if one of them has a lot more to do.
+ *
+ * Deadlines are absolute and only ever advance by whole periods, so a task's ticks stay
+ * on its phase no matter how late any single one of them runs. A task that falls behind
+ * by less than SCHEDULER_MAX_CATCHUP periods runs its missed ticks back to back. Past that
+ * the missed ticks are dropped, and the task is told how many on its next tick.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <janus/debug.h>
+#include <janus/utils.h> //janus_get_monotonic_time
+
+#include "Scheduler.h"
+
+static void* scheduler_thread(void*);
+static void scheduler_rebalance(scheduler*);
+
+/* First tick on the task's phase that's still ahead */
+static gint64 scheduler_next_deadline(scheduler_task* task)
+{
+	gint64 now = janus_get_monotonic_time();
+	return task->phase + ((now - task->phase)/task->period + 1)*task->period;
+}
+
+static void scheduler_timespec(gint64 time, struct timespec* ts)
+{
+	ts->tv_sec = time / G_USEC_PER_SEC;
+	ts->tv_nsec = (time % G_USEC_PER_SEC) * 1000;
+}
+
+/* A worker count of 0 uses one thread per core */
+scheduler* scheduler_create(const char* name, unsigned int workers)
+{
+	if(workers == 0)
+		workers = g_get_num_processors();
+	if(workers == 0)
+		workers = 1;
+
+	scheduler* sched = calloc(1, sizeof(scheduler));
+	if(sched == NULL)
+		return NULL;
+	sched->workers = calloc(workers, sizeof(scheduler_worker));
+	if(sched->workers == NULL)
+	{
+		free(sched);
+		return NULL;
+	}
+	snprintf(sched->name, 16, "%s", name);
+	sched->worker_count = workers;
+	pthread_mutex_init(&sched->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for(unsigned int i = 0; i < workers; i++)
+	{
+		scheduler_worker* worker = &sched->workers[i];
+		worker->scheduler = sched;
+		worker->index = i;
+		pthread_mutex_init(&worker->mutex, NULL);
+		pthread_cond_init(&worker->cond, &attr);
+	}
+	pthread_condattr_destroy(&attr);
+
+	for(unsigned int i = 0; i < workers; i++)
+	{
+		int result = pthread_create(&sched->workers[i].thread, NULL, &scheduler_thread, &sched->workers[i]);
+		if(result != 0)
+		{
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create %s thread #%u (error %d)\n", sched->name, i, result);
+			break;
+		}
+		sched->started++;
+	}
+	if(sched->started == 0)
+	{
+		scheduler_destroy(sched);
+		return NULL;
+	}
+	JANUS_LOG(LOG_INFO, "Started %u %s threads\n", sched->started, sched->name);
+	return sched;
+}
+
+/* Tasks have to be removed first */
+void scheduler_destroy(scheduler* sched)
+{
+	if(sched == NULL)
+		return;
+	g_atomic_int_set(&sched->stopping, 1);
+	for(unsigned int i = 0; i < sched->started; i++)
+	{
+		pthread_mutex_lock(&sched->workers[i].mutex);
+			pthread_cond_broadcast(&sched->workers[i].cond);
+		pthread_mutex_unlock(&sched->workers[i].mutex);
+	}
+	for(unsigned int i = 0; i < sched->started; i++)
+		pthread_join(sched->workers[i].thread, NULL);
+
+	for(unsigned int i = 0; i < sched->worker_count; i++)
+	{
+		scheduler_worker* worker = &sched->workers[i];
+		while(worker->tasks != NULL)
+		{
+			scheduler_task* task = worker->tasks;
+			worker->tasks = task->next;
+			free(task);
+		}
+		pthread_cond_destroy(&worker->cond);
+		pthread_mutex_destroy(&worker->mutex);
+	}
+	pthread_mutex_destroy(&sched->mutex);
+	free(sched->workers);
+	free(sched);
+}
+
+/* The task's first tick is on the next phase slot, and it's given to the least loaded worker */
+scheduler_task* scheduler_add(scheduler* sched, scheduler_tick_fn tick, void* arg, gint64 period)
+{
+	if(sched == NULL || tick == NULL || period <= 0 || g_atomic_int_get(&sched->stopping))
+		return NULL;
+	scheduler_task* task = calloc(1, sizeof(scheduler_task));
+	if(task == NULL)
+		return NULL;
+	task->tick = tick;
+	task->arg = arg;
+	task->period = period;
+
+	pthread_mutex_lock(&sched->mutex);
+		task->phase = (sched->next_phase++ % SCHEDULER_PHASE_SLOTS) * period / SCHEDULER_PHASE_SLOTS;
+		task->deadline = scheduler_next_deadline(task);
+		scheduler_worker* worker = &sched->workers[0];
+		for(unsigned int i = 1; i < sched->started; i++)
+		{
+			scheduler_worker* candidate = &sched->workers[i];
+			if(candidate->load < worker->load || (candidate->load == worker->load && candidate->task_count < worker->task_count))
+				worker = candidate;
+		}
+		pthread_mutex_lock(&worker->mutex);
+			task->worker = worker;
+			task->next = worker->tasks;
+			worker->tasks = task;
+			worker->task_count++;
+			pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mutex);
+	pthread_mutex_unlock(&sched->mutex);
+	return task;
+}
+
+/* Waits for the task's tick to finish if it's running, the task is freed */
+void scheduler_remove(scheduler* sched, scheduler_task* task)
+{
+	if(sched == NULL || task == NULL)
+		return;
+	//Removed tasks aren't moved between workers, so the scheduler's lock isn't needed while waiting on the tick.
+	//Holding it would block anybody waking up a task while the tick waits on them
+	pthread_mutex_lock(&sched->mutex);
+		scheduler_worker* worker = task->worker;
+		pthread_mutex_lock(&worker->mutex);
+			task->removed = 1;
+	pthread_mutex_unlock(&sched->mutex);
+		while(task->running)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+		scheduler_task** link = &worker->tasks;
+		while(*link != NULL && *link != task)
+			link = &(*link)->next;
+		if(*link != NULL)
+			*link = task->next;
+		worker->task_count--;
+		worker->load -= task->load;
+	pthread_mutex_unlock(&worker->mutex);
+	free(task);
+}
+
+/* Resume a parked task on its next phase slot */
+void scheduler_wake(scheduler* sched, scheduler_task* task)
+{
+	if(sched == NULL || task == NULL)
+		return;
+	pthread_mutex_lock(&sched->mutex);
+		scheduler_worker* worker = task->worker;
+		pthread_mutex_lock(&worker->mutex);
+			if(task->running)
+				task->woken = 1;
+			else if(task->parked && !task->removed)
+			{
+				task->parked = 0;
+				task->deadline = scheduler_next_deadline(task);
+				pthread_cond_signal(&worker->cond);
+			}
+		pthread_mutex_unlock(&worker->mutex);
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+unsigned int scheduler_size(scheduler* sched)
+{
+	return sched ? sched->started : 0;
+}
+
+int scheduler_get_stats(scheduler* sched, scheduler_task* task, scheduler_stats* stats)
+{
+	if(sched == NULL || task == NULL)
+		return 1;
+	pthread_mutex_lock(&sched->mutex);
+		pthread_mutex_lock(&task->worker->mutex);
+			*stats = task->stats;
+		pthread_mutex_unlock(&task->worker->mutex);
+	pthread_mutex_unlock(&sched->mutex);
+	return 0;
+}
+
+static void* scheduler_thread(void* data)
+{
+	scheduler_worker* worker = data;
+	scheduler* sched = worker->scheduler;
+	unsigned int ticks = 0;
+	struct timespec wakeup;
+
+	pthread_mutex_lock(&worker->mutex);
+	while(!g_atomic_int_get(&sched->stopping))
+	{
+		scheduler_task* task = NULL;
+		for(scheduler_task* candidate = worker->tasks; candidate != NULL; candidate = candidate->next)
+		{
+			if(!candidate->parked && !candidate->removed && (task == NULL || candidate->deadline < task->deadline))
+				task = candidate;
+		}
+		if(task == NULL)
+		{
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+			continue;
+		}
+		gint64 start = janus_get_monotonic_time();
+		if(task->deadline > start)
+		{
+			scheduler_timespec(task->deadline, &wakeup);
+			pthread_cond_timedwait(&worker->cond, &worker->mutex, &wakeup);
+			continue;
+		}
+
+		gint64 lateness = start - task->deadline;
+		task->stats.ticks++;
+		if(lateness > SCHEDULER_LATE_THRESHOLD)
+			task->stats.late_ticks++;
+		if(lateness > task->stats.max_lateness)
+			task->stats.max_lateness = lateness;
+		unsigned int skipped = task->skipped;
+		task->skipped = 0;
+
+		task->running = 1;
+		pthread_mutex_unlock(&worker->mutex);
+		int result = task->tick(task->arg, skipped);
+		gint64 end = janus_get_monotonic_time();
+		pthread_mutex_lock(&worker->mutex);
+		task->running = 0;
+		worker->load -= task->load;
+		task->cost += (end - start) - (task->cost >> 3);
+		task->load = task->cost*1000/task->period;
+		worker->load += task->load;
+		task->deadline += task->period;
+		if(end - task->deadline >= SCHEDULER_MAX_CATCHUP*task->period)
+		{
+			//Too far behind to catch up without a burst of ticks, drop the ones we missed and carry on from the next one due
+			gint64 missed = (end - task->deadline)/task->period + 1;
+			task->deadline += missed*task->period;
+			task->skipped += missed;
+			task->stats.skipped_ticks += missed;
+		}
+		if(result == SCHEDULER_PARK && !task->woken)
+			task->parked = 1;
+		task->woken = 0;
+		if(task->removed)
+			pthread_cond_broadcast(&worker->cond);
+
+		if(++ticks % SCHEDULER_REBALANCE_TICKS == 0 && sched->started > 1)
+		{
+			pthread_mutex_unlock(&worker->mutex);
+			scheduler_rebalance(sched);
+			pthread_mutex_lock(&worker->mutex);
+		}
+	}
+	pthread_mutex_unlock(&worker->mutex);
+	return NULL;
+}
+
+/*
+ * Move one task from the busiest worker to the least busy one, if that makes the loads more even
+ * Picks the most expensive task that doesn't just turn the idle worker into the busiest
+ */
+static void scheduler_rebalance(scheduler* sched)
+{
+	pthread_mutex_lock(&sched->mutex);
+		for(unsigned int i = 0; i < sched->started; i++)
+			pthread_mutex_lock(&sched->workers[i].mutex);
+
+		scheduler_worker *busiest = &sched->workers[0], *idlest = &sched->workers[0];
+		for(unsigned int i = 1; i < sched->started; i++)
+		{
+			if(sched->workers[i].load > busiest->load)
+				busiest = &sched->workers[i];
+			if(sched->workers[i].load < idlest->load)
+				idlest = &sched->workers[i];
+		}
+		gint64 difference = busiest->load - idlest->load;
+		scheduler_task* move = NULL;
+		for(scheduler_task* task = busiest->tasks; task != NULL; task = task->next)
+		{
+			if(task->running || task->removed || task->load*2 >= difference)
+				continue;
+			if(move == NULL || task->load > move->load)
+				move = task;
+		}
+		if(move != NULL)
+		{
+			scheduler_task** link = &busiest->tasks;
+			while(*link != move)
+				link = &(*link)->next;
+			*link = move->next;
+			busiest->task_count--;
+			busiest->load -= move->load;
+			move->worker = idlest;
+			move->next = idlest->tasks;
+			idlest->tasks = move;
+			idlest->task_count++;
+			idlest->load += move->load;
+			pthread_cond_signal(&idlest->cond);
+			JANUS_LOG(LOG_DBG, "Moved %s task from thread #%u to #%u\n", sched->name, busiest->index, idlest->index);
+		}
+
+		for(unsigned int i = sched->started; i > 0; i--)
+			pthread_mutex_unlock(&sched->workers[i-1].mutex);
+	pthread_mutex_unlock(&sched->mutex);
+}
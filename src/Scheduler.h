@@ -0,0 +1,72 @@
+#pragma once
+#include <pthread.h>
+#include <glib.h>
+
+#define SCHEDULER_CONTINUE	0
+#define SCHEDULER_PARK		1	//Don't run the task again until scheduler_wake()
+
+#define SCHEDULER_PHASE_SLOTS		10	//Offsets within a task's period that ticks are spread over
+#define SCHEDULER_REBALANCE_TICKS	250	//Ticks a worker runs between checks for a better balanced load
+#define SCHEDULER_LATE_THRESHOLD	2000	//Microseconds past its deadline a tick has to start to count as late
+#define SCHEDULER_MAX_CATCHUP		2	//Periods a task can fall behind and still catch up by running ticks back to back
+
+/* Second argument is the number of ticks skipped since the last one */
+typedef int (*scheduler_tick_fn)(void*, unsigned int);
+
+typedef struct scheduler_stats {
+	guint64 ticks;
+	guint64 late_ticks;
+	guint64 skipped_ticks;
+	gint64 max_lateness; //Microseconds
+} scheduler_stats;
+
+/*
+ * Periodic task, ticked every period on its phase (deadline modulo period)
+ * Fields are owned by the worker the task is on and used with its mutex
+ */
+typedef struct scheduler_task {
+	scheduler_tick_fn tick;
+	void* arg;
+	gint64 period; //Microseconds
+	gint64 deadline; //Monotonic time of the next tick, microseconds
+	gint64 phase;
+	gint64 cost; //Average time a tick takes in microseconds, scaled by 8
+	gint64 load; //Share of a thread the task takes up, cost per millisecond of period
+	unsigned int skipped; //Ticks dropped since the last one ran
+	scheduler_stats stats;
+	struct scheduler_worker* worker;
+	struct scheduler_task* next;
+	unsigned int running : 1;
+	unsigned int parked  : 1;
+	unsigned int woken   : 1; //Woken up while running, so it can't park after this tick
+	unsigned int removed : 1;
+} scheduler_task;
+
+typedef struct scheduler_worker {
+	struct scheduler* scheduler;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; //Monotonic clock. Signalled when the worker's tasks change or a removed task finishes its tick
+	scheduler_task* tasks;
+	unsigned int task_count;
+	gint64 load; //Sum of the tasks' loads
+	unsigned int index;
+} scheduler_worker;
+
+typedef struct scheduler {
+	char name[16];
+	scheduler_worker* workers;
+	unsigned int worker_count;
+	unsigned int started;
+	unsigned int next_phase;
+	gint stopping;
+	pthread_mutex_t mutex; //Adding, removing, waking and moving tasks between workers. Taken before any worker's mutex
+} scheduler;
+
+scheduler*	scheduler_create(const char*, unsigned int);
+void		scheduler_destroy(scheduler*);
+scheduler_task*	scheduler_add(scheduler*, scheduler_tick_fn, void*, gint64);
+void		scheduler_remove(scheduler*, scheduler_task*);
+void		scheduler_wake(scheduler*, scheduler_task*);
+unsigned int	scheduler_size(scheduler*);
+int		scheduler_get_stats(scheduler*, scheduler_task*, scheduler_stats*);
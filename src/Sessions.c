@@ -1,9 +1,12 @@
 #include "Sessions.h"
 #include "StreamLobby.h"
+#include "Audio.h"
+#include "Messaging.h"
 #include <janus/debug.h>
 
 static GHashTable* connected_peers;
 static pthread_mutex_t peer_mutex;
+static gint capture_ids;
 
 int sessions_init()
 {
@@ -65,9 +68,12 @@ void sessions_create_session(janus_plugin_session* handle, int* error)
 	}
 	handle->plugin_handle = dude;
 	uuid_generate(dude->uuid);
+	dude->capture_id = (guint32) g_atomic_int_add(&capture_ids, 1) + 1;
 	snprintf(dude->nick, 64, "Anonymous");
+	dude->audio_level = -1;
 	dude->session = handle;
 	pthread_mutex_init(&dude->mutex, NULL);
+	pthread_cond_init(&dude->decode_cond, NULL);
 	pthread_mutex_lock(&peer_mutex);
 		g_hash_table_insert(connected_peers, dude->uuid, dude);
 	pthread_mutex_unlock(&peer_mutex);
@@ -102,6 +108,8 @@ void sessions_destroy_session(janus_plugin_session* handle, int* error)
 	//TODO - If you're going to use sprintf, escape the characters in the peer's nick
 	snprintf(nick, 64, "%s", dude->nick);
 	pthread_mutex_destroy(&dude->mutex);
+	pthread_cond_destroy(&dude->decode_cond);
+	packet_pool_destroy(&dude->pool);
 	free(dude);
 	handle->plugin_handle = NULL;
 	JANUS_LOG(LOG_INFO, "Session %s (%s) destroyed.\n", id, nick);
@@ -112,7 +120,52 @@ void sessions_destroy_session(janus_plugin_session* handle, int* error)
   {
 	  "uuid": <string>,
 	  "nick": <string>,
-	  "lobby": <string>
+	  "lobby": <string>,
+	  "mixer": {
+		  "ticks": <int>,
+		  "late_ticks": <int>,
+		  "skipped_ticks": <int>,
+		  "max_lateness": <int, microseconds>
+	  },
+	  "recording": {
+		  "frames": <int>,
+		  "dropped": <int, frames lost because the disk fell behind>,
+		  "bytes": <int>
+	  },
+	  "audio": {
+		  "decodes": <int>,
+		  "decodes_skipped": <int>,
+		  "audio_level": <int>,
+		  "speech_energy": <int>,
+		  "mixed": <bool>,
+		  "quality_tier": <int>
+	  },
+	  "link": {
+		  "fraction_lost": <int, percent>,
+		  "cumulative_lost": <int>,
+		  "jitter": <int, microseconds>,
+		  "rtt": <int, microseconds, -1 if unknown>,
+		  "reports": <int>,
+		  "packets_sent": <int>,
+		  "octets_sent": <int>,
+		  "packets_received": <int, from the peer's last sender report>,
+		  "octets_received": <int, from the peer's last sender report>
+	  },
+	  "packet_pool": {
+		  "in_use": <int>,
+		  "allocations": <int>,
+		  "slab_allocations": <int>,
+		  "heap_fallbacks": <int>
+	  },
+	  "commands": {
+		  <request name>: {
+			  "calls": <int>,
+			  "errors": <int>,
+			  "latency": [<int, calls that took under 2^(n+1) microseconds, the last one counts everything slower>, ...]
+		  },
+		  ...,
+		  "unknown": <int, requests for commands that don't exist>
+	  }
   }
 */
 json_t* sessions_query_session(janus_plugin_session* handle)
@@ -132,10 +185,59 @@ json_t* sessions_query_session(janus_plugin_session* handle)
 	json_object_set_new(response, "uuid", json_string(uid));
 	pthread_mutex_lock(&dude->mutex);
 		json_object_set_new(response, "nick", json_string(dude->nick));
-		pthread_mutex_lock(&dude->current_lobby->mutex);
-			json_object_set_new(response, "lobby", json_string(dude->current_lobby->name));
-		pthread_mutex_unlock(&dude->current_lobby->mutex);
+		if(dude->current_lobby != NULL)
+		{
+			pthread_mutex_lock(&dude->current_lobby->mutex);
+				json_object_set_new(response, "lobby", json_string(dude->current_lobby->name));
+			pthread_mutex_unlock(&dude->current_lobby->mutex);
+			scheduler_stats stats;
+			if(audio_get_mixer_stats(dude->current_lobby, &stats) == 0)
+			{
+				json_t* mixer_json = json_object();
+				json_object_set_new(mixer_json, "ticks", json_integer(stats.ticks));
+				json_object_set_new(mixer_json, "late_ticks", json_integer(stats.late_ticks));
+				json_object_set_new(mixer_json, "skipped_ticks", json_integer(stats.skipped_ticks));
+				json_object_set_new(mixer_json, "max_lateness", json_integer(stats.max_lateness));
+				json_object_set_new(response, "mixer", mixer_json);
+			}
+			recorder_stats recording;
+			if(audio_get_recording_stats(dude->current_lobby, &recording) == 0)
+			{
+				json_t* recording_json = json_object();
+				json_object_set_new(recording_json, "frames", json_integer(recording.frames));
+				json_object_set_new(recording_json, "dropped", json_integer(recording.dropped));
+				json_object_set_new(recording_json, "bytes", json_integer(recording.bytes));
+				json_object_set_new(response, "recording", recording_json);
+			}
+		}
+		json_t* audio_json = json_object();
+		json_object_set_new(audio_json, "decodes", json_integer(dude->decodes));
+		json_object_set_new(audio_json, "decodes_skipped", json_integer(dude->decodes_skipped));
+		json_object_set_new(audio_json, "audio_level", json_integer(dude->audio_level));
+		json_object_set_new(audio_json, "speech_energy", json_integer(g_atomic_int_get(&dude->speech_energy)));
+		json_object_set_new(audio_json, "mixed", g_atomic_int_get(&dude->mixed) ? json_true() : json_false());
+		json_object_set_new(audio_json, "quality_tier", json_integer(g_atomic_int_get(&dude->quality_tier)));
+		json_object_set_new(response, "audio", audio_json);
+		json_t* link_json = json_object();
+		json_object_set_new(link_json, "fraction_lost", json_integer(dude->link.fraction_lost));
+		json_object_set_new(link_json, "cumulative_lost", json_integer(dude->link.cumulative_lost));
+		json_object_set_new(link_json, "jitter", json_integer(dude->link.jitter));
+		json_object_set_new(link_json, "rtt", json_integer(dude->link.rtt));
+		json_object_set_new(link_json, "reports", json_integer(dude->link.reports));
+		json_object_set_new(link_json, "packets_sent", json_integer(__atomic_load_n(&dude->link.packets_sent, __ATOMIC_RELAXED)));
+		json_object_set_new(link_json, "octets_sent", json_integer(__atomic_load_n(&dude->link.octets_sent, __ATOMIC_RELAXED)));
+		json_object_set_new(link_json, "packets_received", json_integer(dude->link.sender_packets));
+		json_object_set_new(link_json, "octets_received", json_integer(dude->link.sender_octets));
+		json_object_set_new(response, "link", link_json);
+		json_t* pool_json = json_object();
+		json_object_set_new(pool_json, "in_use", json_integer(dude->pool.in_use));
+		json_object_set_new(pool_json, "allocations", json_integer(dude->pool.allocations));
+		json_object_set_new(pool_json, "slab_allocations", json_integer(dude->pool.slab_allocations));
+		json_object_set_new(pool_json, "heap_fallbacks", json_integer(dude->pool.heap_fallbacks));
+		json_object_set_new(response, "packet_pool", pool_json);
 	pthread_mutex_unlock(&dude->mutex);
+	//Plugin wide, so the admin API can see which commands are busy or slow from any session
+	json_object_set_new(response, "commands", message_get_stats());
 	return response;
 }
 
@@ -8,28 +8,61 @@
 #include <janus/plugins/plugin.h>
 
 #include "Lobbies.h"
+#include "JitterBuffer.h"
+#include "PacketPool.h"
+
+/* Peer's link as seen through RTCP */
+typedef struct link_stats {
+	//From the peer's reports about the lobby's stream
+	unsigned int fraction_lost; //Percent, in the last report
+	int cumulative_lost;
+	unsigned int jitter; //Microseconds
+	gint64 rtt; //Microseconds, -1 until a report refers to one of our sender reports
+	guint64 reports;
+	//From the peer's sender reports about their own stream
+	guint64 sender_ntp;
+	guint32 sender_rtp_timestamp;
+	guint32 sender_packets, sender_octets;
+	//Lobby's stream. Atomic, the mixer and its submix threads count them without locking the peer.
+	//Kept last so resetting the rest doesn't write over them
+	guint64 packets_sent, octets_sent;
+} link_stats;
 
 typedef struct peer {
 	janus_plugin_session* session;
 	uuid_t uuid;
+	guint32 capture_id; //Tells the peer's records apart in traffic captures, set once when the session is created
 	pthread_mutex_t mutex; //Used to access all fields below
 	struct lobby* current_lobby;
 	unsigned int lobby_id;
 	char nick[64];
 	opus_int32 *buffer_head, *buffer_tail, *buffer_start, *buffer_end;
 	int sample_count;
-	struct timeval buffering_start;
-	GList* packets;
-	pthread_mutex_t packets_mutex;
-	pthread_t decoder_thread;
-	uint16_t next_seq_num;
+	gint64 buffering_start;
+	unsigned int playout_delay; //Microseconds
+	jitter_buffer packets;
+	packet_pool pool;
+	pthread_cond_t decode_cond; //Signalled when a decoding task finishes
+	int decode_affinity;
 	int opus_pt;
+	int audio_level_ext_id; //Negotiated id of the ssrc-audio-level extension, 0 if none
+	int audio_level; //Last level the peer sent
+	guint64 decodes, decodes_skipped;
+	gint speech_energy; //Smoothed loudness of the peer's recent packets, atomic
+	gint mixed; //Picked by the mixer as one of the lobby's speakers, atomic
+	gint quality_tier; //Listener quality tier the mixer sends this peer, atomic
+	unsigned int good_reports; //Receiver reports in a row good enough to move up a tier
+	link_stats link;
 	OpusDecoder* decoder;
+	struct lobby* media_lobby; //Lobby whose media_peers count includes this peer
+	int sample_rate, frame_size; //Media lobby's profile, what the peer's audio is decoded for
+	gint comms_ready; //Atomic
 	unsigned int is_admin      : 1;
-	unsigned int comms_ready   : 1;
 	unsigned int receive_audio : 1;
 	unsigned int receive_video : 1;
 	unsigned int finished_buffering : 1;
+	unsigned int decode_scheduled : 1;
+	unsigned int decoder_idle : 1; //Packets were skipped since the last decode
 } peer;
 
 int sessions_init();
@@ -81,16 +81,35 @@ int stream_lobby_init(janus_callbacks* callback, const char* config_path)
 		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error %d initializing sessions", result);
 		return INIT_ERROR_SESSION_CREATION_FAIL;
 	}
+	result = messaging_init();
+	if(result != 0)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error %d initializing messaging", result);
+		sessions_shutdown();
+		lobbies_shutdown();
+		return INIT_ERROR_MEM_ALLOC_FAIL;
+	}
 
 	char filename[255];
 	snprintf(filename, 255, "%s/%s.cfg", config_path, PLUGIN_PACKAGE);
 	result = config_parse_file(filename);
 	if(result != 0)
 	{
+		messaging_shutdown();
 		sessions_shutdown();
 		lobbies_shutdown();
 		return INIT_ERROR_CONFIG_ERROR;
 	}
+	result = audio_init();
+	if(result != 0)
+	{
+		JANUS_LOG(LOG_ERR, "[Stream Lobby] Error %d initializing audio", result);
+		sessions_shutdown();
+		lobbies_shutdown();
+		audio_shutdown();
+		messaging_shutdown();
+		return INIT_ERROR_THREAD_CREATION_FAIL;
+	}
 	
 	stream_lobby_set_initialized(1);
 	return 0;
@@ -105,6 +124,8 @@ void stream_lobby_shutdown(void)
 	
 	sessions_shutdown();
 	lobbies_shutdown();
+	audio_shutdown();
+	messaging_shutdown();
 
 	stream_lobby_set_initialized(0);
 	stream_lobby_set_stopping(0);
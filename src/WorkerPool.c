@@ -0,0 +1,212 @@
+/*
+ * Fixed size pool of worker threads with work stealing
+ *
+ * Every worker has its own queue so submitting tasks from many threads doesn't
+ * funnel through a single lock. Workers that run out of tasks steal from the
+ * other queues before going to sleep.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <janus/debug.h>
+
+#include "WorkerPool.h"
+
+typedef struct worker_args {
+	worker_pool* pool;
+	unsigned int index;
+} worker_args;
+
+static void* worker_thread(void*);
+
+static int worker_queue_push(worker_queue* queue, worker_task_fn fn, void* arg)
+{
+	pthread_mutex_lock(&queue->mutex);
+		if(queue->count == queue->capacity)
+		{
+			//Grow the ring, only happens until the queue has reached its working size
+			unsigned int capacity = queue->capacity ? queue->capacity*2 : 64;
+			worker_task* tasks = malloc(capacity*sizeof(worker_task));
+			if(tasks == NULL)
+			{
+				pthread_mutex_unlock(&queue->mutex);
+				return 1;
+			}
+			for(unsigned int i = 0; i < queue->count; i++)
+				tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+			free(queue->tasks);
+			queue->tasks = tasks;
+			queue->head = 0;
+			queue->capacity = capacity;
+		}
+		worker_task* task = &queue->tasks[(queue->head + queue->count) % queue->capacity];
+		task->fn = fn;
+		task->arg = arg;
+		queue->count++;
+	pthread_mutex_unlock(&queue->mutex);
+	return 0;
+}
+
+static int worker_queue_pop(worker_queue* queue, worker_task* task, int steal)
+{
+	int found = 0;
+	pthread_mutex_lock(&queue->mutex);
+		if(queue->count > 0)
+		{
+			if(steal)
+			{
+				*task = queue->tasks[(queue->head + queue->count - 1) % queue->capacity];
+			}
+			else
+			{
+				*task = queue->tasks[queue->head];
+				queue->head = (queue->head + 1) % queue->capacity;
+			}
+			queue->count--;
+			found = 1;
+		}
+	pthread_mutex_unlock(&queue->mutex);
+	return found;
+}
+
+/* A worker count of 0 sizes the pool to the number of cores */
+worker_pool* worker_pool_create(const char* name, unsigned int workers)
+{
+	if(workers == 0)
+		workers = g_get_num_processors();
+	if(workers == 0)
+		workers = 1;
+
+	worker_pool* pool = calloc(1, sizeof(worker_pool));
+	if(pool == NULL)
+		return NULL;
+	snprintf(pool->name, 16, "%s", name);
+	pool->worker_count = workers;
+	pool->threads = calloc(workers, sizeof(pthread_t));
+	pool->queues = calloc(workers, sizeof(worker_queue));
+	if(pool->threads == NULL || pool->queues == NULL)
+	{
+		free(pool->threads);
+		free(pool->queues);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for(unsigned int i = 0; i < workers; i++)
+		pthread_mutex_init(&pool->queues[i].mutex, NULL);
+
+	for(unsigned int i = 0; i < workers; i++)
+	{
+		worker_args* args = malloc(sizeof(worker_args));
+		if(args == NULL)
+			break;
+		args->pool = pool;
+		args->index = i;
+		int result = pthread_create(&pool->threads[i], NULL, &worker_thread, args);
+		if(result != 0)
+		{
+			JANUS_LOG(LOG_ERR, "[Stream Lobby] Couldn't create %s worker thread #%u (error %d)\n", pool->name, i, result);
+			free(args);
+			break;
+		}
+		pool->started++;
+	}
+	if(pool->started == 0)
+	{
+		worker_pool_destroy(pool);
+		return NULL;
+	}
+	JANUS_LOG(LOG_INFO, "Started %u %s worker threads\n", pool->started, pool->name);
+	return pool;
+}
+
+/* Stops the workers once the queued tasks have been run */
+void worker_pool_destroy(worker_pool* pool)
+{
+	if(pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+		g_atomic_int_set(&pool->stopping, 1);
+		pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for(unsigned int i = 0; i < pool->started; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	for(unsigned int i = 0; i < pool->worker_count; i++)
+	{
+		pthread_mutex_destroy(&pool->queues[i].mutex);
+		free(pool->queues[i].tasks);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->queues);
+	free(pool->threads);
+	free(pool);
+}
+
+/*
+ * Queue a task. Tasks with the same (non-negative) affinity go to the same worker's queue,
+ * which keeps their data warm in that worker's cache unless somebody has to steal it
+ */
+int worker_pool_submit(worker_pool* pool, worker_task_fn fn, void* arg, int affinity)
+{
+	if(pool == NULL || fn == NULL || g_atomic_int_get(&pool->stopping))
+		return 1;
+	unsigned int index;
+	if(affinity >= 0)
+		index = affinity % pool->started;
+	else
+		index = (unsigned int)g_atomic_int_add(&pool->next_queue, 1) % pool->started;
+	g_atomic_int_inc(&pool->pending);
+	if(worker_queue_push(&pool->queues[index], fn, arg) != 0)
+	{
+		g_atomic_int_add(&pool->pending, -1);
+		return 2;
+	}
+	//Only bother with the lock if somebody is actually asleep
+	if(g_atomic_int_get(&pool->sleepers) > 0)
+	{
+		pthread_mutex_lock(&pool->mutex);
+			pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+	return 0;
+}
+
+unsigned int worker_pool_size(worker_pool* pool)
+{
+	return pool ? pool->started : 0;
+}
+
+static void* worker_thread(void* data)
+{
+	worker_args* args = data;
+	worker_pool* pool = args->pool;
+	unsigned int index = args->index;
+	free(args);
+
+	worker_task task;
+	while(1)
+	{
+		int found = worker_queue_pop(&pool->queues[index], &task, 0);
+		for(unsigned int i = 1; !found && i < pool->started; i++)
+			found = worker_queue_pop(&pool->queues[(index + i) % pool->started], &task, 1);
+		if(found)
+		{
+			g_atomic_int_add(&pool->pending, -1);
+			task.fn(task.arg);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+			g_atomic_int_inc(&pool->sleepers);
+			while(g_atomic_int_get(&pool->pending) == 0 && !g_atomic_int_get(&pool->stopping))
+				pthread_cond_wait(&pool->cond, &pool->mutex);
+			g_atomic_int_add(&pool->sleepers, -1);
+		pthread_mutex_unlock(&pool->mutex);
+		if(g_atomic_int_get(&pool->stopping) && g_atomic_int_get(&pool->pending) == 0)
+			break;
+	}
+	return NULL;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <pthread.h>
+#include <glib.h>
+
+typedef void (*worker_task_fn)(void*);
+
+typedef struct worker_task {
+	worker_task_fn fn;
+	void* arg;
+} worker_task;
+
+/* Per-worker task queue. The owner takes tasks from the head, idle workers steal from the tail */
+typedef struct worker_queue {
+	pthread_mutex_t mutex;
+	worker_task* tasks; //ring
+	unsigned int head, count, capacity;
+} worker_queue;
+
+typedef struct worker_pool {
+	char name[16];
+	pthread_t* threads;
+	worker_queue* queues;
+	unsigned int worker_count;
+	unsigned int started;
+	gint pending; //Queued tasks over all queues
+	gint sleepers;
+	gint next_queue;
+	gint stopping;
+	pthread_mutex_t mutex; //Idle workers sleep on cond
+	pthread_cond_t cond;
+} worker_pool;
+
+worker_pool*	worker_pool_create(const char*, unsigned int);
+void		worker_pool_destroy(worker_pool*);
+int		worker_pool_submit(worker_pool*, worker_task_fn, void*, int);
+unsigned int	worker_pool_size(worker_pool*);
@@ -0,0 +1,119 @@
+/*
+ * Mixing kernel microbenchmark
+ *
+ * Mixes one 20ms frame from 1, 8, 64 and 512 peer rings (reading across the ring's
+ * wraparound, like the mixer does) with each kernel the CPU supports, and reports
+ * input samples mixed per nanosecond. Every kernel's output is checked against the
+ * scalar one first.
+ *
+ * make mixbench && ./mixbench [seconds per run]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/Mixer.h"
+
+#define FRAME		960
+#define RING		(FRAME*20)
+#define MAX_INPUTS	512
+
+typedef struct kernel {
+	const char* name;
+	mixer_add_fn add;
+	mixer_saturate_fn saturate;
+	int supported;
+} kernel;
+
+static int32_t* rings[MAX_INPUTS];
+static int tails[MAX_INPUTS];
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void mix(kernel* k, int inputs, int32_t* bus, int16_t* out)
+{
+	memset(bus, 0, FRAME*sizeof(int32_t));
+	for(int i = 0; i < inputs; i++)
+	{
+		const int32_t* tail = rings[i] + tails[i];
+		int first = RING - tails[i] < FRAME ? RING - tails[i] : FRAME;
+		k->add(bus, tail, first);
+		if(first < FRAME)
+			k->add(bus + first, rings[i], FRAME - first);
+	}
+	k->saturate(out, bus, FRAME);
+}
+
+int main(int argc, char** argv)
+{
+	double duration = argc > 1 ? atof(argv[1]) : 0.5;
+	kernel kernels[] = {
+		{"scalar", &mixer_add_scalar, &mixer_saturate_scalar, 1},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", &mixer_add_sse2, &mixer_saturate_sse2, __builtin_cpu_supports("sse2")},
+		{"avx2", &mixer_add_avx2, &mixer_saturate_avx2, __builtin_cpu_supports("avx2")},
+#endif
+	};
+	int kernel_count = sizeof(kernels)/sizeof(kernel);
+	int input_counts[] = {1, 8, 64, 512};
+
+	//Loud enough that a handful of inputs clip
+	srand(1);
+	for(int i = 0; i < MAX_INPUTS; i++)
+	{
+		rings[i] = malloc(RING*sizeof(int32_t));
+		if(rings[i] == NULL)
+			return 1;
+		for(int j = 0; j < RING; j++)
+			rings[i][j] = (rand() % 65536) - 32768;
+		//Some reads wrap around the end of the ring
+		tails[i] = i % 2 ? RING - (rand() % FRAME) : rand() % (RING - FRAME);
+	}
+	int32_t bus[FRAME];
+	int16_t out[FRAME], expected[FRAME];
+
+	mixer_init();
+	printf("Selected kernel: %s\n", mixer_kernel_name());
+	printf("%-8s %8s %14s %12s\n", "kernel", "inputs", "samples/ns", "ns/frame");
+	for(int n = 0; n < sizeof(input_counts)/sizeof(int); n++)
+	{
+		int inputs = input_counts[n];
+		mix(&kernels[0], inputs, bus, expected);
+		for(int k = 0; k < kernel_count; k++)
+		{
+			if(!kernels[k].supported)
+			{
+				printf("%-8s %8d %14s\n", kernels[k].name, inputs, "unsupported");
+				continue;
+			}
+			mix(&kernels[k], inputs, bus, out);
+			if(memcmp(out, expected, sizeof(out)) != 0)
+			{
+				printf("%-8s %8d %14s\n", kernels[k].name, inputs, "MISMATCH");
+				return 1;
+			}
+			long frames = 0;
+			double start = now(), elapsed;
+			do
+			{
+				for(int i = 0; i < 64; i++)
+					mix(&kernels[k], inputs, bus, out);
+				frames += 64;
+				elapsed = now() - start;
+			} while(elapsed < duration);
+			double ns = elapsed*1e9;
+			printf("%-8s %8d %14.3f %12.1f\n", kernels[k].name, inputs, (double) frames*inputs*FRAME/ns, ns/frames);
+		}
+	}
+	for(int i = 0; i < MAX_INPUTS; i++)
+		free(rings[i]);
+	return 0;
+}
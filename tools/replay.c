@@ -0,0 +1,525 @@
+/*
+ * Traffic capture replay
+ *
+ * Feeds captures made with the plugin's capture_file setting back through the plugin,
+ * the way Janus would: sessions are created, join their lobby, negotiate the payload type
+ * and audio level extension they had, and get their RTP handed to incoming_rtp. Packets go
+ * in at the pace they were captured at, or with -f as fast as the plugin takes them.
+ *
+ * The plugin is linked in directly and runs against the stub Janus core below, which only
+ * has what the plugin uses. Outgoing packets are counted and thrown away. Lobbies are made
+ * up from the ones named in the capture, with audio on and room for everybody that joined
+ * them. Any plugin setting, global or lobby, can be given with -o and applies to all of them.
+ *
+ * Lobbies' mixers tick on the wall clock either way, so -f measures how fast packets can be
+ * taken in and decoded while paced runs measure the whole path, mixer lateness included.
+ * Sessions whose media started before the capture did can't be replayed, their packets are
+ * counted as unmatched.
+ *
+ * make replay && ./replay [-f] [-v] [-o setting=value]... <capture> [next capture file]...
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <glib.h>
+#include <jansson.h>
+
+#include <janus/plugins/plugin.h>
+#include <janus/apierror.h>
+#include <janus/config.h>
+#include <janus/debug.h>
+#include <janus/rtp.h>
+#include <janus/utils.h>
+
+#include "../src/Audio.h"
+#include "../src/Lobbies.h"
+#include "../src/Recording.h"
+#include "../src/Scheduler.h"
+
+janus_plugin* create(void);
+
+typedef struct replay_session {
+	janus_plugin_session* handle;
+	int media;
+} replay_session;
+
+typedef struct replay_reader {
+	char** files;
+	int count, current;
+	FILE* file;
+} replay_reader;
+
+static GHashTable* lobby_sizes; //Lobby name to the number of sessions that joined it
+static GSList* settings; //"setting=value" from the command line
+static GSList* config_items;
+static gint relayed_rtp, relayed_rtcp, pushed_events;
+static gint64 relayed_bytes;
+
+
+
+//Stub Janus core. Logging, clocks, SDP and RTP helpers, and a config made up from the capture and the command line
+
+int janus_log_level = LOG_WARN;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+char* janus_log_global_prefix = NULL;
+
+void janus_vprintf(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+gint64 janus_get_monotonic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec*G_GINT64_CONSTANT(1000000)) + (ts.tv_nsec/G_GINT64_CONSTANT(1000));
+}
+
+gint64 janus_get_real_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec*G_GINT64_CONSTANT(1000000)) + (ts.tv_nsec/G_GINT64_CONSTANT(1000));
+}
+
+/* Works on the SDP as it is and as the plugin gets it, a JSON dump with its line breaks escaped */
+int janus_get_codec_pt(const char* sdp, const char* codec)
+{
+	if(sdp == NULL || codec == NULL)
+		return -1;
+	const char* line = sdp;
+	size_t length = strlen(codec);
+	while((line = strstr(line, "a=rtpmap:")) != NULL)
+	{
+		char* name;
+		line += strlen("a=rtpmap:");
+		int pt = strtol(line, &name, 10);
+		while(*name == ' ')
+			name++;
+		if(strncasecmp(name, codec, length) == 0 && name[length] == '/')
+			return pt;
+	}
+	return -1;
+}
+
+int janus_rtp_header_extension_get_id(const char* sdp, const char* extension)
+{
+	if(sdp == NULL || extension == NULL)
+		return -1;
+	const char* line = sdp;
+	while((line = strstr(line, "a=extmap:")) != NULL)
+	{
+		char* uri;
+		line += strlen("a=extmap:");
+		int id = strtol(line, &uri, 10);
+		//Skip the direction, if there is one
+		while(*uri != ' ' && *uri != '\0')
+			uri++;
+		while(*uri == ' ')
+			uri++;
+		if(strncmp(uri, extension, strlen(extension)) == 0)
+			return id;
+	}
+	return -1;
+}
+
+char* janus_rtp_payload(char* buf, int len, int* plen)
+{
+	if(buf == NULL || len < RTP_HEADER_SIZE)
+		return NULL;
+	unsigned char* data = (unsigned char*) buf;
+	if((data[0] >> 6) != 2)
+		return NULL;
+	int header = RTP_HEADER_SIZE + (data[0] & 0x0F)*4;
+	if(data[0] & 0x10)
+	{
+		if(len < header + 4)
+			return NULL;
+		header += 4 + ((data[header+2] << 8) | data[header+3])*4;
+	}
+	int padding = (data[0] & 0x20) ? data[len-1] : 0;
+	if(header + padding > len)
+		return NULL;
+	if(plen)
+		*plen = len - header - padding;
+	return buf + header;
+}
+
+janus_plugin_result* janus_plugin_result_new(janus_plugin_result_type type, const char* text, json_t* content)
+{
+	janus_plugin_result* result = g_malloc(sizeof(janus_plugin_result));
+	result->type = type;
+	result->text = text;
+	result->content = content;
+	return result;
+}
+
+void janus_plugin_result_destroy(janus_plugin_result* result)
+{
+	if(result == NULL)
+		return;
+	if(result->content)
+		json_decref(result->content);
+	g_free(result);
+}
+
+janus_config* janus_config_parse(const char* config_file)
+{
+	return g_malloc0(sizeof(janus_config));
+}
+
+void janus_config_print(janus_config* config)
+{
+}
+
+static janus_config_item* replay_config_item(janus_config_type type, const char* name, const char* value)
+{
+	janus_config_item* item = g_malloc0(sizeof(janus_config_item));
+	item->type = type;
+	item->name = g_strdup(name);
+	item->value = g_strdup(value);
+	config_items = g_slist_prepend(config_items, item);
+	return item;
+}
+
+GList* janus_config_get_categories(janus_config* config, janus_config_container* parent)
+{
+	GList* categories = NULL;
+	GHashTableIter iter;
+	gpointer name;
+	g_hash_table_iter_init(&iter, lobby_sizes);
+	while(g_hash_table_iter_next(&iter, &name, NULL))
+		categories = g_list_append(categories, replay_config_item(janus_config_type_category, name, NULL));
+	return categories;
+}
+
+/* Settings from the command line win, lobbies otherwise get audio and room for everybody that joined them */
+void* janus_config_get(janus_config* config, janus_config_container* parent, janus_config_type type, const char* name)
+{
+	size_t length = strlen(name);
+	for(GSList* setting = settings; setting != NULL; setting = setting->next)
+	{
+		const char* text = setting->data;
+		if(strncmp(text, name, length) == 0 && text[length] == '=')
+			return replay_config_item(janus_config_type_item, name, text + length + 1);
+	}
+	if(parent == NULL)
+		return NULL;
+	char value[32];
+	if(strcmp(name, "enable_audio") == 0)
+		return replay_config_item(janus_config_type_item, name, "1");
+	if(strcmp(name, "max_clients") == 0)
+	{
+		unsigned int sessions = GPOINTER_TO_UINT(g_hash_table_lookup(lobby_sizes, parent->name));
+		snprintf(value, sizeof(value), "%u", sessions + sessions/4 + 1);
+		return replay_config_item(janus_config_type_item, name, value);
+	}
+	return NULL;
+}
+
+void janus_config_destroy(janus_config* config)
+{
+	for(GSList* item = config_items; item != NULL; item = item->next)
+	{
+		janus_config_item* config_item = item->data;
+		g_free((char*) config_item->name);
+		g_free((char*) config_item->value);
+		g_free(config_item);
+	}
+	g_slist_free(config_items);
+	config_items = NULL;
+	g_free(config);
+}
+
+
+
+//Stub Janus callbacks, everything the plugin sends is counted and dropped
+
+static int replay_push_event(janus_plugin_session* handle, janus_plugin* plugin, const char* transaction, json_t* message, json_t* jsep)
+{
+	g_atomic_int_inc(&pushed_events);
+	return JANUS_OK;
+}
+
+static void replay_relay_rtp(janus_plugin_session* handle, int video, char* buf, int len)
+{
+	g_atomic_int_inc(&relayed_rtp);
+	__atomic_fetch_add(&relayed_bytes, len, __ATOMIC_RELAXED);
+}
+
+static void replay_relay_rtcp(janus_plugin_session* handle, int video, char* buf, int len)
+{
+	g_atomic_int_inc(&relayed_rtcp);
+}
+
+static janus_callbacks replay_callbacks = {
+	.push_event = replay_push_event,
+	.relay_rtp = replay_relay_rtp,
+	.relay_rtcp = replay_relay_rtcp,
+};
+
+
+
+/* Next record over all the capture's files, 0 at the end */
+static int replay_read(replay_reader* reader, capture_record* record, unsigned char* data)
+{
+	for(;;)
+	{
+		if(reader->file == NULL)
+		{
+			if(reader->current >= reader->count)
+				return 0;
+			const char* filename = reader->files[reader->current++];
+			reader->file = fopen(filename, "rb");
+			capture_header header;
+			if(reader->file == NULL || fread(&header, 1, sizeof(header), reader->file) != sizeof(header)
+				|| memcmp(header.magic, "SLCP", 4) != 0 || header.version != 1)
+			{
+				fprintf(stderr, "Skipping %s, not a capture\n", filename);
+				if(reader->file != NULL)
+					fclose(reader->file);
+				reader->file = NULL;
+				continue;
+			}
+		}
+		if(fread(record, 1, sizeof(capture_record), reader->file) == sizeof(capture_record)
+			&& fread(data, 1, record->length, reader->file) == record->length)
+			return 1;
+		fclose(reader->file);
+		reader->file = NULL;
+	}
+}
+
+static replay_session* replay_get_session(janus_plugin* plugin, GHashTable* sessions, guint32 id)
+{
+	replay_session* session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(id));
+	if(session != NULL)
+		return session;
+	session = g_malloc0(sizeof(replay_session));
+	session->handle = g_malloc0(sizeof(janus_plugin_session));
+	int error = 0;
+	plugin->create_session(session->handle, &error);
+	if(error != 0)
+	{
+		fprintf(stderr, "Couldn't create session %u (error %d)\n", id, error);
+		g_free(session->handle);
+		g_free(session);
+		return NULL;
+	}
+	g_hash_table_insert(sessions, GUINT_TO_POINTER(id), session);
+	return session;
+}
+
+/* Join the lobby and negotiate like the peer did, then start their media */
+static void replay_start_media(janus_plugin* plugin, replay_session* session, const unsigned char* data, int length)
+{
+	if(length < 2)
+		return;
+	if(session->media)
+		plugin->hangup_media(session->handle);
+	session->media = 0;
+	char lobby_name[256], sdp[512];
+	snprintf(lobby_name, sizeof(lobby_name), "%.*s", length - 2, data + 2);
+
+	json_t* message = json_pack("{ssss}", "request", "join_room", "room", lobby_name);
+	janus_plugin_result_destroy(plugin->handle_message(session->handle, NULL, message, NULL));
+	int offset = snprintf(sdp, sizeof(sdp), "v=0\r\no=- 0 0 IN IP4 127.0.0.1\r\ns=replay\r\nt=0 0\r\n"
+		"m=audio 9 UDP/TLS/RTP/SAVPF %u\r\na=rtpmap:%u opus/48000/2\r\n", data[0], data[0]);
+	if(data[1] > 0)
+		offset += snprintf(sdp + offset, sizeof(sdp) - offset, "a=extmap:%u %s\r\n", data[1], JANUS_RTP_EXTMAP_AUDIO_LEVEL);
+	snprintf(sdp + offset, sizeof(sdp) - offset, "a=sendonly\r\n");
+	message = json_pack("{ss}", "request", "sdp_pass");
+	json_t* jsep = json_pack("{ssss}", "type", "offer", "sdp", sdp);
+	janus_plugin_result_destroy(plugin->handle_message(session->handle, NULL, message, jsep));
+	json_decref(jsep);
+
+	plugin->setup_media(session->handle);
+	session->media = 1;
+}
+
+static void replay_sleep_until(gint64 time)
+{
+	gint64 now = janus_get_monotonic_time();
+	if(time <= now)
+		return;
+	struct timespec ts;
+	ts.tv_sec = (time - now) / G_USEC_PER_SEC;
+	ts.tv_nsec = ((time - now) % G_USEC_PER_SEC) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static double replay_cpu_time(struct timeval* tv)
+{
+	return tv->tv_sec + tv->tv_usec/1e6;
+}
+
+int main(int argc, char** argv)
+{
+	int fast = 0, option;
+	while((option = getopt(argc, argv, "fvo:")) != -1)
+	{
+		switch(option)
+		{
+			case 'f':
+				fast = 1;
+			break;
+			case 'v':
+				janus_log_level = LOG_INFO;
+			break;
+			case 'o':
+				if(strchr(optarg, '=') == NULL)
+				{
+					fprintf(stderr, "Settings are given as setting=value\n");
+					return 1;
+				}
+				settings = g_slist_append(settings, optarg);
+			break;
+			default:
+				fprintf(stderr, "Usage: %s [-f] [-v] [-o setting=value]... <capture> [next capture file]...\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind >= argc)
+	{
+		fprintf(stderr, "Usage: %s [-f] [-v] [-o setting=value]... <capture> [next capture file]...\n", argv[0]);
+		return 1;
+	}
+
+	//First pass finds the lobbies and how many joined each, so they can be set up before the plugin starts
+	unsigned char* data = malloc(65536);
+	capture_record record;
+	replay_reader reader = {argv + optind, argc - optind, 0, NULL};
+	GHashTable* session_lobbies = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	lobby_sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	guint64 records = 0;
+	gint64 first_time = 0, last_time = 0;
+	while(replay_read(&reader, &record, data))
+	{
+		if(records++ == 0)
+			first_time = record.time;
+		last_time = record.time;
+		if(record.kind == CAPTURE_MEDIA && record.length > 2)
+			g_hash_table_insert(session_lobbies, GUINT_TO_POINTER(record.session), g_strndup((char*) data + 2, record.length - 2));
+	}
+	GHashTableIter iter;
+	gpointer name;
+	g_hash_table_iter_init(&iter, session_lobbies);
+	while(g_hash_table_iter_next(&iter, NULL, &name))
+	{
+		unsigned int sessions = GPOINTER_TO_UINT(g_hash_table_lookup(lobby_sizes, name));
+		g_hash_table_insert(lobby_sizes, g_strdup(name), GUINT_TO_POINTER(sessions + 1));
+	}
+	if(records == 0 || g_hash_table_size(lobby_sizes) == 0)
+	{
+		fprintf(stderr, "Nothing to replay\n");
+		return 1;
+	}
+	printf("%"G_GUINT64_FORMAT" records, %u sessions in %u lobbies, %.2fs long\n", records, g_hash_table_size(session_lobbies),
+		g_hash_table_size(lobby_sizes), (last_time - first_time)/1e6);
+
+	janus_plugin* plugin = create();
+	//The stub config doesn't read anything, the plugin just needs a path
+	if(plugin->init(&replay_callbacks, ".") != 0)
+	{
+		fprintf(stderr, "Couldn't start the plugin\n");
+		return 1;
+	}
+
+	GHashTable* sessions = g_hash_table_new(g_direct_hash, g_direct_equal);
+	guint64 packets = 0, unmatched = 0;
+	struct rusage usage_start, usage_end;
+	getrusage(RUSAGE_SELF, &usage_start);
+	gint64 start = janus_get_monotonic_time();
+	reader.current = 0;
+	while(replay_read(&reader, &record, data))
+	{
+		if(!fast)
+			replay_sleep_until(start + (record.time - first_time));
+		replay_session* session;
+		switch(record.kind)
+		{
+			case CAPTURE_MEDIA:
+				session = replay_get_session(plugin, sessions, record.session);
+				if(session != NULL)
+					replay_start_media(plugin, session, data, record.length);
+			break;
+			case CAPTURE_HANGUP:
+				session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(record.session));
+				if(session != NULL && session->media)
+				{
+					plugin->hangup_media(session->handle);
+					session->media = 0;
+				}
+			break;
+			case CAPTURE_RTP:
+				session = g_hash_table_lookup(sessions, GUINT_TO_POINTER(record.session));
+				if(session == NULL || !session->media)
+				{
+					unmatched++;
+					break;
+				}
+				plugin->incoming_rtp(session->handle, 0, (char*) data, record.length);
+				packets++;
+			break;
+		}
+	}
+	gint64 end = janus_get_monotonic_time();
+	getrusage(RUSAGE_SELF, &usage_end);
+	//Let the mixers catch up with the last packets before the lobbies' stats are taken
+	replay_sleep_until(janus_get_monotonic_time() + 200000);
+
+	double elapsed = (end - start)/1e6, captured = (last_time - first_time)/1e6;
+	double user = replay_cpu_time(&usage_end.ru_utime) - replay_cpu_time(&usage_start.ru_utime);
+	double system = replay_cpu_time(&usage_end.ru_stime) - replay_cpu_time(&usage_start.ru_stime);
+	printf("Replayed %"G_GUINT64_FORMAT" packets in %.2fs, %.2fx real time, %.0f packets/s\n", packets, elapsed,
+		elapsed > 0 ? captured/elapsed : 0, elapsed > 0 ? packets/elapsed : 0);
+	printf("CPU: %.2fs user, %.2fs system\n", user, system);
+	printf("Relayed %d RTP packets (%"G_GINT64_FORMAT" bytes), %d RTCP packets, %d events\n", g_atomic_int_get(&relayed_rtp),
+		__atomic_load_n(&relayed_bytes, __ATOMIC_RELAXED), g_atomic_int_get(&relayed_rtcp), g_atomic_int_get(&pushed_events));
+	if(unmatched > 0)
+		printf("%"G_GUINT64_FORMAT" packets from sessions whose media started before the capture\n", unmatched);
+	g_hash_table_iter_init(&iter, lobby_sizes);
+	while(g_hash_table_iter_next(&iter, &name, NULL))
+	{
+		scheduler_stats stats;
+		lobby* room = lobbies_get_lobby(name);
+		if(room != NULL && audio_get_mixer_stats(room, &stats) == 0)
+			printf("%s: %"G_GUINT64_FORMAT" ticks, %"G_GUINT64_FORMAT" late, %"G_GUINT64_FORMAT" skipped, %"G_GINT64_FORMAT"us latest\n",
+				(char*) name, stats.ticks, stats.late_ticks, stats.skipped_ticks, stats.max_lateness);
+	}
+
+	g_hash_table_iter_init(&iter, sessions);
+	gpointer value;
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		replay_session* session = value;
+		if(session->media)
+			plugin->hangup_media(session->handle);
+		int error = 0;
+		plugin->destroy_session(session->handle, &error);
+	}
+	plugin->destroy();
+	g_hash_table_iter_init(&iter, sessions);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		replay_session* session = value;
+		g_free(session->handle);
+		g_free(session);
+	}
+	g_hash_table_destroy(sessions);
+	g_hash_table_destroy(session_lobbies);
+	g_hash_table_destroy(lobby_sizes);
+	free(data);
+	return 0;
+}